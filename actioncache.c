@@ -0,0 +1,580 @@
+#include "actioncache.h"
+#include "hash.h"
+#include "watch.h"
+#include "arena.h"
+#include "isolation.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+// Bumped whenever the way keys are computed changes:
+#define ACTIONCACHE_KEY_VERSION 1
+
+typedef struct {
+    Pipeline * pipeline;
+    char ** outputs;        // Full paths, skipped while hashing inputs
+    uint64_t sum;
+    int files;
+    int error;
+} ActionInputs;
+
+static uint64_t action_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+static int is_output(char ** outputs, char const * path) {
+
+    for (char ** output = outputs; output && *output; ++output) {
+        int len = strlen(*output);
+        if (strncmp(path, *output, len) == 0 && (path[len] == '\0' || path[len] == '/')) return 1;
+    }
+    return 0;
+}
+
+// Full paths of the pipeline's outputs, in the scratch arena.
+static char ** output_paths(Pipeline * pipeline) {
+
+    int count = 0;
+    while (pipeline->outputs && pipeline->outputs[count]) ++count;
+
+    Ctx saved = scratch_begin();
+    char ** paths = ALLOC(sizeof(char *) * (count + 1));
+    for (int i = 0; paths != NULL && i < count; ++i) {
+        paths[i] = join_path(pipeline->workdir, pipeline->outputs[i]);
+        if (paths[i] == NULL) paths = NULL;
+    }
+    if (paths != NULL) paths[count] = NULL;
+    ctx_restore(saved);
+
+    return paths;
+}
+
+// Content hash of one input file. Hashing every input on every run would
+// defeat the point, so results are memoised under the file's metadata and only
+// files whose inode, size or timestamps moved are read again.
+static int input_hash(ActionInputs * inputs, char const * path, struct stat const * st, uint64_t * result) {
+
+    uint64_t meta[4] = {
+        st->st_ino,
+        st->st_size,
+        (uint64_t) st->st_mtim.tv_sec * 1000000000ull + st->st_mtim.tv_nsec,
+        (uint64_t) st->st_ctim.tv_sec * 1000000000ull + st->st_ctim.tv_nsec
+    };
+    uint64_t key = hash_bytes(meta, sizeof(meta), hash_str(path));
+
+    HashCache * memo = &inputs->pipeline->inputs;
+    if (hashcache_get(memo, key, result)) return 0;
+
+    if (hash_file(path, result) < 0) return -1;
+    hashcache_put(memo, key, *result);
+    return 0;
+}
+
+// Adds everything at and below path that the pipeline would react to. Entries
+// are summed so that directory listing order doesn't matter.
+static void input_walk(ActionInputs * inputs, char * path, int len, int root) {
+
+    Pipeline * pipeline = inputs->pipeline;
+
+    struct stat st;
+    if (lstat(path, &st) < 0 || is_output(inputs->outputs, path)) return;
+
+    uint64_t content;
+
+    if (S_ISREG(st.st_mode)) {
+
+        if (!filter_match(&pipeline->filter, path)) return;
+        if (input_hash(inputs, path, &st, &content) < 0) {
+            inputs->error = 1;
+            return;
+        }
+
+    } else if (S_ISLNK(st.st_mode)) {
+
+        if (!filter_match(&pipeline->filter, path)) return;
+        char target[PATH_MAX];
+        ssize_t target_len = readlink(path, target, sizeof(target));
+        if (target_len < 0) return;
+        content = hash_bytes(target, target_len, 1);
+
+    } else if (S_ISDIR(st.st_mode)) {
+
+        if (!root && (!pipeline->recursive || filter_excludes_dir(&pipeline->filter, path))) return;
+
+        DIR * dir = opendir(path);
+        if (dir == NULL) return;
+
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL) {
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            int name_len = strlen(entry->d_name);
+            if (len + name_len + 2 > PATH_MAX) continue;
+
+            path[len] = '/';
+            memcpy(path + len + 1, entry->d_name, name_len + 1);
+            input_walk(inputs, path, len + name_len + 1, 0);
+            path[len] = '\0';
+        }
+
+        closedir(dir);
+        return;
+
+    } else {
+        return;
+    }
+
+    // Executable bits are part of the content as far as a build is concerned:
+    uint64_t entry[2] = { content, st.st_mode & 0111 };
+    inputs->sum += action_mix(hash_bytes(entry, sizeof(entry), hash_str(path)));
+    ++inputs->files;
+}
+
+static int action_key(Pipeline * pipeline, uint64_t * key) {
+
+    ActionInputs inputs = { .pipeline = pipeline };
+    inputs.outputs = output_paths(pipeline);
+    if (inputs.outputs == NULL) return -1;
+
+    char path[PATH_MAX];
+    for (char ** watch_path = pipeline->watch_paths; watch_path && *watch_path; ++watch_path) {
+
+        char * full_path = scratch_join_path(pipeline->workdir, *watch_path);
+        if (full_path == NULL) continue;
+
+        int len = strlen(full_path);
+        if (len < PATH_MAX) {
+            memcpy(path, full_path, len + 1);
+            input_walk(&inputs, path, len, 1);
+        }
+    }
+
+    if (inputs.error) return -1;
+
+    // Drop memoised hashes of files that no longer exist once they dominate:
+    if (pipeline->inputs.count > (uint32_t) inputs.files * 4 + 1024) {
+        hashcache_clear(&pipeline->inputs);
+    }
+    hashcache_save(&pipeline->inputs);
+
+    // The prepared argv and environment cover the command, how it's run and
+    // every variable it sees apart from the per-run ones. A resource class
+    // doesn't change what the command produces, so it's left out:
+    uint64_t h = hash_str(pipeline->cmd) ^ ACTIONCACHE_KEY_VERSION;
+    h = hash_bytes(pipeline->workdir, pipeline->workdir ? strlen(pipeline->workdir) : 0, h);
+    for (char * const * arg = isolation_unwrap(pipeline->argv); arg && *arg; ++arg) h = hash_bytes(*arg, strlen(*arg) + 1, h);
+    for (int i = 0; i < pipeline->envp_count; ++i) {
+        h = hash_bytes(pipeline->envp[i], strlen(pipeline->envp[i]) + 1, h);
+    }
+
+    uint64_t parts[3] = { h, inputs.sum, inputs.files };
+    *key = hash_bytes(parts, sizeof(parts), 0);
+    return 0;
+}
+
+// Returns the path of a file in one of the cache's directories below the
+// state directory, creating the directory if needed. The path is in the
+// scratch arena.
+static char * cache_path(char const * dir, uint64_t hash) {
+
+    Ctx saved = scratch_begin();
+    char * path = NULL;
+
+    char * dir_path = state_path(dir, "");
+    if (dir_path != NULL && (mkdir(dir_path, 0755) == 0 || errno == EEXIST)) {
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long) hash);
+        path = join_path(dir_path, name);
+    }
+
+    ctx_restore(saved);
+    return path;
+}
+
+// Copies src to a new file at dst, sharing extents with a reflink where the
+// filesystem supports it. With reflink_only, fails rather than copy the data.
+static int copy_file(char const * src, char const * dst, mode_t mode, int reflink_only) {
+
+    int res = -1;
+    int out = -1;
+
+    int in = open(src, O_RDONLY | O_CLOEXEC);
+    if (in < 0) goto exit;
+
+    out = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out < 0) goto exit;
+
+    if (ioctl(out, FICLONE, in) == 0) {
+        res = fchmod(out, mode);
+        goto exit;
+    }
+    if (reflink_only) goto exit;
+
+    ssize_t n;
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 30, 0)) > 0);
+    if (n == 0) {
+        res = fchmod(out, mode);
+        goto exit;
+    }
+
+    // copy_file_range() can't cross every pair of filesystems:
+    if (lseek(in, 0, SEEK_SET) < 0 || lseek(out, 0, SEEK_SET) < 0 || ftruncate(out, 0) < 0) goto exit;
+
+    char buf[65536];
+    while ((n = read(in, buf, sizeof(buf))) > 0) {
+        if (write_all(out, buf, n) < 0) goto exit;
+    }
+    res = n == 0 ? fchmod(out, mode) : -1;
+
+exit:
+    if (in >= 0) close(in);
+    if (out >= 0) close(out);
+    if (res < 0 && out >= 0) unlink(dst);
+    return res;
+}
+
+// Copies a file into the object store, unless its contents are there already.
+static int store_object(char const * path, uint64_t * hash) {
+
+    if (hash_file(path, hash) < 0) return -1;
+
+    char * object = cache_path("objects", *hash);
+    if (object == NULL) return -1;
+
+    int res = 0;
+    if (access(object, F_OK) < 0) {
+
+        // Objects are shared by hardlinks, so they're made read-only to stop
+        // a command writing through a restored output into the store. Copy to
+        // a temporary name first so a half-written object is never visible.
+        char tmp[PATH_MAX];
+        snprintf(tmp, sizeof(tmp), "%s.%d.tmp", object, getpid());
+        res = copy_file(path, tmp, 0444, 0);
+        if (res == 0 && rename(tmp, object) < 0) {
+            unlink(tmp);
+            res = -1;
+        }
+    }
+
+    return res;
+}
+
+// Writes one manifest line for every regular file at and below path.
+static int store_path(char * path, int len, int fd) {
+
+    struct stat st;
+    if (lstat(path, &st) < 0) return -1;
+
+    if (S_ISREG(st.st_mode)) {
+
+        uint64_t hash;
+        if (store_object(path, &hash) < 0) return -1;
+
+        char line[PATH_MAX + 64];
+        int line_len = snprintf(line, sizeof(line), "%016llx %o %s\n",
+                                (unsigned long long) hash, st.st_mode & 07777, path);
+        return write_all(fd, line, line_len);
+    }
+
+    if (!S_ISDIR(st.st_mode)) return 0;
+
+    DIR * dir = opendir(path);
+    if (dir == NULL) return -1;
+
+    int res = 0;
+    struct dirent * entry;
+    while (res == 0 && (entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        int name_len = strlen(entry->d_name);
+        if (len + name_len + 2 > PATH_MAX) continue;
+
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+        res = store_path(path, len + name_len + 1, fd);
+        path[len] = '\0';
+    }
+
+    closedir(dir);
+    return res;
+}
+
+int actioncache_store(Pipeline * pipeline) {
+
+    if (!pipeline->action_cache || pipeline->action_key == 0) return 0;
+
+    // Outputs built from inputs that changed under the command don't belong
+    // to the key computed before it started:
+    watch_drain(pipeline);
+    if (pipeline->dirty) return 0;
+
+    int res = -1;
+    int fd = -1;
+    char tmp[PATH_MAX];
+    char path[PATH_MAX];
+
+    char * manifest = cache_path("actions", pipeline->action_key);
+    if (manifest == NULL) goto exit;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", manifest, getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) goto exit;
+
+    for (char ** output = pipeline->outputs; output && *output; ++output) {
+
+        char * full_path = scratch_join_path(pipeline->workdir, *output);
+        if (full_path == NULL) goto exit;
+
+        int len = strlen(full_path);
+        int path_res = -1;
+        if (len < PATH_MAX) {
+            memcpy(path, full_path, len + 1);
+            path_res = store_path(path, len, fd);
+        }
+
+        if (path_res < 0) goto exit;
+    }
+
+    if (close(fd) < 0) {
+        fd = -1;
+        goto exit;
+    }
+    fd = -1;
+
+    res = rename(tmp, manifest);
+
+exit:
+    if (res < 0) {
+        printf(">> Pipeline %s: unable to cache outputs (%s)\n", pipeline->name, strerror(errno));
+        if (fd >= 0) close(fd);
+        if (manifest != NULL) unlink(tmp);
+    }
+    return res;
+}
+
+static int make_parents(char * path) {
+
+    for (char * slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int res = mkdir(path, 0755);
+        *slash = '/';
+        if (res < 0 && errno != EEXIST) return -1;
+    }
+    return 0;
+}
+
+static int restore_file(char const * object, char * path, mode_t mode) {
+
+    if (make_parents(path) < 0) return -1;
+    if (unlink(path) < 0 && errno != ENOENT) return -1;
+
+    // A reflink gives the output its own inode (and its own mode). Failing
+    // that, share the object's read-only inode, and only copy the data when
+    // the store is on another filesystem.
+    if (copy_file(object, path, mode, 1) == 0) return 0;
+    if (link(object, path) == 0) return 0;
+    return errno == EXDEV ? copy_file(object, path, mode, 0) : -1;
+}
+
+// Gives every output still hardlinked into the object store a private, writable
+// copy, so the command about to run can't modify the store through it.
+static void detach_path(char * path, int len) {
+
+    struct stat st;
+    if (lstat(path, &st) < 0) return;
+
+    if (S_ISREG(st.st_mode)) {
+
+        if (st.st_nlink < 2 || st.st_mode & 0222) return;
+
+        char tmp[PATH_MAX];
+        if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, getpid()) >= (int) sizeof(tmp)) return;
+        if (copy_file(path, tmp, (st.st_mode & 07777) | S_IWUSR, 0) == 0 && rename(tmp, path) < 0) {
+            unlink(tmp);
+        }
+        return;
+    }
+
+    if (!S_ISDIR(st.st_mode)) return;
+
+    DIR * dir = opendir(path);
+    if (dir == NULL) return;
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        int name_len = strlen(entry->d_name);
+        if (len + name_len + 2 > PATH_MAX) continue;
+
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+        detach_path(path, len + name_len + 1);
+        path[len] = '\0';
+    }
+
+    closedir(dir);
+}
+
+static void detach_outputs(Pipeline * pipeline) {
+
+    char path[PATH_MAX];
+    for (char ** output = pipeline->outputs; output && *output; ++output) {
+
+        char * full_path = scratch_join_path(pipeline->workdir, *output);
+        if (full_path == NULL) continue;
+
+        int len = strlen(full_path);
+        if (len < PATH_MAX) {
+            memcpy(path, full_path, len + 1);
+            detach_path(path, len);
+        }
+    }
+}
+
+// Removes everything at and below path, apart from path itself when it's a
+// directory.
+static void clear_path(char * path, int len, int root) {
+
+    struct stat st;
+    if (lstat(path, &st) < 0) return;
+
+    if (!S_ISDIR(st.st_mode)) {
+        unlink(path);
+        return;
+    }
+
+    DIR * dir = opendir(path);
+    if (dir == NULL) return;
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        int name_len = strlen(entry->d_name);
+        if (len + name_len + 2 > PATH_MAX) continue;
+
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+        clear_path(path, len + name_len + 1, 0);
+        path[len] = '\0';
+    }
+
+    closedir(dir);
+    if (!root) rmdir(path);
+}
+
+// A restore has to leave the outputs as the cached run did, so anything a
+// different build left in them goes first.
+static void clear_outputs(Pipeline * pipeline) {
+
+    char path[PATH_MAX];
+    for (char ** output = pipeline->outputs; output && *output; ++output) {
+
+        char * full_path = scratch_join_path(pipeline->workdir, *output);
+        if (full_path == NULL) continue;
+
+        int len = strlen(full_path);
+        if (len < PATH_MAX) {
+            memcpy(path, full_path, len + 1);
+            clear_path(path, len, 1);
+        }
+    }
+}
+
+// Manifest lines are "<object hash> <mode> <path>".
+static int restore_manifest(Pipeline * pipeline, char * manifest) {
+
+    int entries = 0;
+
+    // Check every object is present before touching any output:
+    for (char * line = manifest; *line;) {
+
+        char * end = strchr(line, '\n');
+        if (end == NULL) return -1;
+
+        unsigned long long hash;
+        if (sscanf(line, "%16llx", &hash) != 1) return -1;
+
+        char * object = cache_path("objects", hash);
+        int present = object != NULL && access(object, F_OK) == 0;
+        if (!present) return -1;
+
+        ++entries;
+        line = end + 1;
+    }
+
+    clear_outputs(pipeline);
+
+    for (char * line = manifest; *line;) {
+
+        char * end = strchr(line, '\n');
+        *end = '\0';
+
+        unsigned long long hash;
+        unsigned int mode;
+        int offset = 0;
+        if (sscanf(line, "%16llx %o %n", &hash, &mode, &offset) != 2 || offset == 0) return -1;
+
+        char * object = cache_path("objects", hash);
+        if (object == NULL) return -1;
+
+        int res = restore_file(object, line + offset, mode);
+        if (res < 0) return -1;
+
+        line = end + 1;
+    }
+
+    return entries;
+}
+
+int actioncache_lookup(Pipeline * pipeline) {
+
+    pipeline->action_key = 0;
+    if (!pipeline->action_cache) return 0;
+
+    int restored = -1;
+    char * manifest = NULL;
+
+    uint64_t key;
+    if (action_key(pipeline, &key) < 0) {
+        printf(">> Pipeline %s: unable to hash inputs, running without the action cache\n", pipeline->name);
+        goto miss;
+    }
+    pipeline->action_key = key;
+
+    char * manifest_path = cache_path("actions", key);
+    if (manifest_path == NULL) goto miss;
+
+    manifest = read_entire_file(manifest_path);
+    if (manifest == NULL) goto miss;
+
+    restored = restore_manifest(pipeline, manifest);
+    FREE(manifest);
+
+    if (restored < 0) {
+        printf(">> Pipeline %s: unable to restore cached outputs (%s)\n", pipeline->name, strerror(errno));
+        goto miss;
+    }
+
+    printf(">> Pipeline %s: restored %d cached output%s\n", pipeline->name, restored, restored == 1 ? "" : "s");
+    changeset_clear(&pipeline->changes);
+    return 1;
+
+miss:
+    detach_outputs(pipeline);
+    return 0;
+}
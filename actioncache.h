@@ -0,0 +1,24 @@
+#ifndef ACTIONCACHE_H
+#define ACTIONCACHE_H
+
+#include "pipelines.h"
+
+// A local, content-addressed cache of pipeline runs, enabled per pipeline with
+// "action_cache: true". A run is identified by its action key: a hash of the
+// command, workdir, environment and the contents of every watched input. After
+// a successful run the declared outputs are copied into ".pipelines/objects"
+// under their content hash, and a manifest listing them is written to
+// ".pipelines/actions/<key>". When the same inputs come round again the
+// outputs are restored from there (reflinked, or hardlinked if the filesystem
+// can't) instead of running the command.
+
+// Computes the pipeline's current action key and restores its outputs if that
+// key has been seen before. Returns 1 on a hit, in which case the pending
+// change set has been consumed, and 0 if the command needs to run.
+int actioncache_lookup(Pipeline * pipeline);
+
+// Records the outputs of a successful run under the key computed by the
+// lookup before it. Skipped if inputs changed while the command was running.
+int actioncache_store(Pipeline * pipeline);
+
+#endif // ACTIONCACHE_H
@@ -0,0 +1,184 @@
+#include "arena.h"
+
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+struct ArenaBlock {
+    ArenaBlock * next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+struct PoolSlab {
+    PoolSlab * next;
+    _Alignas(ARENA_ALIGN) char data[];
+};
+
+_Thread_local Arena scratch = { .block_size = 64 * 1024 };
+
+// Arenas and pools sit underneath ALLOC, so their own blocks always come
+// straight from the heap whatever context is active.
+static void * heap_alloc(size_t size) {
+    return ctx_heap_alloc(size);
+}
+
+void arena_init(Arena * arena, size_t block_size) {
+    memset(arena, 0, sizeof(Arena));
+    arena->block_size = block_size;
+}
+
+void * arena_alloc(Arena * arena, size_t size) {
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    // Move on through blocks kept from before the last reset, then grow:
+    ArenaBlock * block = arena->current;
+    while (block != NULL && block->used + size > block->size) {
+        block = block->next;
+        if (block != NULL) block->used = 0;
+    }
+
+    if (block == NULL) {
+
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        block = heap_alloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) return NULL;
+
+        block->size = block_size;
+        block->used = 0;
+
+        // New blocks go after the current one so that reset order is kept:
+        if (arena->current != NULL) {
+            block->next = arena->current->next;
+            arena->current->next = block;
+        } else {
+            block->next = arena->blocks;
+            arena->blocks = block;
+        }
+    }
+
+    arena->current = block;
+    void * result = block->data + block->used;
+    block->used += size;
+    ++arena->allocs;
+    arena->bytes += size;
+    return result;
+}
+
+void arena_reset(Arena * arena) {
+
+    if (arena->blocks != NULL) arena->blocks->used = 0;
+    arena->current = arena->blocks;
+    arena->allocs = 0;
+    arena->bytes = 0;
+}
+
+void arena_free(Arena * arena) {
+
+    ArenaBlock * block = arena->blocks;
+    while (block != NULL) {
+        ArenaBlock * next = block->next;
+        ctx_heap_free(block);
+        block = next;
+    }
+    arena->blocks = NULL;
+    arena->current = NULL;
+    arena->allocs = 0;
+    arena->bytes = 0;
+}
+
+// The context hooks take no state, so they use whichever arena was installed
+// on this thread last.
+static _Thread_local Arena * ctx_arena;
+
+static void * ctx_arena_alloc(size_t size) {
+    return arena_alloc(ctx_arena, size);
+}
+
+static void ctx_arena_free(void * ptr) {
+    (void) ptr;
+}
+
+Ctx ctx_use_arena(Arena * arena) {
+
+    Ctx saved = ctx;
+    saved.state = ctx_arena;
+
+    ctx_arena = arena;
+    ctx.alloc = ctx_arena_alloc;
+    ctx.free = ctx_arena_free;
+    return saved;
+}
+
+void ctx_restore(Ctx saved) {
+    ctx_arena = saved.state;
+    saved.state = NULL;
+    ctx = saved;
+}
+
+Ctx scratch_begin() {
+    return ctx_use_arena(&scratch);
+}
+
+void scratch_reset() {
+    arena_reset(&scratch);
+}
+
+void pool_init(Pool * pool, size_t slot_size, int slots_per_slab) {
+
+    memset(pool, 0, sizeof(Pool));
+
+    // Free slots hold the free list link:
+    if (slot_size < sizeof(void *)) slot_size = sizeof(void *);
+    pool->slot_size = (slot_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    pool->slots_per_slab = slots_per_slab;
+}
+
+void * pool_alloc(Pool * pool) {
+
+    if (pool->free_list == NULL) {
+
+        PoolSlab * slab = heap_alloc(sizeof(PoolSlab) + pool->slot_size * pool->slots_per_slab);
+        if (slab == NULL) return NULL;
+
+        slab->next = pool->slabs;
+        pool->slabs = slab;
+        pool->capacity += pool->slots_per_slab;
+
+        // Thread the new slots onto the free list, first slot on top:
+        for (int i = pool->slots_per_slab - 1; i >= 0; --i) {
+            void ** slot = (void **) (slab->data + pool->slot_size * i);
+            *slot = pool->free_list;
+            pool->free_list = slot;
+        }
+    }
+
+    void ** slot = pool->free_list;
+    pool->free_list = *slot;
+    ++pool->in_use;
+    return slot;
+}
+
+void pool_release(Pool * pool, void * slot) {
+
+    if (slot == NULL) return;
+    *(void **) slot = pool->free_list;
+    pool->free_list = slot;
+    --pool->in_use;
+}
+
+void pool_free(Pool * pool) {
+
+    PoolSlab * slab = pool->slabs;
+    while (slab != NULL) {
+        PoolSlab * next = slab->next;
+        ctx_heap_free(slab);
+        slab = next;
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    pool->capacity = 0;
+}
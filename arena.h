@@ -0,0 +1,58 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "ctx.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A bump allocator. Allocations are carved out of large blocks and are never
+// freed individually; the whole arena is reset or released at once. Blocks
+// are kept across resets, so an arena that's reused settles into making no
+// heap allocations at all.
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+    ArenaBlock * blocks;
+    ArenaBlock * current;
+    size_t block_size;
+    uint64_t allocs;        // Since the last reset
+    uint64_t bytes;         // Since the last reset
+} Arena;
+
+void arena_init(Arena * arena, size_t block_size);
+void * arena_alloc(Arena * arena, size_t size);
+void arena_reset(Arena * arena);
+void arena_free(Arena * arena);
+
+// Routes ALLOC through the arena (and makes FREE a no-op) until the returned
+// context is restored with ctx_restore().
+Ctx ctx_use_arena(Arena * arena);
+void ctx_restore(Ctx saved);
+
+// The per-thread scratch arena, for memory that only has to last until the
+// current run has been dispatched. scratch_reset() is called by the engines
+// between runs; nothing allocated in scratch may be FREE'd or kept past it.
+extern _Thread_local Arena scratch;
+
+Ctx scratch_begin();
+void scratch_reset();
+
+// Fixed-size slots, with freed slots kept on a free list for reuse.
+typedef struct PoolSlab PoolSlab;
+
+typedef struct {
+    size_t slot_size;
+    int slots_per_slab;
+    PoolSlab * slabs;
+    void * free_list;
+    uint64_t in_use;
+    uint64_t capacity;
+} Pool;
+
+void pool_init(Pool * pool, size_t slot_size, int slots_per_slab);
+void * pool_alloc(Pool * pool);
+void pool_release(Pool * pool, void * slot);
+void pool_free(Pool * pool);
+
+#endif // ARENA_H
@@ -0,0 +1,718 @@
+// End-to-end benchmark for pipelines. Each workload builds a synthetic tree on
+// tmpfs, starts the pipelines binary on a generated Pipefile and drives file
+// changes at it. The pipelines' commands re-run this binary as "stamp", which
+// reports the moment it started and how many changed paths it was handed
+// through a FIFO, so event-to-spawn latency is measured on one clock from the
+// write to the command actually running.
+//
+// Usage: bench <path to pipelines binary>
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define BENCH_TIMEOUT_MS 3000   // Longest wait for a run before counting it missed
+#define BENCH_SETTLE_MS 300     // Quiet period that ends the collection of a burst
+
+typedef struct {
+    uint64_t start_ns;      // CLOCK_MONOTONIC when the command started
+    int64_t changed;        // PIPELINES_CHANGED_COUNT, or -1 if unset
+} Stamp;
+
+typedef struct {
+    char root[PATH_MAX];
+    char fifo[PATH_MAX];
+    int fifo_fd;
+    pid_t pid;
+} Bench;
+
+typedef struct {
+    char const * name;
+    uint64_t * latencies;
+    int latency_count;
+    int runs;
+    long events;            // Changes made by the workload
+    long reported;          // Changed paths reported to the commands
+    int incomplete;         // Runs told the change list was incomplete
+    int missed;
+    double drain_seconds;
+    int watches;
+    double startup_ms;
+    long rss_kb;
+    long peak_rss_kb;
+} Result;
+
+static char const * pipelines_binary;
+static char self_path[PATH_MAX];
+static int failures;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_ms(int ms) {
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+    nanosleep(&ts, NULL);
+}
+
+// The command each benchmark pipeline runs:
+static int stamp_main(char const * fifo) {
+
+    Stamp stamp = { .start_ns = now_ns(), .changed = -1 };
+    char const * count = getenv("PIPELINES_CHANGED_COUNT");
+    if (count != NULL) stamp.changed = atoll(count);
+
+    int fd = open(fifo, O_WRONLY);
+    if (fd < 0) return 1;
+
+    // Writes below PIPE_BUF are atomic, so concurrent commands can't interleave:
+    int res = write(fd, &stamp, sizeof(stamp)) == sizeof(stamp) ? 0 : 1;
+    close(fd);
+    return res;
+}
+
+static int write_file(char const * path, char const * contents) {
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int len = strlen(contents);
+    int res = write(fd, contents, len) == len ? 0 : -1;
+    close(fd);
+    return res;
+}
+
+// snprintf() for paths. A path that doesn't fit fails the workload rather
+// than benchmarking a truncated one:
+static int format_path(char * path, size_t size, char const * fmt, ...) __attribute__((format(printf, 3, 4)));
+static int format_path(char * path, size_t size, char const * fmt, ...) {
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(path, size, fmt, args);
+    va_end(args);
+
+    if (n < 0 || n >= (int) size) {
+        printf("Path too long: %s...\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static int make_dir(char const * fmt, ...) __attribute__((format(printf, 1, 2)));
+static int make_dir(char const * fmt, ...) {
+
+    char path[PATH_MAX];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(path, sizeof(path), fmt, args);
+    va_end(args);
+
+    if (n < 0 || n >= (int) sizeof(path)) {
+        printf("Path too long: %s...\n", path);
+        return -1;
+    }
+    return mkdir(path, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+static int remove_tree(char const * path) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execl("/bin/rm", "rm", "-rf", path, (char *) NULL);
+        _exit(127);
+    }
+    int status = 0;
+    if (pid > 0) waitpid(pid, &status, 0);
+    return status == 0 ? 0 : -1;
+}
+
+static int bench_init(Bench * bench, char const * name) {
+
+    memset(bench, 0, sizeof(Bench));
+    bench->fifo_fd = -1;
+
+    // Prefer tmpfs so the disk doesn't end up being what's measured:
+    char const * base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+    if (format_path(bench->root, sizeof(bench->root), "%s/pipelines-bench-%s-XXXXXX", base, name) < 0 ||
+        mkdtemp(bench->root) == NULL) {
+        bench->root[0] = '\0';
+        return -1;
+    }
+
+    if (format_path(bench->fifo, sizeof(bench->fifo), "%s/stamps", bench->root) < 0 ||
+        mkfifo(bench->fifo, 0600) < 0) {
+        return -1;
+    }
+
+    // Opened read-write so the FIFO never reports EOF between commands:
+    bench->fifo_fd = open(bench->fifo, O_RDWR | O_NONBLOCK);
+    return bench->fifo_fd < 0 ? -1 : 0;
+}
+
+// Appends one pipeline watching <root>/<dir> to the Pipefile being built:
+static void pipefile_add(FILE * f, Bench * bench, char const * name, char const * dir) {
+    fprintf(f, "    - %s:\n", name);
+    fprintf(f, "        watch_paths: \"%s\"\n", dir);
+    fprintf(f, "        shell: false\n");
+    fprintf(f, "        cmd: \"%s stamp %s\"\n", self_path, bench->fifo);
+}
+
+static int count_lines(char const * path, char const * needle) {
+
+    FILE * f = fopen(path, "r");
+    if (f == NULL) return 0;
+
+    int count = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strstr(line, needle) != NULL) ++count;
+    }
+    fclose(f);
+    return count;
+}
+
+// Counts the inotify watches a process holds in the kernel, the one on the
+// Pipefile's directory included.
+static int count_kernel_watches(pid_t pid) {
+
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo", pid);
+    DIR * dir = opendir(path);
+    if (dir == NULL) return -1;
+
+    int count = 0;
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+
+        if (entry->d_name[0] == '.') continue;
+        snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, entry->d_name);
+        FILE * f = fopen(path, "r");
+        if (f == NULL) continue;
+
+        char line[512];
+        while (fgets(line, sizeof(line), f) != NULL) {
+            if (strncmp(line, "inotify wd:", 11) == 0) ++count;
+        }
+        fclose(f);
+    }
+    closedir(dir);
+    return count;
+}
+
+// Starts pipelines on the Pipefile in the bench root and waits until every
+// pipeline reports that it's monitoring.
+static int bench_start(Bench * bench, int pipelines, Result * result) {
+
+    char log_path[PATH_MAX];
+    if (format_path(log_path, sizeof(log_path), "%s/log", bench->root) < 0) return -1;
+
+    uint64_t start = now_ns();
+
+    bench->pid = fork();
+    if (bench->pid < 0) return -1;
+    if (bench->pid == 0) {
+        int fd = open(log_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || chdir(bench->root) < 0) _exit(127);
+        dup2(fd, STDOUT_FILENO);
+        dup2(fd, STDERR_FILENO);
+        execl(pipelines_binary, pipelines_binary, "-e", "epoll", (char *) NULL);
+        _exit(127);
+    }
+
+    while (now_ns() - start < 60 * 1000000000ull) {
+
+        if (count_lines(log_path, "monitoring") >= pipelines) {
+            result->startup_ms = (now_ns() - start) / 1e6;
+            result->watches = count_kernel_watches(bench->pid);
+            return 0;
+        }
+
+        if (waitpid(bench->pid, NULL, WNOHANG) == bench->pid) {
+            bench->pid = 0;
+            printf("pipelines exited during startup, see %s\n", log_path);
+            return -1;
+        }
+        sleep_ms(5);
+    }
+
+    printf("timed out waiting for pipelines to start\n");
+    return -1;
+}
+
+static long read_status_kb(pid_t pid, char const * field) {
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE * f = fopen(path, "r");
+    if (f == NULL) return -1;
+
+    long value = -1;
+    char line[256];
+    int len = strlen(field);
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            value = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(f);
+    return value;
+}
+
+static void bench_stop(Bench * bench, Result * result) {
+
+    if (bench->pid > 0) {
+        result->rss_kb = read_status_kb(bench->pid, "VmRSS");
+        result->peak_rss_kb = read_status_kb(bench->pid, "VmHWM");
+        kill(bench->pid, SIGTERM);
+        waitpid(bench->pid, NULL, 0);
+    }
+    if (bench->fifo_fd >= 0) close(bench->fifo_fd);
+    remove_tree(bench->root);
+}
+
+// Waits up to timeout_ms for the next stamp. Returns 0 on timeout.
+static int next_stamp(Bench * bench, Stamp * stamp, int timeout_ms) {
+
+    struct pollfd pfd = { .fd = bench->fifo_fd, .events = POLLIN };
+    for (;;) {
+        ssize_t r = read(bench->fifo_fd, stamp, sizeof(Stamp));
+        if (r == sizeof(Stamp)) return 1;
+        if (r < 0 && errno != EAGAIN && errno != EINTR) return 0;
+
+        if (poll(&pfd, 1, timeout_ms) <= 0) return 0;
+    }
+}
+
+static void record_stamp(Result * result, Stamp const * stamp) {
+    ++result->runs;
+    if (stamp->changed < 0) ++result->incomplete;
+    else result->reported += stamp->changed;
+}
+
+// Makes one change, then waits for the run it triggers and records the time
+// between the two.
+static void measure_save(Bench * bench, Result * result, char const * path, int iteration) {
+
+    char contents[64];
+    snprintf(contents, sizeof(contents), "%d\n", iteration);
+
+    uint64_t t0 = now_ns();
+    write_file(path, contents);
+    ++result->events;
+
+    Stamp stamp;
+    if (!next_stamp(bench, &stamp, BENCH_TIMEOUT_MS)) {
+        ++result->missed;
+        return;
+    }
+    record_stamp(result, &stamp);
+    result->latencies[result->latency_count++] = stamp.start_ns > t0 ? stamp.start_ns - t0 : 0;
+
+    // Let the command exit, so the next save doesn't wait behind it:
+    sleep_ms(2);
+}
+
+// Collects runs until none arrive for BENCH_SETTLE_MS, then works out what was
+// dropped. Waiting for quiet rather than stopping at the expected count makes
+// sure follow-up runs don't leak into the next round.
+static void collect_burst(Bench * bench, Result * result, uint64_t t0, long expected) {
+
+    Stamp stamp;
+    uint64_t last = t0;
+    int first = 1;
+
+    while (next_stamp(bench, &stamp, first ? BENCH_TIMEOUT_MS : BENCH_SETTLE_MS)) {
+        if (first) result->latencies[result->latency_count++] = stamp.start_ns - t0;
+        first = 0;
+        record_stamp(result, &stamp);
+        last = stamp.start_ns;
+    }
+
+    result->drain_seconds += (last - t0) / 1e9;
+
+    // A run told the list is incomplete is the correct response to dropped
+    // events, so only paths that went unreported with no such run are missed:
+    if (result->incomplete == 0 && result->reported < expected) {
+        result->missed += expected - result->reported;
+    }
+}
+
+static int compare_u64(void const * a, void const * b) {
+    uint64_t x = *(uint64_t const *) a, y = *(uint64_t const *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(Result * result, double p) {
+    if (result->latency_count == 0) return 0;
+    int i = (int) (p * (result->latency_count - 1) + 0.5);
+    return result->latencies[i] / 1e3;
+}
+
+static void report(Result * result) {
+
+    qsort(result->latencies, result->latency_count, sizeof(uint64_t), compare_u64);
+
+    printf("%-10s %9.1f %9.1f %6d %9.0f %7ld %6d %8d %9.1f %8ld %8ld\n",
+           result->name,
+           percentile_us(result, 0.50), percentile_us(result, 0.99),
+           result->runs,
+           result->drain_seconds > 0 ? result->events / result->drain_seconds : 0,
+           (long) result->missed, result->incomplete,
+           result->watches, result->startup_ms,
+           result->rss_kb, result->peak_rss_kb);
+
+    if (result->missed > 0 || result->latency_count == 0) ++failures;
+}
+
+// One file rewritten over and over, each save waited for.
+static void bench_single(int iterations) {
+
+    Bench bench;
+    Result result = { .name = "single" };
+    result.latencies = calloc(iterations, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    if (bench_init(&bench, "single") < 0 || make_dir("%s/src", bench.root) < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    pipefile_add(f, &bench, "single", "src");
+    fclose(f);
+
+    if (bench_start(&bench, 1, &result) < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/src/file.c", bench.root) < 0) goto exit;
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iterations; ++i) measure_save(&bench, &result, path, i);
+    result.drain_seconds = (now_ns() - t0) / 1e9;
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+// Many distinct files written back to back, as fast as possible.
+static void bench_burst(int files, int rounds) {
+
+    Bench bench;
+    Result result = { .name = "burst" };
+    result.latencies = calloc(rounds, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    if (bench_init(&bench, "burst") < 0 || make_dir("%s/src", bench.root) < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    pipefile_add(f, &bench, "burst", "src");
+    fclose(f);
+
+    if (bench_start(&bench, 1, &result) < 0) goto exit;
+
+    for (int round = 0; round < rounds; ++round) {
+
+        long reported = result.reported;
+        result.reported = 0;
+
+        uint64_t t0 = now_ns();
+        for (int i = 0; i < files; ++i) {
+            if (format_path(path, sizeof(path), "%s/src/file%d.c", bench.root, i) < 0) goto exit;
+            write_file(path, "x\n");
+        }
+        result.events += files;
+
+        collect_burst(&bench, &result, t0, files);
+        result.reported += reported;
+    }
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+// What a branch switch looks like: every file in a tree replaced through a
+// temporary name and a rename, spread across many directories.
+static void bench_checkout(int dirs, int files_per_dir, int rounds) {
+
+    Bench bench;
+    Result result = { .name = "checkout" };
+    result.latencies = calloc(rounds, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    char tmp[PATH_MAX];
+    if (bench_init(&bench, "checkout") < 0 || make_dir("%s/src", bench.root) < 0) goto exit;
+
+    for (int d = 0; d < dirs; ++d) {
+        if (make_dir("%s/src/dir%d", bench.root, d) < 0) goto exit;
+        for (int i = 0; i < files_per_dir; ++i) {
+            if (format_path(path, sizeof(path), "%s/src/dir%d/file%d.c", bench.root, d, i) < 0) goto exit;
+            write_file(path, "base\n");
+        }
+    }
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    pipefile_add(f, &bench, "checkout", "src");
+    fclose(f);
+
+    if (bench_start(&bench, 1, &result) < 0) goto exit;
+
+    for (int round = 0; round < rounds; ++round) {
+
+        long reported = result.reported;
+        result.reported = 0;
+
+        uint64_t t0 = now_ns();
+        for (int d = 0; d < dirs; ++d) {
+            for (int i = 0; i < files_per_dir; ++i) {
+                if (format_path(tmp, sizeof(tmp), "%s/src/dir%d/.file%d.c.tmp", bench.root, d, i) < 0 ||
+                    format_path(path, sizeof(path), "%s/src/dir%d/file%d.c", bench.root, d, i) < 0) {
+                    goto exit;
+                }
+                write_file(tmp, round % 2 ? "base\n" : "branch\n");
+                rename(tmp, path);
+            }
+        }
+
+        // Each file shows up as its temporary name and its real one:
+        long expected = 2L * dirs * files_per_dir;
+        result.events += expected;
+
+        collect_burst(&bench, &result, t0, expected);
+        result.reported += reported;
+    }
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+static int build_tree(char * path, int len, int depth, int fanout) {
+
+    if (depth == 0) return 0;
+
+    for (int i = 0; i < fanout; ++i) {
+        int n = snprintf(path + len, PATH_MAX - len, "/d%d", i);
+        if (n >= PATH_MAX - len) {
+            printf("Path too long: %s...\n", path);
+            return -1;
+        }
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) return -1;
+        if (build_tree(path, len + n, depth - 1, fanout) < 0) return -1;
+        path[len] = '\0';
+    }
+    return 0;
+}
+
+// A large recursive tree: startup cost, watch count, and the latency of
+// saves at the bottom of it.
+static void bench_deep(int depth, int fanout, int iterations) {
+
+    Bench bench;
+    Result result = { .name = "deep" };
+    result.latencies = calloc(iterations, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    if (bench_init(&bench, "deep") < 0 || make_dir("%s/src", bench.root) < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/src", bench.root) < 0 ||
+        build_tree(path, strlen(path), depth, fanout) < 0) {
+        goto exit;
+    }
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    pipefile_add(f, &bench, "deep", "src");
+    fclose(f);
+
+    if (bench_start(&bench, 1, &result) < 0) goto exit;
+
+    // The tree was built within PATH_MAX, so only the leaf's name can overflow:
+    int len = snprintf(path, sizeof(path), "%s/src", bench.root);
+    for (int i = 0; i < depth; ++i) len += snprintf(path + len, sizeof(path) - len, "/d%d", fanout - 1);
+    if (format_path(path + len, sizeof(path) - len, "/leaf.c") < 0) goto exit;
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iterations; ++i) measure_save(&bench, &result, path, i);
+    result.drain_seconds = (now_ns() - t0) / 1e9;
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+// Many small pipelines in one process, each save landing on a different one.
+static void bench_many(int pipelines, int iterations) {
+
+    Bench bench;
+    Result result = { .name = "many" };
+    result.latencies = calloc(iterations, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    char dir[64];
+    if (bench_init(&bench, "many") < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    for (int i = 0; i < pipelines; ++i) {
+        if (make_dir("%s/p%d", bench.root, i) < 0) {
+            fclose(f);
+            goto exit;
+        }
+        snprintf(dir, sizeof(dir), "p%d", i);
+        pipefile_add(f, &bench, dir, dir);
+    }
+    fclose(f);
+
+    if (bench_start(&bench, pipelines, &result) < 0) goto exit;
+
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iterations; ++i) {
+        if (format_path(path, sizeof(path), "%s/p%d/file.c", bench.root, (i * 7919) % pipelines) < 0) goto exit;
+        measure_save(&bench, &result, path, i);
+    }
+    result.drain_seconds = (now_ns() - t0) / 1e9;
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+// Pipelines whose watch paths overlap: half watch a tree and half one of its
+// subdirectories, and every save lands in all of them. Kernel watches should
+// stay at one per directory, however many pipelines there are.
+static void bench_overlap(int pipelines, int depth, int fanout, int iterations) {
+
+    Bench bench;
+    Result result = { .name = "overlap" };
+    result.latencies = calloc(iterations, sizeof(uint64_t));
+
+    char path[PATH_MAX];
+    char name[64];
+    if (bench_init(&bench, "overlap") < 0 || make_dir("%s/src", bench.root) < 0) goto exit;
+
+    if (format_path(path, sizeof(path), "%s/src", bench.root) < 0 ||
+        build_tree(path, strlen(path), depth, fanout) < 0) {
+        goto exit;
+    }
+
+    if (format_path(path, sizeof(path), "%s/Pipefile", bench.root) < 0) goto exit;
+    FILE * f = fopen(path, "w");
+    if (f == NULL) goto exit;
+    fprintf(f, "pipelines:\n");
+    for (int i = 0; i < pipelines; ++i) {
+        snprintf(name, sizeof(name), "o%d", i);
+        pipefile_add(f, &bench, name, i % 2 ? "src/d0" : "src");
+    }
+    fclose(f);
+
+    if (bench_start(&bench, pipelines, &result) < 0) goto exit;
+
+    // The tree was built within PATH_MAX, so only the leaf's name can overflow:
+    int len = snprintf(path, sizeof(path), "%s/src", bench.root);
+    for (int i = 0; i < depth; ++i) len += snprintf(path + len, sizeof(path) - len, "/d0");
+    if (format_path(path + len, sizeof(path) - len, "/leaf.c") < 0) goto exit;
+
+    // Each save is timed until the last of the pipelines has started:
+    uint64_t t0 = now_ns();
+    for (int i = 0; i < iterations; ++i) {
+
+        char contents[64];
+        snprintf(contents, sizeof(contents), "%d\n", i);
+
+        uint64_t saved = now_ns();
+        write_file(path, contents);
+        result.events += pipelines;
+
+        Stamp stamp;
+        uint64_t last = saved;
+        for (int run = 0; run < pipelines; ++run) {
+            if (!next_stamp(&bench, &stamp, BENCH_TIMEOUT_MS)) {
+                result.missed += pipelines - run;
+                break;
+            }
+            record_stamp(&result, &stamp);
+            if (stamp.start_ns > last) last = stamp.start_ns;
+        }
+        result.latencies[result.latency_count++] = last - saved;
+        sleep_ms(5);
+    }
+    result.drain_seconds = (now_ns() - t0) / 1e9;
+
+exit:
+    bench_stop(&bench, &result);
+    report(&result);
+    free(result.latencies);
+}
+
+int main(int argc, char ** argv) {
+
+    if (argc == 3 && strcmp(argv[1], "stamp") == 0) {
+        return stamp_main(argv[2]);
+    }
+
+    if (argc != 2) {
+        printf("Usage: %s <pipelines binary>\n", argv[0]);
+        return 1;
+    }
+
+    if (realpath(argv[0], self_path) == NULL) {
+        printf("Unable to resolve %s: %s\n", argv[0], strerror(errno));
+        return 1;
+    }
+
+    static char binary[PATH_MAX];
+    if (realpath(argv[1], binary) == NULL) {
+        printf("Unable to resolve %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    pipelines_binary = binary;
+
+    // Writing to a FIFO after the harness has gone shouldn't kill anything:
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%-10s %9s %9s %6s %9s %7s %6s %8s %9s %8s %8s\n",
+           "workload", "p50(us)", "p99(us)", "runs", "events/s",
+           "missed", "incmpl", "watches", "start(ms)", "rss(kB)", "peak(kB)");
+
+    bench_single(200);
+    bench_burst(2000, 5);
+    bench_checkout(50, 40, 5);
+    bench_deep(7, 4, 100);
+    bench_many(64, 200);
+    bench_overlap(16, 5, 4, 50);
+
+    if (failures > 0) {
+        printf("%d workload%s missed events or never ran\n", failures, failures == 1 ? "" : "s");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,150 @@
+#include "changeset.h"
+#include "ctx.h"
+#include "util.h"
+
+#include <string.h>
+
+// Paths are written out in chunks this large:
+#define CHANGESET_WRITE_SIZE 4096
+
+static uint32_t hash_path(char const * path, int len) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < len; ++i) {
+        h ^= (unsigned char) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static int changeset_grow_slots(ChangeSet * set) {
+
+    int capacity = set->slot_capacity ? set->slot_capacity * 2 : 256;
+    int * slots = ALLOC(sizeof(int) * capacity);
+    uint32_t * hashes = ALLOC(sizeof(uint32_t) * capacity);
+    if (slots == NULL || hashes == NULL) {
+        FREE(slots);
+        FREE(hashes);
+        return -1;
+    }
+    memset(slots, 0, sizeof(int) * capacity);
+
+    // Reinsert the existing entries:
+    uint32_t mask = capacity - 1;
+    for (int i = 0; i < set->slot_capacity; ++i) {
+        if (set->slots[i] == 0) continue;
+        uint32_t j = set->hashes[i] & mask;
+        while (slots[j] != 0) j = (j + 1) & mask;
+        slots[j] = set->slots[i];
+        hashes[j] = set->hashes[i];
+    }
+
+    FREE(set->slots);
+    FREE(set->hashes);
+    set->slots = slots;
+    set->hashes = hashes;
+    set->slot_capacity = capacity;
+    return 0;
+}
+
+static int changeset_append(ChangeSet * set, char const * path, int len) {
+
+    if (set->strings_len + len + 1 > set->strings_capacity) {
+
+        int capacity = set->strings_capacity ? set->strings_capacity : 4096;
+        while (capacity < set->strings_len + len + 1) capacity *= 2;
+
+        char * strings = ALLOC(capacity);
+        if (strings == NULL) return -1;
+
+        if (set->strings != NULL) {
+            memcpy(strings, set->strings, set->strings_len);
+            FREE(set->strings);
+        }
+        set->strings = strings;
+        set->strings_capacity = capacity;
+    }
+
+    int offset = set->strings_len;
+    memcpy(set->strings + offset, path, len + 1);
+    set->strings_len += len + 1;
+    return offset;
+}
+
+int changeset_add(ChangeSet * set, char const * path) {
+
+    if (set->incomplete) return -1;
+
+    // The list handed to commands and workers is one path per line, so a
+    // path containing a newline can't be listed:
+    if (strchr(path, '\n') != NULL) {
+        set->incomplete = 1;
+        return -1;
+    }
+
+    // Keep the table at most half full:
+    if ((set->count + 1) * 2 > set->slot_capacity && changeset_grow_slots(set) < 0) {
+        set->incomplete = 1;
+        return -1;
+    }
+
+    int len = strlen(path);
+    uint32_t h = hash_path(path, len);
+    uint32_t mask = set->slot_capacity - 1;
+
+    uint32_t i = h & mask;
+    for (; set->slots[i] != 0; i = (i + 1) & mask) {
+        if (set->hashes[i] == h && strcmp(set->strings + set->slots[i] - 1, path) == 0) {
+            return 0;
+        }
+    }
+
+    if (set->count == CHANGESET_MAX_PATHS) {
+        set->incomplete = 1;
+        return -1;
+    }
+
+    int offset = changeset_append(set, path, len);
+    if (offset < 0) {
+        set->incomplete = 1;
+        return -1;
+    }
+
+    set->slots[i] = offset + 1;
+    set->hashes[i] = h;
+    ++set->count;
+    return 1;
+}
+
+int changeset_write(ChangeSet * set, int fd) {
+
+    // Paths are stored NUL-separated, so newlines are swapped in through a
+    // scratch buffer, leaving the set itself untouched:
+    char buf[CHANGESET_WRITE_SIZE];
+    int len = 0;
+
+    for (int i = 0; i < set->strings_len; ++i) {
+        if (len == (int) sizeof(buf)) {
+            if (write_all(fd, buf, len) < 0) return -1;
+            len = 0;
+        }
+        buf[len++] = set->strings[i] != '\0' ? set->strings[i] : '\n';
+    }
+
+    return write_all(fd, buf, len);
+}
+
+void changeset_clear(ChangeSet * set) {
+
+    if (set->slots != NULL) memset(set->slots, 0, sizeof(int) * set->slot_capacity);
+    set->strings_len = 0;
+    set->count = 0;
+    set->incomplete = 0;
+}
+
+void changeset_free(ChangeSet * set) {
+
+    FREE(set->strings);
+    FREE(set->slots);
+    FREE(set->hashes);
+    memset(set, 0, sizeof(ChangeSet));
+}
@@ -0,0 +1,37 @@
+#ifndef CHANGESET_H
+#define CHANGESET_H
+
+#include <stdint.h>
+
+// Upper bound on the paths remembered for one run. Past this the set is marked
+// incomplete and the command is expected to treat everything as changed.
+#define CHANGESET_MAX_PATHS 65536
+
+// The set of distinct paths changed since a pipeline last ran. Paths are packed
+// into a single string buffer and deduplicated through an open-addressed table
+// of offsets into it.
+typedef struct {
+    char * strings;
+    int strings_len;
+    int strings_capacity;
+
+    int * slots;            // Offset into strings + 1, or 0 if empty
+    uint32_t * hashes;
+    int slot_capacity;      // Power of two
+
+    int count;
+    int incomplete;
+} ChangeSet;
+
+// Adds a path unless it's already present. Returns 1 if it was added, 0 if it
+// was a duplicate and -1 if the set had to be marked incomplete, which a path
+// containing a newline also does.
+int changeset_add(ChangeSet * set, char const * path);
+
+// Writes the set to fd as newline-separated paths.
+int changeset_write(ChangeSet * set, int fd);
+
+void changeset_clear(ChangeSet * set);
+void changeset_free(ChangeSet * set);
+
+#endif // CHANGESET_H
@@ -1,4 +1,20 @@
 #include "ctx.h"
 _Thread_local Ctx ctx;
 
-void set_default_ctx();
\ No newline at end of file
+#ifdef PIPELINES_ALLOC_STATS
+
+_Thread_local CtxStats ctx_stats;
+
+void * ctx_heap_alloc(size_t sz) {
+    ++ctx_stats.allocs;
+    return malloc(sz);
+}
+
+void ctx_heap_free(void * ptr) {
+    if (ptr != NULL) ++ctx_stats.frees;
+    free(ptr);
+}
+
+#endif
+
+void set_default_ctx();
@@ -2,10 +2,12 @@
 #define CTX_H
 
 #include <stdlib.h>
+#include <stdint.h>
 
 typedef struct {
     void * (*alloc)(size_t sz);
     void (*free)(void *);
+    void * state;       // Whatever the allocator needs restored with the context
 } Ctx;
 
 extern _Thread_local Ctx ctx;
@@ -13,9 +15,31 @@ extern _Thread_local Ctx ctx;
 #define ALLOC(x) (*ctx.alloc)(x)
 #define FREE(x) (*ctx.free)((void *) x)
 
+// Building with ALLOC_STATS=1 counts every heap allocation and free made on
+// the thread, which is how the event path is checked to make none.
+#ifdef PIPELINES_ALLOC_STATS
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+} CtxStats;
+
+extern _Thread_local CtxStats ctx_stats;
+
+void * ctx_heap_alloc(size_t sz);
+void ctx_heap_free(void * ptr);
+
+#else
+
+#define ctx_heap_alloc malloc
+#define ctx_heap_free free
+
+#endif
+
 inline void set_default_ctx() {
-    ctx.alloc = malloc;
-    ctx.free = free;
+    ctx.alloc = ctx_heap_alloc;
+    ctx.free = ctx_heap_free;
+    ctx.state = NULL;
 }
 
-#endif // CTX_H
\ No newline at end of file
+#endif // CTX_H
@@ -0,0 +1,315 @@
+#include "fanotify.h"
+#include "watch.h"
+#include "hash.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/fanotify.h>
+#include <sys/statfs.h>
+
+// Directory events, plus writes to files in any directory on the filesystem:
+#define FANOTIFY_MASK (FAN_CLOSE_WRITE | FAN_CREATE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO | FAN_ONDIR)
+
+// Events which cause the pipeline to run (creating a directory does too):
+#define FANOTIFY_TRIGGER_MASK (FAN_CLOSE_WRITE | FAN_DELETE | FAN_MOVED_FROM | FAN_MOVED_TO)
+
+#define FANOTIFY_READ_SIZE (64 * 1024)
+
+// Resolved directory paths, so a burst of events in one directory costs one
+// open_by_handle_at(). Longer paths are resolved every time.
+#define FANOTIFY_CACHE_SIZE 256
+#define FANOTIFY_CACHE_PATH 256
+
+typedef struct {
+    fsid_t fsid;
+    int fd;             // Any descriptor on the filesystem, for open_by_handle_at()
+} FanotifyFilesystem;
+
+typedef struct {
+    char * real;        // As the kernel spells it, with symlinks resolved
+    int real_len;
+    char * path;        // As the pipeline spells it, which is what gets recorded
+} FanotifyRoot;
+
+typedef struct {
+    uint64_t key;
+    int len;            // 0 if the entry is empty
+    char path[FANOTIFY_CACHE_PATH];
+} FanotifyCacheEntry;
+
+struct FanotifyWatch {
+    int fd;
+    FanotifyFilesystem * filesystems;
+    int filesystem_count;
+    FanotifyRoot * roots;
+    int root_count;
+    FanotifyCacheEntry * cache;
+};
+
+static char * fanotify_strdup(char const * s) {
+
+    int len = strlen(s);
+    char * copy = ALLOC(len + 1);
+    if (copy != NULL) memcpy(copy, s, len + 1);
+    return copy;
+}
+
+// Marks the filesystem holding a watch path, once per filesystem.
+static int fanotify_add_filesystem(FanotifyWatch * watch, char const * path) {
+
+    struct statfs st;
+    if (statfs(path, &st) < 0) return -1;
+
+    for (int i = 0; i < watch->filesystem_count; ++i) {
+        if (memcmp(&watch->filesystems[i].fsid, &st.f_fsid, sizeof(fsid_t)) == 0) return 0;
+    }
+
+    // open_by_handle_at() turns away O_PATH descriptors here:
+    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    if (fanotify_mark(watch->fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM, FANOTIFY_MASK, AT_FDCWD, path) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    watch->filesystems[watch->filesystem_count++] = (FanotifyFilesystem) { .fsid = st.f_fsid, .fd = fd };
+    return 0;
+}
+
+FanotifyWatch * fanotify_watch_open(Pipeline * pipeline) {
+
+    int path_count = 0;
+    for (char ** path = pipeline->watch_paths; path && *path; ++path) ++path_count;
+
+    FanotifyWatch * watch = ALLOC(sizeof(FanotifyWatch));
+    if (watch == NULL) return NULL;
+    memset(watch, 0, sizeof(FanotifyWatch));
+
+    // Nothing is read through the group's own descriptors (events carry file
+    // handles), and with the capability it needs anyway the queue can be
+    // unbounded, so it never overflows:
+    watch->fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | FAN_UNLIMITED_QUEUE |
+                              FAN_NONBLOCK | FAN_CLOEXEC, O_RDONLY);
+    if (watch->fd < 0) goto error;
+
+    watch->filesystems = ALLOC(sizeof(FanotifyFilesystem) * (path_count + 1));
+    watch->roots = ALLOC(sizeof(FanotifyRoot) * (path_count + 1));
+    watch->cache = ALLOC(sizeof(FanotifyCacheEntry) * FANOTIFY_CACHE_SIZE);
+    if (watch->filesystems == NULL || watch->roots == NULL || watch->cache == NULL) goto error;
+    memset(watch->cache, 0, sizeof(FanotifyCacheEntry) * FANOTIFY_CACHE_SIZE);
+
+    for (char ** path = pipeline->watch_paths; path && *path; ++path) {
+
+        char * full_path = join_path(pipeline->workdir, *path);
+        if (full_path == NULL) goto error;
+
+        char real[PATH_MAX];
+        if (realpath(full_path, real) == NULL || fanotify_add_filesystem(watch, real) < 0) {
+            FREE(full_path);
+            goto error;
+        }
+
+        FanotifyRoot * root = &watch->roots[watch->root_count++];
+        root->path = full_path;
+        root->real = fanotify_strdup(real);
+        if (root->real == NULL) goto error;
+
+        // The filesystem root would otherwise need a special case for its '/':
+        root->real_len = strcmp(real, "/") == 0 ? 0 : strlen(real);
+    }
+
+    return watch;
+
+error:;
+    int saved_errno = errno;
+    fanotify_watch_close(watch);
+    errno = saved_errno;
+    return NULL;
+}
+
+int fanotify_watch_fd(FanotifyWatch * watch) {
+    return watch->fd;
+}
+
+int fanotify_watch_count(FanotifyWatch * watch) {
+    return watch->filesystem_count;
+}
+
+// Writes the current path of the directory an event's file handle refers to.
+// Returns its length, or -1 if the directory can't be found any more.
+static int fanotify_dir_path(FanotifyWatch * watch, struct fanotify_event_info_fid * fid, char * buf, int size) {
+
+    struct file_handle * handle = (struct file_handle *) fid->handle;
+    uint64_t key = hash_bytes(handle->f_handle, handle->handle_bytes,
+                              hash_bytes(&fid->fsid, sizeof(fid->fsid), handle->handle_type));
+
+    FanotifyCacheEntry * entry = &watch->cache[key % FANOTIFY_CACHE_SIZE];
+    if (entry->len > 0 && entry->key == key && entry->len < size) {
+        memcpy(buf, entry->path, entry->len + 1);
+        return entry->len;
+    }
+
+    int mount_fd = -1;
+    for (int i = 0; i < watch->filesystem_count && mount_fd < 0; ++i) {
+        if (memcmp(&watch->filesystems[i].fsid, &fid->fsid, sizeof(fsid_t)) == 0) mount_fd = watch->filesystems[i].fd;
+    }
+    if (mount_fd < 0) return -1;
+
+    int fd = open_by_handle_at(mount_fd, handle, O_PATH | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    char link[32];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, buf, size - 1);
+    close(fd);
+    if (len <= 0 || len >= size - 1) return -1;
+    buf[len] = '\0';
+
+    if (len < FANOTIFY_CACHE_PATH) {
+        entry->key = key;
+        entry->len = len;
+        memcpy(entry->path, buf, len + 1);
+    }
+    return len;
+}
+
+// Directories that are moved or deleted take the cached paths below them along.
+static void fanotify_cache_clear(FanotifyWatch * watch) {
+    for (int i = 0; i < FANOTIFY_CACHE_SIZE; ++i) watch->cache[i].len = 0;
+}
+
+// Writes the path of the entry an event names, spelled as under the pipeline's
+// watch path it falls in, and sets root_len to the length of that watch path.
+// Returns the path's length, 0 if it's outside every watch path, or -1 if its
+// directory can't be found any more.
+static int fanotify_event_path(FanotifyWatch * watch, struct fanotify_event_info_fid * fid,
+                               char * buf, int size, int * root_len) {
+
+    char dir[PATH_MAX];
+    int dir_len = fanotify_dir_path(watch, fid, dir, sizeof(dir));
+    if (dir_len < 0) return -1;
+
+    // The entry name follows the handle, and is empty or "." for the
+    // directory itself:
+    struct file_handle * handle = (struct file_handle *) fid->handle;
+    char const * name = (char const *) handle->f_handle + handle->handle_bytes;
+
+    char full[PATH_MAX];
+    int full_len = name[0] == '\0' || strcmp(name, ".") == 0
+        ? snprintf(full, sizeof(full), "%s", dir)
+        : snprintf(full, sizeof(full), "%s%s%s", dir, dir_len > 1 ? "/" : "", name);
+    if (full_len >= (int) sizeof(full)) return -1;
+
+    for (int i = 0; i < watch->root_count; ++i) {
+
+        FanotifyRoot * root = &watch->roots[i];
+        if (strncmp(full, root->real, root->real_len) != 0) continue;
+
+        char const * rest = full + root->real_len;
+        if (*rest != '\0' && *rest != '/') continue;
+
+        // The filesystem root is kept as the kernel spells it:
+        int len = root->real_len == 0
+            ? snprintf(buf, size, "%s", full)
+            : snprintf(buf, size, "%s%s", root->path, rest);
+        *root_len = len - strlen(rest);
+        return len < size ? len : -1;
+    }
+
+    return 0;
+}
+
+// With no watches on excluded directories, inotify never reports anything
+// below them. A filesystem mark does, so each directory on the way down from
+// the watch path is checked instead.
+static int fanotify_excluded(Pipeline * pipeline, char * path, int root_len) {
+
+    for (char * slash = strchr(path + root_len + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        int excluded = filter_excludes_dir(&pipeline->filter, path);
+        *slash = '/';
+        if (excluded) return 1;
+    }
+    return 0;
+}
+
+// Without recursive, inotify only watches the watch path itself. A filesystem
+// mark reports every depth, so anything below its direct entries is dropped.
+static int fanotify_too_deep(Pipeline * pipeline, char const * path, int root_len) {
+    return !pipeline->recursive && path[root_len] != '\0' && strchr(path + root_len + 1, '/') != NULL;
+}
+
+int fanotify_watch_drain(Pipeline * pipeline, FanotifyWatch * watch, int * received, int * filtered) {
+
+    static char buf[FANOTIFY_READ_SIZE] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+    int count = 0;
+
+    for (;;) {
+
+        ssize_t r = read(watch->fd, buf, sizeof(buf));
+        if (r < 0) {
+            if (errno == EAGAIN) break;
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+
+        ssize_t len = r;
+        for (struct fanotify_event_metadata * ev = (struct fanotify_event_metadata *) buf;
+             FAN_EVENT_OK(ev, len); ev = FAN_EVENT_NEXT(ev, len)) {
+
+            if (ev->mask & FAN_Q_OVERFLOW) {
+                METRIC_ADD(pipeline->metrics, overflows, 1);
+                pipeline->changes.incomplete = 1;
+                ++*received;
+                ++count;
+                continue;
+            }
+
+            int is_dir = (ev->mask & FAN_ONDIR) != 0;
+            int trigger = ev->mask & FANOTIFY_TRIGGER_MASK || (ev->mask & FAN_CREATE && is_dir);
+
+            // Only the directory and name are asked for, so that's the one record:
+            struct fanotify_event_info_fid * fid = (struct fanotify_event_info_fid *) ((char *) ev + ev->metadata_len);
+            if (!trigger || ev->event_len <= ev->metadata_len || fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID_NAME) {
+                continue;
+            }
+
+            char path[PATH_MAX];
+            int root_len = 0;
+            int path_len = fanotify_event_path(watch, fid, path, sizeof(path), &root_len);
+            if (is_dir && ev->mask & (FAN_DELETE | FAN_MOVED_FROM)) fanotify_cache_clear(watch);
+
+            // A directory that's gone can't be placed, and may well be anywhere
+            // on the filesystem. If it was watched, its own removal is reported
+            // from its parent, which is still there:
+            if (path_len <= 0 || fanotify_too_deep(pipeline, path, root_len)) continue;
+
+            ++*received;
+            int relevant = !fanotify_excluded(pipeline, path, root_len) &&
+                           watch_record_path(pipeline, path, is_dir, (ev->mask & (FAN_DELETE | FAN_MOVED_FROM)) != 0);
+            count += relevant;
+            *filtered += !relevant;
+        }
+    }
+
+    return count;
+}
+
+void fanotify_watch_close(FanotifyWatch * watch) {
+
+    if (watch == NULL) return;
+
+    if (watch->fd >= 0) close(watch->fd);
+    for (int i = 0; i < watch->filesystem_count; ++i) close(watch->filesystems[i].fd);
+    for (int i = 0; i < watch->root_count; ++i) {
+        FREE(watch->roots[i].path);
+        FREE(watch->roots[i].real);
+    }
+
+    FREE(watch->filesystems);
+    FREE(watch->roots);
+    FREE(watch->cache);
+    FREE(watch);
+}
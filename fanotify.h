@@ -0,0 +1,33 @@
+#ifndef FANOTIFY_H
+#define FANOTIFY_H
+
+#include "pipelines.h"
+
+// The fanotify watch backend. One filesystem mark per filesystem holding a
+// watch path replaces a kernel watch per directory, so the kernel's cost and
+// the time taken to start don't grow with the size of the tree. Events name
+// the directory by file handle plus an entry name, and handles are resolved
+// back to paths with open_by_handle_at(). That needs CAP_SYS_ADMIN and
+// CAP_DAC_READ_SEARCH, and a 5.9 or newer kernel.
+typedef struct FanotifyWatch FanotifyWatch;
+
+// Opens the fanotify group and marks the filesystem of each watch path.
+// Returns NULL with errno set if that isn't allowed or supported.
+FanotifyWatch * fanotify_watch_open(Pipeline * pipeline);
+
+// The descriptor to poll for events.
+int fanotify_watch_fd(FanotifyWatch * watch);
+
+// The number of filesystems marked.
+int fanotify_watch_count(FanotifyWatch * watch);
+
+// Reads every queued event, recording the relevant ones through
+// watch_record_path(). Events outside the pipeline's watch paths are skipped,
+// as a filesystem mark reports everything on the filesystem. Returns the
+// number of relevant events or -1 on error; received and filtered are
+// incremented for the metrics.
+int fanotify_watch_drain(Pipeline * pipeline, FanotifyWatch * watch, int * received, int * filtered);
+
+void fanotify_watch_close(FanotifyWatch * watch);
+
+#endif // FANOTIFY_H
@@ -0,0 +1,339 @@
+#include "filter.h"
+#include "ctx.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+typedef enum {
+    FILTER_TOKEN_LITERAL,
+    FILTER_TOKEN_ANY,           // ?
+    FILTER_TOKEN_CLASS,         // [...]
+    FILTER_TOKEN_STAR,          // *, never crosses a '/'
+    FILTER_TOKEN_GLOBSTAR,      // **
+    FILTER_TOKEN_GLOBSTAR_DIR   // **/, zero or more whole directories
+} FilterTokenOp;
+
+struct FilterToken {
+    FilterTokenOp op;
+    int len;
+    char const * literal;
+    uint8_t set[32];
+};
+
+static int glob_match(FilterToken const * tokens, int count, char const * s) {
+
+    for (int t = 0; t < count; ++t) {
+
+        FilterToken const * token = &tokens[t];
+        switch (token->op) {
+
+            case FILTER_TOKEN_LITERAL: {
+                if (strncmp(s, token->literal, token->len) != 0) return 0;
+                s += token->len;
+                break;
+            }
+
+            case FILTER_TOKEN_ANY: {
+                if (*s == '\0' || *s == '/') return 0;
+                ++s;
+                break;
+            }
+
+            case FILTER_TOKEN_CLASS: {
+                unsigned char c = *s;
+                if (c == '\0' || !(token->set[c >> 3] & (1 << (c & 7)))) return 0;
+                ++s;
+                break;
+            }
+
+            case FILTER_TOKEN_STAR: {
+                for (char const * p = s;; ++p) {
+                    if (glob_match(token + 1, count - t - 1, p)) return 1;
+                    if (*p == '\0' || *p == '/') return 0;
+                }
+            }
+
+            case FILTER_TOKEN_GLOBSTAR: {
+                for (char const * p = s;; ++p) {
+                    if (glob_match(token + 1, count - t - 1, p)) return 1;
+                    if (*p == '\0') return 0;
+                }
+            }
+
+            case FILTER_TOKEN_GLOBSTAR_DIR: {
+                for (char const * p = s;; ++p) {
+                    if ((p == s || p[-1] == '/') && glob_match(token + 1, count - t - 1, p)) return 1;
+                    if (*p == '\0') return 0;
+                }
+            }
+        }
+    }
+
+    return *s == '\0';
+}
+
+static int filter_compile_glob(FilterRule * rule, char const * pattern) {
+
+    int len = strlen(pattern);
+    rule->tokens = ALLOC(sizeof(FilterToken) * (len + 1));
+    if (rule->tokens == NULL) return -1;
+
+    // Literal runs are copied here back to back, unescaped:
+    char * lit = rule->literal;
+    FilterToken * token = NULL;
+
+    for (char const * p = pattern; *p;) {
+
+        if (p[0] == '*' && p[1] == '*') {
+            p += 2;
+            token = &rule->tokens[rule->token_count++];
+            token->op = *p == '/' ? FILTER_TOKEN_GLOBSTAR_DIR : FILTER_TOKEN_GLOBSTAR;
+            if (*p == '/') ++p;
+
+        } else if (*p == '*') {
+            ++p;
+            token = &rule->tokens[rule->token_count++];
+            token->op = FILTER_TOKEN_STAR;
+
+        } else if (*p == '?') {
+            ++p;
+            token = &rule->tokens[rule->token_count++];
+            token->op = FILTER_TOKEN_ANY;
+
+        } else if (*p == '[') {
+
+            token = &rule->tokens[rule->token_count++];
+            token->op = FILTER_TOKEN_CLASS;
+            memset(token->set, 0, sizeof(token->set));
+
+            ++p;
+            int negate = *p == '!' || *p == '^';
+            if (negate) ++p;
+
+            // A ']' straight after the opening bracket is a literal member:
+            for (int first = 1; *p && (first || *p != ']'); first = 0) {
+                unsigned char lo = *p++, hi = lo;
+                if (p[0] == '-' && p[1] && p[1] != ']') {
+                    hi = p[1];
+                    p += 2;
+                }
+                for (unsigned c = lo; c <= hi; ++c) token->set[c >> 3] |= 1 << (c & 7);
+            }
+            if (*p != ']') return -1;
+            ++p;
+
+            if (negate) {
+                for (int i = 0; i < 32; ++i) token->set[i] = ~token->set[i];
+            }
+            token->set['/' >> 3] &= ~(1 << ('/' & 7));
+
+        } else {
+
+            if (*p == '\\' && p[1]) ++p;
+
+            if (token == NULL || token->op != FILTER_TOKEN_LITERAL) {
+                token = &rule->tokens[rule->token_count++];
+                token->op = FILTER_TOKEN_LITERAL;
+                token->literal = lit;
+                token->len = 0;
+            }
+            *lit++ = *p++;
+            ++token->len;
+        }
+    }
+
+    return 0;
+}
+
+static int filter_compile_rule(FilterRule * rule, char const * pattern) {
+
+    memset(rule, 0, sizeof(FilterRule));
+
+    // "dir/" means everything below dir:
+    int len = strlen(pattern);
+    rule->literal = ALLOC(len + 3);
+    if (rule->literal == NULL) return -1;
+
+    char * expanded = ALLOC(len + 3);
+    if (expanded == NULL) {
+        FREE(rule->literal);
+        rule->literal = NULL;
+        return -1;
+    }
+    memcpy(expanded, pattern, len + 1);
+    if (len > 1 && pattern[len - 1] == '/') {
+        memcpy(expanded + len, "**", 3);
+        len += 2;
+    }
+
+    rule->absolute = expanded[0] == '/';
+    rule->match_path = strchr(expanded, '/') != NULL;
+
+    int res = 0;
+    int has_meta = strpbrk(expanded, "*?[\\") != NULL;
+
+    if (!rule->match_path && !has_meta) {
+        rule->kind = FILTER_RULE_NAME;
+        memcpy(rule->literal, expanded, len + 1);
+
+    } else if (!rule->match_path && expanded[0] == '*' && strpbrk(expanded + 1, "*?[\\") == NULL) {
+        rule->kind = FILTER_RULE_SUFFIX;
+        memcpy(rule->literal, expanded + 1, len);
+
+    } else if (len > 3 && strcmp(expanded + len - 3, "/**") == 0
+               && strpbrk(expanded, "*?[\\") == expanded + len - 2) {
+        rule->kind = FILTER_RULE_PREFIX;
+        memcpy(rule->literal, expanded, len - 3);
+        rule->literal[len - 3] = '\0';
+
+    } else {
+        rule->kind = FILTER_RULE_GLOB;
+        res = filter_compile_glob(rule, expanded);
+    }
+
+    // A glob's literal runs aren't terminated, each token keeps its own length:
+    if (rule->kind != FILTER_RULE_GLOB) rule->literal_len = strlen(rule->literal);
+    FREE(expanded);
+    return res;
+}
+
+static int filter_compile_rules(FilterRule ** rules, int * count, char ** patterns) {
+
+    int n = 0;
+    while (patterns && patterns[n]) ++n;
+    if (n == 0) return 0;
+
+    *rules = ALLOC(sizeof(FilterRule) * n);
+    if (*rules == NULL) return -1;
+    memset(*rules, 0, sizeof(FilterRule) * n);
+
+    for (int i = 0; i < n; ++i) {
+        *count = i + 1;
+        if (filter_compile_rule(&(*rules)[i], patterns[i]) < 0) {
+            printf("Invalid glob \"%s\"\n", patterns[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int filter_compile(Filter * filter, char ** include, char ** exclude, char const * base) {
+
+    memset(filter, 0, sizeof(Filter));
+
+    if (base != NULL) {
+        filter->base_len = strlen(base);
+        filter->base = ALLOC(filter->base_len + 1);
+        if (filter->base == NULL) return -1;
+        memcpy(filter->base, base, filter->base_len + 1);
+    }
+
+    if (filter_compile_rules(&filter->include, &filter->include_count, include) < 0 ||
+        filter_compile_rules(&filter->exclude, &filter->exclude_count, exclude) < 0) {
+        filter_free(filter);
+        return -1;
+    }
+    return 0;
+}
+
+static int rule_match(FilterRule const * rule, char const * name, char const * rel, char const * path) {
+
+    char const * subject = !rule->match_path ? name : rule->absolute ? path : rel;
+
+    switch (rule->kind) {
+
+        case FILTER_RULE_NAME: {
+            return strcmp(subject, rule->literal) == 0;
+        }
+
+        case FILTER_RULE_SUFFIX: {
+            int len = strlen(subject);
+            return len >= rule->literal_len
+                && memcmp(subject + len - rule->literal_len, rule->literal, rule->literal_len) == 0;
+        }
+
+        case FILTER_RULE_PREFIX: {
+            return strncmp(subject, rule->literal, rule->literal_len) == 0
+                && (subject[rule->literal_len] == '/' || subject[rule->literal_len] == '\0');
+        }
+
+        case FILTER_RULE_GLOB: {
+            return glob_match(rule->tokens, rule->token_count, subject);
+        }
+    }
+
+    return 0;
+}
+
+static int rules_match(FilterRule const * rules, int count, char const * name, char const * rel, char const * path) {
+    for (int i = 0; i < count; ++i) {
+        if (rule_match(&rules[i], name, rel, path)) return 1;
+    }
+    return 0;
+}
+
+static char const * filter_relative(Filter const * filter, char const * path) {
+
+    if (filter->base != NULL && strncmp(path, filter->base, filter->base_len) == 0) {
+        if (path[filter->base_len] == '/') return path + filter->base_len + 1;
+        if (path[filter->base_len] == '\0') return path + filter->base_len;
+    }
+    return path;
+}
+
+int filter_match(Filter const * filter, char const * path) {
+
+    if (filter->include_count == 0 && filter->exclude_count == 0) return 1;
+
+    char const * rel = filter_relative(filter, path);
+    char const * slash = strrchr(path, '/');
+    char const * name = slash ? slash + 1 : path;
+
+    if (filter->include_count > 0 && !rules_match(filter->include, filter->include_count, name, rel, path)) {
+        return 0;
+    }
+    return !rules_match(filter->exclude, filter->exclude_count, name, rel, path);
+}
+
+int filter_excludes_dir(Filter const * filter, char const * path) {
+
+    if (filter->exclude_count == 0) return 0;
+
+    // Directory globs are tested with a trailing slash, so that "build/**"
+    // excludes the build directory itself and not just what's inside it:
+    char dir[PATH_MAX];
+    int len = snprintf(dir, sizeof(dir), "%s/", path);
+    if (len < 0 || len >= (int) sizeof(dir)) return 0;
+
+    char const * rel = filter_relative(filter, dir);
+    dir[len - 1] = '\0';
+    char const * slash = strrchr(dir, '/');
+    char const * name = slash ? slash + 1 : dir;
+    dir[len - 1] = '/';
+
+    // Names are compared without the slash:
+    char name_copy[NAME_MAX + 1];
+    int name_len = dir + len - 1 - name;
+    if (name_len > NAME_MAX) return 0;
+    memcpy(name_copy, name, name_len);
+    name_copy[name_len] = '\0';
+
+    return rules_match(filter->exclude, filter->exclude_count, name_copy, rel, dir);
+}
+
+static void filter_free_rules(FilterRule * rules, int count) {
+    for (int i = 0; i < count; ++i) {
+        FREE(rules[i].literal);
+        FREE(rules[i].tokens);
+    }
+    FREE(rules);
+}
+
+void filter_free(Filter * filter) {
+
+    filter_free_rules(filter->include, filter->include_count);
+    filter_free_rules(filter->exclude, filter->exclude_count);
+    FREE(filter->base);
+    memset(filter, 0, sizeof(Filter));
+}
@@ -0,0 +1,52 @@
+#ifndef FILTER_H
+#define FILTER_H
+
+#include <stdint.h>
+
+// A glob compiled into a flat token program. Patterns without a '/' match the
+// file name only (as in .gitignore); patterns with one match the path relative
+// to the pipeline's workdir, or the absolute path if they start with '/'.
+// Plain names, "*.ext" suffixes and "dir/**" prefixes skip the glob matcher.
+typedef enum {
+    FILTER_RULE_NAME,
+    FILTER_RULE_SUFFIX,
+    FILTER_RULE_PREFIX,
+    FILTER_RULE_GLOB
+} FilterRuleKind;
+
+typedef struct FilterToken FilterToken;
+
+typedef struct {
+    FilterRuleKind kind;
+    int match_path;         // Match against the (relative) path, not the name
+    int absolute;           // Match against the absolute path
+    char * literal;         // Name, suffix or prefix for the fast kinds
+    int literal_len;
+    FilterToken * tokens;   // Program for FILTER_RULE_GLOB
+    int token_count;
+} FilterRule;
+
+typedef struct {
+    FilterRule * include;
+    int include_count;
+    FilterRule * exclude;
+    int exclude_count;
+    char * base;
+    int base_len;
+} Filter;
+
+// Compiles the include and exclude globs. Either list may be NULL. Returns -1
+// and prints the offending pattern if one can't be compiled.
+int filter_compile(Filter * filter, char ** include, char ** exclude, char const * base);
+
+// Returns 1 if an event on the absolute path should be acted upon: it matches
+// an include glob (or there are none) and matches no exclude glob.
+int filter_match(Filter const * filter, char const * path);
+
+// Returns 1 if the directory at the absolute path is excluded outright, in
+// which case it needn't be watched at all.
+int filter_excludes_dir(Filter const * filter, char const * path);
+
+void filter_free(Filter * filter);
+
+#endif // FILTER_H
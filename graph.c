@@ -0,0 +1,122 @@
+#include "graph.h"
+#include "timeline.h"
+
+static int graph_find(Pipeline * pipelines, int count, char const * name) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(pipelines[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int graph_append(int ** list, int * count, int value) {
+
+    int * new_list = ALLOC(sizeof(int) * (*count + 1));
+    if (new_list == NULL) return -1;
+
+    if (*list != NULL) {
+        memcpy(new_list, *list, sizeof(int) * *count);
+        FREE(*list);
+    }
+    new_list[(*count)++] = value;
+    *list = new_list;
+    return 0;
+}
+
+int graph_resolve(Pipeline * pipelines, int count, int * order) {
+
+    for (int i = 0; i < count; ++i) {
+        for (char ** name = pipelines[i].depends_on; name && *name; ++name) {
+
+            int upstream = graph_find(pipelines, count, *name);
+            if (upstream < 0) {
+                printf("Pipeline %s depends on unknown pipeline \"%s\"\n", pipelines[i].name, *name);
+                return -1;
+            }
+
+            if (graph_append(&pipelines[i].upstream, &pipelines[i].upstream_count, upstream) < 0 ||
+                graph_append(&pipelines[upstream].downstream, &pipelines[upstream].downstream_count, i) < 0) {
+                return -1;
+            }
+        }
+    }
+
+    // Kahn's algorithm, using order[] itself as the queue:
+    int * pending = ALLOC(sizeof(int) * (count + 1));
+    if (pending == NULL) return -1;
+
+    int head = 0, tail = 0;
+    for (int i = 0; i < count; ++i) {
+        pending[i] = pipelines[i].upstream_count;
+        if (pending[i] == 0) order[tail++] = i;
+    }
+
+    while (head < tail) {
+        Pipeline * pipeline = &pipelines[order[head++]];
+        for (int d = 0; d < pipeline->downstream_count; ++d) {
+            if (--pending[pipeline->downstream[d]] == 0) order[tail++] = pipeline->downstream[d];
+        }
+    }
+
+    if (tail < count) {
+        printf("Dependency cycle between pipelines:");
+        for (int i = 0; i < count; ++i) {
+            if (pending[i] > 0) printf(" %s", pipelines[i].name);
+        }
+        printf("\n");
+    }
+
+    FREE(pending);
+    return tail < count ? -1 : 0;
+}
+
+void graph_update_blocked(Pipeline * pipelines, int const * order, int count) {
+
+    // Upstreams come first in order[], so their state is final when read:
+    for (int i = 0; i < count; ++i) {
+
+        Pipeline * pipeline = &pipelines[order[i]];
+        pipeline->blocked = 0;
+
+        for (int u = 0; u < pipeline->upstream_count; ++u) {
+            Pipeline * upstream = &pipelines[pipeline->upstream[u]];
+            if (upstream->blocked || upstream->dirty || upstream->pid != 0) {
+                pipeline->blocked = 1;
+                break;
+            }
+        }
+    }
+}
+
+void graph_propagate(Pipeline * pipelines, Pipeline * upstream) {
+
+    for (int d = 0; d < upstream->downstream_count; ++d) {
+
+        Pipeline * downstream = &pipelines[upstream->downstream[d]];
+
+        // Without declared outputs there's nothing specific to report:
+        if (upstream->outputs == NULL) downstream->changes.incomplete = 1;
+
+        for (char ** output = upstream->outputs; output && *output; ++output) {
+            char * path = scratch_join_path(upstream->workdir, *output);
+            if (path == NULL) {
+                downstream->changes.incomplete = 1;
+                continue;
+            }
+            changeset_add(&downstream->changes, path);
+        }
+
+        printf(">> Pipeline %s triggered by %s\n", downstream->name, upstream->name);
+        if (!downstream->dirty) timeline_triggered(downstream, upstream);
+        pipeline_mark_dirty(downstream);
+    }
+}
+
+void graph_free(Pipeline * pipeline) {
+
+    FREE(pipeline->upstream);
+    FREE(pipeline->downstream);
+    pipeline->upstream = NULL;
+    pipeline->downstream = NULL;
+    pipeline->upstream_count = 0;
+    pipeline->downstream_count = 0;
+}
@@ -0,0 +1,22 @@
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include "pipelines.h"
+
+// Resolves each pipeline's depends_on names into upstream and downstream
+// index lists and writes a topological order of all pipelines into order.
+// Returns -1 (after printing why) on an unknown name or a dependency cycle.
+int graph_resolve(Pipeline * pipelines, int count, int * order);
+
+// Recomputes which pipelines are blocked: those with an upstream, direct or
+// transitive, that is dirty or running. A blocked pipeline must not start,
+// so a downstream runs once after its upstreams rather than mid-build.
+void graph_update_blocked(Pipeline * pipelines, int const * order, int count);
+
+// Marks the downstreams of a pipeline dirty after a run that changed its
+// outputs, recording the outputs as the changed paths.
+void graph_propagate(Pipeline * pipelines, Pipeline * upstream);
+
+void graph_free(Pipeline * pipeline);
+
+#endif // GRAPH_H
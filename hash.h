@@ -0,0 +1,16 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// XXH64, a fast non-cryptographic 64-bit hash. Good for spotting changed file
+// contents, not for anything adversarial.
+uint64_t hash_bytes(void const * data, size_t len, uint64_t seed);
+
+uint64_t hash_str(char const * str);
+
+// Hashes the contents of a regular file. Returns -1 if it can't be read.
+int hash_file(char const * path, uint64_t * result);
+
+#endif // HASH_H
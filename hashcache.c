@@ -0,0 +1,225 @@
+#include "hashcache.h"
+#include "hash.h"
+#include "ctx.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define HASHCACHE_MAGIC 0x4348504cu   // "PLHC"
+#define HASHCACHE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t count;
+} HashCacheHeader;
+
+uint64_t hashcache_key(char const * file_path) {
+    // Zero is reserved for empty slots:
+    uint64_t key = hash_str(file_path);
+    return key ? key : 1;
+}
+
+static HashEntry * hashcache_slot(HashCache * cache, uint64_t key) {
+
+    uint32_t mask = cache->capacity - 1;
+    uint32_t i = key & mask;
+    while (cache->entries[i].key != 0 && cache->entries[i].key != key) {
+        i = (i + 1) & mask;
+    }
+    return &cache->entries[i];
+}
+
+// Moves the table into memory we own, doubling it if asked to.
+static int hashcache_rebuild(HashCache * cache, uint32_t capacity) {
+
+    HashEntry * entries = ALLOC(sizeof(HashEntry) * capacity);
+    if (entries == NULL) return -1;
+    memset(entries, 0, sizeof(HashEntry) * capacity);
+
+    HashEntry * old_entries = cache->entries;
+    uint32_t old_capacity = cache->capacity;
+    cache->entries = entries;
+    cache->capacity = capacity;
+
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old_entries[i].key != 0) {
+            *hashcache_slot(cache, old_entries[i].key) = old_entries[i];
+        }
+    }
+
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+    } else {
+        FREE(old_entries);
+    }
+    return 0;
+}
+
+int hashcache_load(HashCache * cache, char const * path) {
+
+    memset(cache, 0, sizeof(HashCache));
+    cache->path = copy_str(path);
+    if (cache->path == NULL) return -1;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+
+        struct stat st;
+        HashCacheHeader header;
+        if (fstat(fd, &st) == 0 && pread(fd, &header, sizeof(header), 0) == sizeof(header)
+            && header.magic == HASHCACHE_MAGIC && header.version == HASHCACHE_VERSION
+            && header.capacity > 0 && (header.capacity & (header.capacity - 1)) == 0
+            && (size_t) st.st_size == sizeof(header) + sizeof(HashEntry) * header.capacity) {
+
+            // Private mapping: updates stay in our copy until the next save.
+            void * map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                cache->map = map;
+                cache->map_size = st.st_size;
+                cache->entries = (HashEntry *) ((char *) map + sizeof(header));
+                cache->capacity = header.capacity;
+                cache->count = header.count;
+            }
+        }
+        close(fd);
+    }
+
+    if (cache->entries == NULL) {
+        return hashcache_rebuild(cache, 1024);
+    }
+    return 0;
+}
+
+int hashcache_init(HashCache * cache, char const * path) {
+
+    memset(cache, 0, sizeof(HashCache));
+    cache->path = copy_str(path);
+    if (cache->path == NULL || hashcache_rebuild(cache, 1024) < 0) {
+        FREE(cache->path);
+        return -1;
+    }
+
+    // An empty cache is still worth writing out over whatever was there:
+    cache->modified = 1;
+    return 0;
+}
+
+int hashcache_get(HashCache * cache, uint64_t key, uint64_t * content) {
+
+    HashEntry * entry = hashcache_slot(cache, key ? key : 1);
+    if (entry->key == 0) return 0;
+
+    *content = entry->content_hash;
+    return 1;
+}
+
+int hashcache_put(HashCache * cache, uint64_t key, uint64_t content) {
+
+    // Keep the table at most half full:
+    if ((cache->count + 1) * 2 > cache->capacity && hashcache_rebuild(cache, cache->capacity * 2) < 0) {
+        return -1;
+    }
+
+    if (key == 0) key = 1;
+    HashEntry * entry = hashcache_slot(cache, key);
+
+    if (entry->key == key && entry->content_hash == content) return 0;
+
+    if (entry->key == 0) ++cache->count;
+    entry->key = key;
+    entry->content_hash = content;
+    cache->modified = 1;
+    return 1;
+}
+
+int hashcache_update(HashCache * cache, char const * file_path) {
+
+    uint64_t content;
+    if (hash_file(file_path, &content) < 0) return 1;
+
+    return hashcache_put(cache, hashcache_key(file_path), content) != 0;
+}
+
+void hashcache_remove(HashCache * cache, char const * file_path) {
+
+    uint64_t key = hashcache_key(file_path);
+    HashEntry * entry = hashcache_slot(cache, key);
+    if (entry->key != key) return;
+
+    // Backward-shift deletion keeps linear probing correct without tombstones:
+    uint32_t mask = cache->capacity - 1;
+    uint32_t i = entry - cache->entries;
+    uint32_t j = i;
+    for (;;) {
+        j = (j + 1) & mask;
+        if (cache->entries[j].key == 0) break;
+
+        uint32_t home = cache->entries[j].key & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            cache->entries[i] = cache->entries[j];
+            i = j;
+        }
+    }
+    cache->entries[i].key = 0;
+    --cache->count;
+    cache->modified = 1;
+}
+
+int hashcache_save(HashCache * cache) {
+
+    if (!cache->modified) return 0;
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", cache->path) >= (int) sizeof(tmp_path)) return -1;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+
+    HashCacheHeader header = {
+        .magic = HASHCACHE_MAGIC,
+        .version = HASHCACHE_VERSION,
+        .capacity = cache->capacity,
+        .count = cache->count
+    };
+
+    // The data has to reach the disk before the rename does, or a power loss
+    // can leave the name pointing at an empty or partial file:
+    int ok = write_all(fd, &header, sizeof(header)) == 0
+          && write_all(fd, cache->entries, sizeof(HashEntry) * cache->capacity) == 0
+          && fsync(fd) == 0;
+    close(fd);
+
+    if (!ok || rename(tmp_path, cache->path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+
+    cache->modified = 0;
+    return 0;
+}
+
+void hashcache_clear(HashCache * cache) {
+
+    memset(cache->entries, 0, sizeof(HashEntry) * cache->capacity);
+    cache->count = 0;
+    cache->modified = 1;
+}
+
+void hashcache_close(HashCache * cache) {
+
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+    } else {
+        FREE(cache->entries);
+    }
+    FREE(cache->path);
+    memset(cache, 0, sizeof(HashCache));
+}
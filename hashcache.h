@@ -0,0 +1,56 @@
+#ifndef HASHCACHE_H
+#define HASHCACHE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A persistent table of 64-bit content hashes under 64-bit keys, normally the
+// hash of a file's path. The on-disk file is a 16 byte header followed by the open-
+// addressed entry table exactly as it's used in memory, so loading it is a
+// single mmap() and lookups work straight off the mapped pages.
+typedef struct {
+    uint64_t key;           // 0 marks an empty slot
+    uint64_t content_hash;
+} HashEntry;
+
+typedef struct {
+    HashEntry * entries;
+    uint32_t capacity;      // Power of two
+    uint32_t count;
+    void * map;             // Non-NULL while entries point into the mapped file
+    size_t map_size;
+    int modified;
+    char * path;
+} HashCache;
+
+// Loads the cache stored at path, or starts an empty one if there isn't a
+// valid file there yet.
+int hashcache_load(HashCache * cache, char const * path);
+
+// Starts an empty cache that will be saved to path, ignoring any file there.
+int hashcache_init(HashCache * cache, char const * path);
+
+// The key a file's path is stored under.
+uint64_t hashcache_key(char const * file_path);
+
+// Rehashes a changed file and records the new hash. Returns 1 if its contents
+// differ from the recorded hash (or it's new, or unreadable) and 0 if they're
+// identical.
+int hashcache_update(HashCache * cache, char const * file_path);
+
+// Looks up or stores a hash under an arbitrary key. hashcache_put returns 1 if
+// the stored value changed, 0 if it was already there and -1 on failure.
+int hashcache_get(HashCache * cache, uint64_t key, uint64_t * content);
+int hashcache_put(HashCache * cache, uint64_t key, uint64_t content);
+
+// Forgets a file that was deleted or moved away.
+void hashcache_remove(HashCache * cache, char const * file_path);
+
+// Writes the cache back to its file if it was modified. The file is replaced
+// atomically, so a crash never leaves a torn cache behind.
+int hashcache_save(HashCache * cache);
+
+void hashcache_clear(HashCache * cache);
+void hashcache_close(HashCache * cache);
+
+#endif // HASHCACHE_H
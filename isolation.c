@@ -0,0 +1,242 @@
+#include "isolation.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/ioprio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+static int watcher_raised;
+
+int isolation_parse_ioprio(char const * value, int * ioprio) {
+
+    char const * level = strchr(value, ':');
+    int name_len = level != NULL ? level - value : (int) strlen(value);
+
+    int class;
+    if (name_len == 4 && strncmp(value, "idle", 4) == 0) class = IOPRIO_CLASS_IDLE;
+    else if (name_len == 11 && strncmp(value, "best-effort", 11) == 0) class = IOPRIO_CLASS_BE;
+    else if (name_len == 8 && strncmp(value, "realtime", 8) == 0) class = IOPRIO_CLASS_RT;
+    else return -1;
+
+    // Levels run from 0 (highest) to 7, and the kernel's default is 4. The
+    // idle class doesn't have any:
+    int data = class == IOPRIO_CLASS_IDLE ? 0 : 4;
+    if (level != NULL) {
+        if (class == IOPRIO_CLASS_IDLE || level[1] < '0' || level[1] > '7' || level[2] != '\0') return -1;
+        data = level[1] - '0';
+    }
+
+    *ioprio = IOPRIO_PRIO_VALUE(class, data);
+    return 0;
+}
+
+int isolation_parse_cpus(char const * value, cpu_set_t * cpus) {
+
+    CPU_ZERO(cpus);
+
+    char const * p = value;
+    for (;;) {
+
+        char * end;
+        long first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE) return -1;
+
+        long last = first;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) return -1;
+        }
+
+        for (long cpu = first; cpu <= last; ++cpu) CPU_SET(cpu, cpus);
+
+        if (*end == '\0') break;
+        if (*end != ',') return -1;
+        p = end + 1;
+    }
+
+    return CPU_COUNT(cpus) > 0 ? 0 : -1;
+}
+
+int isolation_needed(Pipeline const * pipeline) {
+    return pipeline->nice != 0 || pipeline->ioprio != 0 || pipeline->cpus != NULL || pipeline->cgroup != NULL;
+}
+
+int isolation_wrap(Pipeline * pipeline) {
+
+    if (!isolation_needed(pipeline)) return 0;
+
+    // Unset parts of the class are passed as empty arguments:
+    char nice[16] = "";
+    char ioprio[16] = "";
+    char cpu_weight[16] = "";
+    if (pipeline->nice != 0) snprintf(nice, sizeof(nice), "%d", pipeline->nice);
+    if (pipeline->ioprio != 0) snprintf(ioprio, sizeof(ioprio), "%d", pipeline->ioprio);
+    if (pipeline->cpu_weight != 0) snprintf(cpu_weight, sizeof(cpu_weight), "%d", pipeline->cpu_weight);
+
+    char const * prefix[ISOLATION_ARGC] = {
+        ISOLATION_EXE, ISOLATION_ARG, nice, ioprio,
+        pipeline->cpus ? pipeline->cpus : "",
+        pipeline->cgroup ? pipeline->cgroup : "",
+        cpu_weight,
+        pipeline->memory_high ? pipeline->memory_high : ""
+    };
+
+    int count = 0;
+    while (pipeline->argv[count]) ++count;
+
+    char ** argv = ALLOC(sizeof(char *) * (ISOLATION_ARGC + count + 1));
+    if (argv == NULL) return -1;
+
+    for (int i = 0; i < ISOLATION_ARGC; ++i) {
+        argv[i] = copy_str(prefix[i]);
+        if (argv[i] == NULL) {
+            while (i-- > 0) FREE(argv[i]);
+            FREE(argv);
+            return -1;
+        }
+    }
+    memcpy(argv + ISOLATION_ARGC, pipeline->argv, sizeof(char *) * (count + 1));
+
+    FREE(pipeline->argv);
+    pipeline->argv = argv;
+    return 0;
+}
+
+char * const * isolation_unwrap(char * const * argv) {
+
+    if (argv != NULL && argv[0] != NULL && argv[1] != NULL &&
+        strcmp(argv[0], ISOLATION_EXE) == 0 && strcmp(argv[1], ISOLATION_ARG) == 0) {
+        return argv + ISOLATION_ARGC;
+    }
+    return argv;
+}
+
+void isolation_raise_watcher() {
+
+    errno = 0;
+    int nice = getpriority(PRIO_PROCESS, 0);
+    if (errno == 0 && nice <= ISOLATION_WATCHER_NICE) return;
+
+    // The flag has to be set first, so that no command is ever started with
+    // the raised priority. It keeps the current policy:
+    struct sched_param param;
+    int policy = sched_getscheduler(0);
+    if (policy < 0 || sched_getparam(0, &param) < 0 ||
+        sched_setscheduler(0, policy | SCHED_RESET_ON_FORK, &param) < 0 ||
+        setpriority(PRIO_PROCESS, 0, ISOLATION_WATCHER_NICE) < 0) {
+        printf(">> Unable to raise the watcher's priority: %s\n", strerror(errno));
+        return;
+    }
+    watcher_raised = 1;
+}
+
+int isolation_watcher_raised() {
+    return watcher_raised;
+}
+
+// The rest runs in the process a command is started through, which shares
+// the command's stdout and stderr. A worker's stdout carries its protocol, so
+// problems go to stderr.
+
+static void isolation_warn(char const * what, char const * value) {
+    fprintf(stderr, ">> Unable to %s %s: %s\n", what, value, strerror(errno));
+}
+
+// Writes value to one of a cgroup's files.
+static int isolation_write(char const * cgroup, char const * file, char const * value) {
+
+    char path[PATH_MAX];
+    if (snprintf(path, sizeof(path), "%s/%s", cgroup, file) >= (int) sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    int res = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+    close(fd);
+    return res;
+}
+
+// Sets a controller's file in the cgroup. A cgroup only has the files of the
+// controllers its parent enables for its children, so that's done first if
+// the file is missing.
+static void isolation_set(char const * cgroup, char const * controller, char const * file, char const * value) {
+
+    if (isolation_write(cgroup, file, value) == 0) return;
+
+    if (errno == ENOENT) {
+
+        char parent[PATH_MAX];
+        char enable[32];
+        snprintf(parent, sizeof(parent), "%s", cgroup);
+        char * slash = strrchr(parent, '/');
+        if (slash != NULL && slash != parent) *slash = '\0';
+        snprintf(enable, sizeof(enable), "+%s", controller);
+
+        if (isolation_write(parent, "cgroup.subtree_control", enable) == 0 &&
+            isolation_write(cgroup, file, value) == 0) {
+            return;
+        }
+    }
+
+    fprintf(stderr, ">> Unable to set %s/%s to %s: %s\n", cgroup, file, value, strerror(errno));
+}
+
+static void isolation_join_cgroup(char const * cgroup, char const * cpu_weight, char const * memory_high) {
+
+    if (mkdir(cgroup, 0755) < 0 && errno != EEXIST) {
+        isolation_warn("create cgroup", cgroup);
+        return;
+    }
+
+    // Settings are written on every run, so edits to them take effect
+    // without removing the cgroup:
+    if (*cpu_weight) isolation_set(cgroup, "cpu", "cpu.weight", cpu_weight);
+    if (*memory_high) isolation_set(cgroup, "memory", "memory.high", memory_high);
+
+    // "0" is the writing process:
+    if (isolation_write(cgroup, "cgroup.procs", "0") < 0) isolation_warn("join cgroup", cgroup);
+}
+
+int isolation_exec(int argc, char ** argv) {
+
+    if (argc <= ISOLATION_ARGC) {
+        fprintf(stderr, ">> %s needs a class and a command\n", ISOLATION_ARG);
+        return 127;
+    }
+
+    char const * nice = argv[2];
+    char const * ioprio = argv[3];
+    char const * cpus = argv[4];
+    char const * cgroup = argv[5];
+    char const * cpu_weight = argv[6];
+    char const * memory_high = argv[7];
+
+    // Each part is applied to this process before the command replaces it,
+    // so nothing the command starts can escape them. A part that can't be
+    // applied is reported, and the command runs without it:
+    if (*cgroup) isolation_join_cgroup(cgroup, cpu_weight, memory_high);
+
+    if (*cpus) {
+        cpu_set_t set;
+        int res = isolation_parse_cpus(cpus, &set);
+        if (res < 0) errno = EINVAL;
+        else res = sched_setaffinity(0, sizeof(set), &set);
+        if (res < 0) isolation_warn("run on CPUs", cpus);
+    }
+
+    if (*ioprio && syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, atoi(ioprio)) < 0) {
+        isolation_warn("set I/O priority", ioprio);
+    }
+
+    if (*nice && setpriority(PRIO_PROCESS, 0, atoi(nice)) < 0) isolation_warn("set nice value", nice);
+
+    execv(argv[ISOLATION_ARGC], argv + ISOLATION_ARGC);
+    isolation_warn("run", argv[ISOLATION_ARGC]);
+    return 127;
+}
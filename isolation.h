@@ -0,0 +1,59 @@
+#ifndef ISOLATION_H
+#define ISOLATION_H
+
+#include "pipelines.h"
+
+#include <sched.h>
+
+// Resource classes, which keep a rebuild from competing with the program a
+// pipeline is running and with the watcher itself. A pipeline's nice value,
+// I/O priority, CPU affinity and cgroup v2 placement apply to its command and
+// everything the command starts.
+//
+// posix_spawn() can't change any of these in the child before it execs, and
+// changing them afterwards races with whatever the command forks. So commands
+// with a class are started through pipelines itself: isolation_wrap() puts
+// "/proc/self/exe --isolate <class>" in front of the pipeline's argv, and that
+// process applies the class with isolation_exec() before exec'ing the command.
+// Pipelines without one are started directly, as before.
+
+// The argv entries isolation_wrap() puts in front of the command:
+#define ISOLATION_EXE "/proc/self/exe"
+#define ISOLATION_ARG "--isolate"
+#define ISOLATION_ARGC 8
+
+// The nice value the watcher asks for once any pipeline has a class:
+#define ISOLATION_WATCHER_NICE -5
+
+// Parses an I/O priority such as "idle", "best-effort" or "realtime:2" into
+// the value ioprio_set() takes. Returns -1 if it isn't one.
+int isolation_parse_ioprio(char const * value, int * ioprio);
+
+// Parses a CPU list such as "0-3,6", as taskset -c takes. Returns -1 if it
+// isn't one or is empty.
+int isolation_parse_cpus(char const * value, cpu_set_t * cpus);
+
+// Returns 1 if the pipeline sets any part of a class.
+int isolation_needed(Pipeline const * pipeline);
+
+// Starts the pipeline's command through isolation_exec() if it has a class.
+// Called by pipeline_prepare() once argv is built.
+int isolation_wrap(Pipeline * pipeline);
+
+// Returns the command a wrapped argv runs, or argv itself.
+char * const * isolation_unwrap(char * const * argv);
+
+// Raises the calling process above the commands it starts: a negative nice
+// value, which SCHED_RESET_ON_FORK keeps children from inheriting. Needs
+// CAP_SYS_NICE or a high enough RLIMIT_NICE, and is left alone otherwise.
+void isolation_raise_watcher();
+
+// Whether isolation_raise_watcher() was called. Monitor processes call it
+// again after fork(), since the raised priority isn't inherited.
+int isolation_watcher_raised();
+
+// The entry point for a command started through "--isolate". Applies the
+// class and execs the command, so only returns on failure.
+int isolation_exec(int argc, char ** argv);
+
+#endif // ISOLATION_H
@@ -0,0 +1,68 @@
+#include "jobserver.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+Jobserver jobserver = { .read_fd = -1, .write_fd = -1, .poll_fd = -1 };
+
+int jobserver_open(int tokens) {
+
+    // Children need these descriptors, so they're deliberately not CLOEXEC:
+    int fds[2];
+    if (pipe(fds) < 0) return -1;
+
+    // O_NONBLOCK belongs to the open file description, and older versions of
+    // make expect a blocking read end. Reopening the pipe through /proc gives
+    // us a description of our own to poll and read without blocking.
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fds[0]);
+    int poll_fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (poll_fd < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    for (int i = 0; i < tokens; ++i) {
+        if (write(fds[1], "+", 1) != 1) {
+            close(fds[0]);
+            close(fds[1]);
+            close(poll_fd);
+            return -1;
+        }
+    }
+
+    jobserver.read_fd = fds[0];
+    jobserver.write_fd = fds[1];
+    jobserver.poll_fd = poll_fd;
+    jobserver.tokens = tokens;
+    snprintf(jobserver.makeflags, sizeof(jobserver.makeflags),
+             "MAKEFLAGS= -j%d --jobserver-auth=%d,%d", tokens, fds[0], fds[1]);
+    return 0;
+}
+
+int jobserver_enabled() {
+    return jobserver.read_fd >= 0;
+}
+
+int jobserver_try_acquire() {
+
+    char token;
+    for (;;) {
+        ssize_t r = read(jobserver.poll_fd, &token, 1);
+        if (r == 1) return 1;
+        if (r < 0 && errno == EINTR) continue;
+        return 0;
+    }
+}
+
+void jobserver_release() {
+    while (write(jobserver.write_fd, "+", 1) < 0 && errno == EINTR);
+}
+
+char const * jobserver_makeflags() {
+    return jobserver_enabled() ? jobserver.makeflags : NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef JOBSERVER_H
+#define JOBSERVER_H
+
+// A GNU make compatible jobserver shared by every pipeline. The pool holds one
+// token per job slot. Each running command takes a token before it starts,
+// which stands in for make's implicit job slot, and any make it runs draws
+// further tokens from the same pool through MAKEFLAGS. Total parallelism
+// across all pipelines therefore stays within the -j budget.
+typedef struct {
+    int read_fd;        // Blocking; inherited by children
+    int write_fd;       // Inherited by children
+    int poll_fd;        // A separate non-blocking open of the read end
+    int tokens;
+    char makeflags[96];
+} Jobserver;
+
+extern Jobserver jobserver;
+
+int jobserver_open(int tokens);
+int jobserver_enabled();
+
+// Returns 1 if a token was taken, 0 if the pool is empty right now.
+int jobserver_try_acquire();
+
+void jobserver_release();
+
+// Returns the MAKEFLAGS=... environment entry for children, or NULL.
+char const * jobserver_makeflags();
+
+#endif // JOBSERVER_H
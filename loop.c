@@ -0,0 +1,610 @@
+#include "loop.h"
+#include "watch.h"
+#include "graph.h"
+#include "jobserver.h"
+#include "actioncache.h"
+#include "arena.h"
+#include "timeline.h"
+#include "worker.h"
+
+#include <stdint.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+#define LOOP_MAX_EVENTS 64
+
+typedef enum {
+    LOOP_SOURCE_INOTIFY = 0,
+    LOOP_SOURCE_CHILD = 1,
+    LOOP_SOURCE_JOBSERVER = 2,
+    LOOP_SOURCE_METRICS = 3,
+    LOOP_SOURCE_PIPEFILE = 4,
+    LOOP_SOURCE_SIGNAL = 5,
+    LOOP_SOURCE_OUTPUT = 6,
+    LOOP_SOURCE_WATCHES = 7,    // The inotify session shared by every pipeline
+    LOOP_SOURCE_WORKERS = 8     // Responses from persistent workers (see worker.h)
+} LoopSource;
+
+typedef struct {
+    int epfd;
+    Pipeline * pipelines;
+    int count;
+    int * order;        // Topological order, upstreams first
+    int running;
+    int watch_fd;       // See watch_share()
+    LoopOptions const * options;
+} Loop;
+
+// Each epoll registration carries the pipeline index and the source type, so
+// dispatching an event needs no lookup or per-source allocation.
+static uint64_t loop_tag(int index, LoopSource source) {
+    return ((uint64_t) index << 8) | source;
+}
+
+static int loop_add(Loop * loop, int fd, uint64_t tag) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+// Points an existing registration at a pipeline's new index.
+static int loop_retag(Loop * loop, int fd, uint64_t tag) {
+    struct epoll_event ev = { .events = EPOLLIN, .data.u64 = tag };
+    return epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static int loop_watch(Loop * loop, int index) {
+
+    Pipeline * pipeline = &loop->pipelines[index];
+    if (watch_open(pipeline) < 0) return -1;
+
+    // Remember the current state of the outputs so the first run can tell
+    // whether it changed them:
+    pipeline->outputs_stamp = pipeline_outputs_stamp(pipeline);
+
+    // Workers are started ahead of the first run, which is what they're for:
+    if (pipeline->worker) worker_start(pipeline);
+
+    // Pipelines on the shared session are read through its registration:
+    if (pipeline->notify_fd == loop->watch_fd) return 0;
+    return loop_add(loop, pipeline->notify_fd, loop_tag(index, LOOP_SOURCE_INOTIFY));
+}
+
+// Called once a run is over, whether the command ran or its outputs came from
+// the action cache. Successful runs pass their changes on to their downstreams.
+static void loop_finish_run(Loop * loop, Pipeline * pipeline, int success) {
+
+    if (jobserver_enabled()) jobserver_release();
+
+    if (!success || pipeline->downstream_count == 0) return;
+
+    // Early cutoff: a run that left its declared outputs untouched has
+    // nothing new to offer its downstreams.
+    if (pipeline->outputs != NULL) {
+        uint64_t stamp = pipeline_outputs_stamp(pipeline);
+        if (stamp == pipeline->outputs_stamp) {
+            printf(">> Pipeline %s: outputs unchanged\n", pipeline->name);
+            return;
+        }
+        pipeline->outputs_stamp = stamp;
+    }
+
+    graph_propagate(loop->pipelines, pipeline);
+}
+
+static void loop_start_run(Loop * loop, int index) {
+
+    Pipeline * pipeline = &loop->pipelines[index];
+
+    // Anything arriving from here on needs another run after this one:
+    timeline_queued(pipeline);
+    pipeline_clear_dirty(pipeline);
+
+    uint64_t start = now_ns();
+
+    if (loop->options->replay != NULL) {
+        replay_run(loop->options->replay, pipeline);
+        timeline_spawned(pipeline, start);
+        timeline_exited(pipeline, 1, 0);
+        loop_finish_run(loop, pipeline, 1);
+        return;
+    }
+
+    if (actioncache_lookup(pipeline)) {
+        METRIC_ADD(pipeline->metrics, runs_cached, 1);
+        timeline_cached(pipeline);
+        loop_finish_run(loop, pipeline, 1);
+        return;
+    }
+
+    // A worker takes the run as a request, and its response ends it:
+    if (pipeline->worker) {
+        int res = worker_send(pipeline);
+        if (res < 0) {
+            printf(">> Pipeline %s: %s\n", pipeline->name, pipelines_strerror(res));
+            if (jobserver_enabled()) jobserver_release();
+            return;
+        }
+        timeline_spawned(pipeline, start);
+        ++loop->running;
+        return;
+    }
+
+    pid_t pid = pipeline_spawn(pipeline);
+    if (pid > 0) timeline_spawned(pipeline, start);
+    if (pid < 0) {
+        printf(">> Pipeline %s: %s\n", pipeline->name, pipelines_strerror(pid));
+        if (jobserver_enabled()) jobserver_release();
+        return;
+    }
+
+    int pidfd = pidfd_open(pid, 0);
+    if (pidfd < 0 || loop_add(loop, pidfd, loop_tag(index, LOOP_SOURCE_CHILD)) < 0) {
+
+        // Without a pidfd we can't wait asynchronously, so fall back to blocking.
+        // Its output still has to be drained, or it could fill the pipe:
+        printf(">> Pipeline %s: unable to track child (%s)\n", pipeline->name, strerror(errno));
+        if (pidfd >= 0) close(pidfd);
+
+        struct pollfd pfd = { .fd = pipeline->output.fd, .events = POLLIN };
+        while (pfd.fd >= 0 && (poll(&pfd, 1, -1) >= 0 || errno == EINTR) && output_drain(pipeline) > 0);
+        waitpid(pid, NULL, 0);
+        output_end(pipeline);
+        if (jobserver_enabled()) jobserver_release();
+        return;
+    }
+
+    pipeline->pid = pid;
+    pipeline->pidfd = pidfd;
+    ++loop->running;
+
+    if (pipeline->output.fd >= 0 && loop_add(loop, pipeline->output.fd, loop_tag(index, LOOP_SOURCE_OUTPUT)) < 0) {
+        printf(">> Pipeline %s: unable to capture output (%s)\n", pipeline->name, strerror(errno));
+    }
+}
+
+static void loop_on_inotify(Pipeline * pipeline) {
+
+    // Drain everything queued on the descriptor. The pipeline is left dirty
+    // and loop_dispatch() decides when it actually runs.
+    if (watch_drain(pipeline) < 0) {
+        printf(">> Pipeline %s: error reading events (%s)\n", pipeline->name, strerror(errno));
+    }
+}
+
+static void loop_on_watches() {
+    if (watch_drain_shared() < 0) {
+        printf(">> Error reading events (%s)\n", strerror(errno));
+    }
+}
+
+// Returns 1 if a signal asked the loop to stop. SIGUSR1 writes the timeline.
+static int loop_on_signal(int fd) {
+
+    int stopping = 0;
+    struct signalfd_siginfo info;
+    while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGUSR1) timeline_dump();
+        else stopping = 1;
+    }
+    return stopping;
+}
+
+static void loop_on_output(Loop * loop, Pipeline * pipeline) {
+
+    // A pipe at end of file stays readable, so it's dropped from the set until
+    // loop_on_child() closes it:
+    if (pipeline->output.fd >= 0 && output_drain(pipeline) <= 0) {
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, pipeline->output.fd, NULL);
+    }
+}
+
+// Called once a run's command has exited or its worker has responded.
+static void loop_end_run(Loop * loop, Pipeline * pipeline, int exited, int code) {
+
+    int success = 0;
+    metrics_run_finished(pipeline, exited, code);
+    timeline_exited(pipeline, exited, code);
+
+    // A run stopped for a restart is neither a success nor worth reporting:
+    if (pipeline->stop_deadline_ns == 0) {
+        if (!exited || code != 0) {
+            printf(">> Pipeline %s: %s\n", pipeline->name, pipelines_strerror(PIPELINES_ERR_NONZERO_STATUS));
+        } else {
+            success = 1;
+        }
+    }
+
+    pipeline->pid = 0;
+    --loop->running;
+    pipeline_end_run(pipeline);
+
+    if (success) actioncache_store(pipeline);
+    loop_finish_run(loop, pipeline, success);
+}
+
+static void loop_on_child(Loop * loop, int index) {
+
+    Pipeline * pipeline = &loop->pipelines[index];
+
+    siginfo_t info = {0};
+    int reaped = waitid(P_PIDFD, pipeline->pidfd, &info, WEXITED) == 0;
+    if (!reaped) printf(">> Pipeline %s: waitid failed (%s)\n", pipeline->name, strerror(errno));
+
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, pipeline->pidfd, NULL);
+    close(pipeline->pidfd);
+    pipeline->pidfd = -1;
+    output_end(pipeline);
+
+    loop_end_run(loop, pipeline, reaped && info.si_code == CLD_EXITED, reaped ? info.si_status : -1);
+}
+
+static void loop_on_workers(Loop * loop) {
+
+    WorkerResult results[LOOP_MAX_EVENTS];
+    int count = worker_drain(results, LOOP_MAX_EVENTS);
+    for (int i = 0; i < count; ++i) {
+        loop_end_run(loop, results[i].pipeline, results[i].exited, results[i].status);
+    }
+}
+
+// Stops a running command for good and waits for it to go. The run counts as
+// still to be done, which the snapshot then reflects.
+static void loop_kill_run(Loop * loop, Pipeline * pipeline) {
+
+    if (pipeline->pid == 0) return;
+
+    pipeline_stop_run(pipeline);
+
+    if (pipeline->worker_slot >= 0) {
+        worker_kill(pipeline);
+    } else {
+        struct pollfd pfd = { .fd = pipeline->pidfd, .events = POLLIN };
+        while (poll(&pfd, 1, pipeline_supervise_run(pipeline)) == 0);
+
+        siginfo_t info;
+        waitid(P_PIDFD, pipeline->pidfd, &info, WEXITED);
+        epoll_ctl(loop->epfd, EPOLL_CTL_DEL, pipeline->pidfd, NULL);
+    }
+    timeline_exited(pipeline, 0, 0);
+
+    pipeline->pid = 0;
+    --loop->running;
+    if (jobserver_enabled()) jobserver_release();
+
+    pipeline_end_run(pipeline);
+}
+
+// Stops a pipeline that was removed from the Pipefile, abandoning its run.
+static void loop_stop(Loop * loop, Pipeline * pipeline) {
+    loop_kill_run(loop, pipeline);
+    watch_save_snapshot(pipeline);
+    pipeline_free(pipeline);
+}
+
+// Applies an edited Pipefile. Pipelines whose configuration is unchanged keep
+// their watches, pending changes and running commands; a changed pipeline
+// only has its watches rebuilt if what it watches changed.
+static void loop_reload(Loop * loop) {
+
+    Reload * reload = loop->options->reload;
+
+    Arena next;
+    Pipeline * pipelines = reload_parse(reload, &next);
+    if (pipelines == NULL) return;
+
+    int count = 0;
+    while (pipelines[count].valid) ++count;
+
+    int * order = ALLOC(sizeof(int) * (count + 1));
+    if (order == NULL || graph_resolve(pipelines, count, order) < 0) {
+        printf(">> Keeping the current configuration\n");
+        for (int i = 0; i < count; ++i) graph_free(&pipelines[i]);
+        FREE(order);
+        arena_free(&next);
+        return;
+    }
+
+    int added = count, changed = 0, removed = 0;
+
+    for (int i = 0; i < loop->count; ++i) {
+
+        Pipeline * old = &loop->pipelines[i];
+        int index = reload_find(pipelines, old->name);
+        if (index < 0) {
+            printf(">> Pipeline %s removed\n", old->name);
+            loop_stop(loop, old);
+            ++removed;
+            continue;
+        }
+
+        Pipeline * pipeline = &pipelines[index];
+        ReloadChange change = reload_diff(old, pipeline);
+        pipeline_move_state(pipeline, old);
+        graph_free(old);
+        --added;
+
+        if (change == RELOAD_CHANGED_WATCH) {
+            printf(">> Pipeline %s changed, rebuilding its watches\n", pipeline->name);
+
+            // Saved first so the new watches only catch up on what's pending:
+            watch_save_snapshot(pipeline);
+            watch_close(pipeline);
+            ++changed;
+        } else if (change == RELOAD_CHANGED) {
+            printf(">> Pipeline %s changed\n", pipeline->name);
+            pipeline->outputs_stamp = pipeline_outputs_stamp(pipeline);
+            ++changed;
+        }
+    }
+
+    FREE(loop->order);
+    loop->pipelines = pipelines;
+    loop->count = count;
+    loop->order = order;
+
+    if (metrics_init(pipelines) < 0) {
+        printf("Unable to allocate metrics: %s\n", strerror(errno));
+    }
+
+    // Indices may have shifted, so every registration is re-tagged. New and
+    // re-watched pipelines get their watches set up from scratch.
+    for (int i = 0; i < count; ++i) {
+
+        Pipeline * pipeline = &pipelines[i];
+        if (pipeline->pidfd >= 0) loop_retag(loop, pipeline->pidfd, loop_tag(i, LOOP_SOURCE_CHILD));
+        if (pipeline->output.fd >= 0) loop_retag(loop, pipeline->output.fd, loop_tag(i, LOOP_SOURCE_OUTPUT));
+
+        if (pipeline->notify_fd >= 0) {
+            if (pipeline->notify_fd != loop->watch_fd) {
+                loop_retag(loop, pipeline->notify_fd, loop_tag(i, LOOP_SOURCE_INOTIFY));
+            }
+        } else if (loop_watch(loop, i) < 0) {
+            printf(">> Error monitoring %s\n", pipeline->name);
+        }
+    }
+
+    worker_prune(pipelines);
+
+    printf(">> Reloaded %s: %d added, %d changed, %d removed\n", reload->path, added, changed, removed);
+    reload_commit(reload, &next);
+}
+
+// Asks for a wakeup once the jobserver pool has a token again. The pool is
+// registered one-shot, so it only wakes the loop while a run is waiting.
+static void loop_wait_for_token(Loop * loop) {
+    struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = LOOP_SOURCE_JOBSERVER };
+    epoll_ctl(loop->epfd, EPOLL_CTL_MOD, jobserver.poll_fd, &ev);
+}
+
+// Starts every idle pipeline whose changes have settled and whose upstreams
+// are all idle, in topological order and up to the job limit. Pipelines that
+// are still running stay dirty, which gives exactly one follow-up run once
+// they exit. Returns the epoll timeout until the next pending deadline.
+static int loop_dispatch(Loop * loop) {
+
+    int timeout = -1;
+    int out_of_tokens = 0;
+
+    graph_update_blocked(loop->pipelines, loop->order, loop->count);
+
+    for (int i = 0; i < loop->count; ++i) {
+
+        int index = loop->order[i];
+        Pipeline * pipeline = &loop->pipelines[index];
+
+        // A running pipeline set to restart is stopped here once its new
+        // changes have settled. loop_on_child() leaves it due to run again.
+        if (pipeline->pid != 0) {
+            int delay = pipeline_supervise_run(pipeline);
+            if (delay > 0 && (timeout < 0 || delay < timeout)) timeout = delay;
+            continue;
+        }
+
+        if (pipeline->blocked) continue;
+
+        int delay = pipeline_trigger_delay(pipeline);
+        if (delay == 0) {
+
+            // Every worker in its pool is busy with other pipelines' runs.
+            // One finishing wakes the loop again:
+            if (pipeline->worker && !worker_available(pipeline)) continue;
+
+            // With a jobserver, each run needs a token from the shared pool
+            // (make may be holding the rest). Without one, no more runs
+            // start, but the walk goes on so running pipelines are still
+            // supervised:
+            if (out_of_tokens) continue;
+            if (jobserver_enabled() && !jobserver_try_acquire()) {
+                loop_wait_for_token(loop);
+                out_of_tokens = 1;
+                continue;
+            }
+
+            loop_start_run(loop, index);
+
+            // Whatever depends on this pipeline is now blocked behind it:
+            graph_update_blocked(loop->pipelines, loop->order, loop->count);
+
+        } else if (delay > 0 && (timeout < 0 || delay < timeout)) {
+            timeout = delay;
+        }
+    }
+
+    return timeout;
+}
+
+int pipelines_run_loop(Pipeline * pipelines, LoopOptions const * options) {
+
+    int res = 0;
+    int signal_fd = -1;
+
+    Loop loop = { .pipelines = pipelines, .watch_fd = -1, .options = options };
+    while (pipelines[loop.count].valid) ++loop.count;
+
+    loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop.epfd < 0) {
+        printf("Error: %s\n", strerror(errno));
+        return 1;
+    }
+
+    loop.order = ALLOC(sizeof(int) * (loop.count + 1));
+    if (loop.order == NULL || graph_resolve(pipelines, loop.count, loop.order) < 0) {
+        res = 1;
+        goto exit;
+    }
+
+    if (jobserver_enabled()) {
+        struct epoll_event ev = { .events = EPOLLIN | EPOLLONESHOT, .data.u64 = LOOP_SOURCE_JOBSERVER };
+        if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, jobserver.poll_fd, &ev) < 0) {
+            printf("Error: %s\n", strerror(errno));
+            res = 1;
+            goto exit;
+        }
+    }
+
+    if (options->metrics_fd >= 0 && loop_add(&loop, options->metrics_fd, LOOP_SOURCE_METRICS) < 0) {
+        printf("Error: %s\n", strerror(errno));
+        res = 1;
+        goto exit;
+    }
+
+    // SIGINT and SIGTERM stop the loop cleanly, so the snapshots get saved:
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    if (timeline_enabled()) sigaddset(&signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd < 0 || loop_add(&loop, signal_fd, LOOP_SOURCE_SIGNAL) < 0) {
+        printf("Error: %s\n", strerror(errno));
+        res = 1;
+        goto exit;
+    }
+
+    if (options->reload != NULL && options->reload->notify_fd >= 0 &&
+        loop_add(&loop, options->reload->notify_fd, LOOP_SOURCE_PIPEFILE) < 0) {
+        printf("Error: %s\n", strerror(errno));
+        res = 1;
+        goto exit;
+    }
+
+    // A replay stands in for the watches:
+    Replay * replay = options->replay;
+    if (replay != NULL) {
+        replay_begin(replay, pipelines);
+    } else {
+
+        int worker_fd = worker_open();
+        if (worker_fd < 0 || loop_add(&loop, worker_fd, LOOP_SOURCE_WORKERS) < 0) {
+            printf("Error: %s\n", strerror(errno));
+            res = 1;
+            goto exit;
+        }
+
+        // Pipelines watching the same directories share the kernel watches:
+        loop.watch_fd = watch_share();
+        if (loop.watch_fd < 0 || loop_add(&loop, loop.watch_fd, LOOP_SOURCE_WATCHES) < 0) {
+            printf("Error: %s\n", strerror(errno));
+            res = 1;
+            goto exit;
+        }
+
+        for (int i = 0; i < loop.count; ++i) {
+            if (loop_watch(&loop, i) < 0) {
+                printf(">> Error monitoring %s\n", pipelines[i].name);
+                res = 1;
+                goto exit;
+            }
+        }
+        if (loop.count > 1) {
+            printf(">> %d kernel watches shared between %d pipelines\n", watch_shared_count(), loop.count);
+        }
+    }
+
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    // Pipelines with changes from while pipelines was stopped run straight away:
+    int timeout = loop_dispatch(&loop);
+    int reload = 0;
+    int stopping = 0;
+    for (;;) {
+
+        // A replay waits for its next record as well as the scheduler's
+        // deadlines, on a clock that may not be running at real time:
+        if (replay != NULL) {
+            if (replay_feed(replay, loop.pipelines) > 0) timeout = loop_dispatch(&loop);
+            if (replay_done(replay) && timeout < 0 && loop.running == 0) goto exit;
+            timeout = replay_wait(replay, timeout);
+        }
+
+        int n = epoll_wait(loop.epfd, events, LOOP_MAX_EVENTS, timeout);
+        if (n == 0 && replay != NULL) replay_waited(replay);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            printf("Error: %s\n", strerror(errno));
+            res = 1;
+            goto exit;
+        }
+
+        for (int i = 0; i < n; ++i) {
+
+            int index = events[i].data.u64 >> 8;
+
+            switch ((LoopSource) (events[i].data.u64 & 0xff)) {
+                case LOOP_SOURCE_INOTIFY: loop_on_inotify(&loop.pipelines[index]); break;
+                case LOOP_SOURCE_CHILD: loop_on_child(&loop, index); break;
+                case LOOP_SOURCE_JOBSERVER: break;
+                case LOOP_SOURCE_METRICS: metrics_serve(options->metrics_fd, loop.pipelines); break;
+                case LOOP_SOURCE_PIPEFILE: {
+
+                    // Events already read in this batch are tagged with the old
+                    // indices, so the reload waits until the batch is done:
+                    reload = reload || reload_pending(options->reload);
+                    break;
+                }
+                case LOOP_SOURCE_SIGNAL: stopping = stopping || loop_on_signal(signal_fd); break;
+                case LOOP_SOURCE_OUTPUT: loop_on_output(&loop, &loop.pipelines[index]); break;
+                case LOOP_SOURCE_WATCHES: loop_on_watches(); break;
+                case LOOP_SOURCE_WORKERS: loop_on_workers(&loop); break;
+            }
+        }
+
+        if (stopping) {
+            printf(">> Stopping\n");
+            goto exit;
+        }
+
+        if (reload) {
+            loop_reload(&loop);
+            reload = 0;
+        }
+
+        timeout = loop_dispatch(&loop);
+
+        // Nothing from this round's events and runs is needed any more:
+        scratch_reset();
+    }
+
+exit:
+    if (options->replay != NULL) replay_close(options->replay, loop.pipelines);
+
+    // Every command is asked to stop before waiting on any of them:
+    for (int i = 0; i < loop.count; ++i) pipeline_stop_run(&loop.pipelines[i]);
+
+    for (int i = 0; i < loop.count; ++i) {
+        loop_kill_run(&loop, &loop.pipelines[i]);
+        watch_save_snapshot(&loop.pipelines[i]);
+        pipeline_free(&loop.pipelines[i]);
+    }
+    worker_close();
+    if (signal_fd >= 0) close(signal_fd);
+    FREE(loop.order);
+    close(loop.epfd);
+    return res;
+}
@@ -0,0 +1,21 @@
+#ifndef LOOP_H
+#define LOOP_H
+
+#include "pipelines.h"
+#include "reload.h"
+#include "replay.h"
+
+typedef struct {
+    int max_jobs;       // Most commands running at once (0 = no limit)
+    int metrics_fd;     // Listening socket for metrics scrapes, or -1
+    Reload * reload;    // Applies edits to the Pipefile, or NULL
+    Replay * replay;    // Feeds a recorded trace in place of the watches, or NULL
+} LoopOptions;
+
+// Runs every pipeline from the calling process. A single epoll instance owns
+// each pipeline's inotify descriptor and the pidfd of its running command, so
+// no per-pipeline monitor process is needed. Pipelines are scheduled in
+// dependency order (see graph.h).
+int pipelines_run_loop(Pipeline * pipelines, LoopOptions const * options);
+
+#endif // LOOP_H
@@ -1,23 +1,222 @@
 #include "pipelines.h"
 #include "parser.h"
+#include "loop.h"
+#include "jobserver.h"
+#include "arena.h"
+#include "reload.h"
+#include "watch.h"
+#include "timeline.h"
+#include "isolation.h"
 
-int main() {
+static void print_usage(char const * argv0) {
+    printf("Usage: %s [-e fork|epoll] [-w inotify|fanotify] [-j jobs] [-m socket] [-r trace]\n", argv0);
+    printf("       %*s [-t timeline]\n", (int) strlen(argv0), "");
+    printf("       %s -R trace [-x speed]\n", argv0);
+    printf("       %s -l pipeline [-n kb]\n", argv0);
+    printf("  -e fork   Monitor each pipeline from its own process (default)\n");
+    printf("  -e epoll  Monitor every pipeline from a single event loop\n");
+    printf("  -w fanotify  Watch with filesystem-wide fanotify marks instead of\n");
+    printf("            inotify, unless a pipeline sets watch_backend\n");
+    printf("  -j jobs   Share this many job slots between all pipelines, and with\n");
+    printf("            any make they run through a jobserver\n");
+    printf("  -m socket Serve Prometheus metrics on this Unix socket\n");
+    printf("  -t file   Keep a timeline of recent runs, written to file as a Chrome\n");
+    printf("            trace on SIGUSR1 and on exit (implies -e epoll)\n");
+    printf("  -r trace  Record every change seen to a trace file (implies -e epoll)\n");
+    printf("  -R trace  Replay a trace into the Pipefile's pipelines, without running\n");
+    printf("            their commands, and exit\n");
+    printf("  -x speed  Replay at this many times real time (default: as fast as\n");
+    printf("            possible)\n");
+    printf("  -l name   Print the recent output of a pipeline and exit\n");
+    printf("  -n kb     Print at most this many KB of it\n");
+}
+
+int main(int argc, char ** argv) {
+
+    // Commands with a resource class are started through here (see isolation.h):
+    if (argc > 1 && strcmp(argv[1], ISOLATION_ARG) == 0) return isolation_exec(argc, argv);
 
     set_default_ctx();
 
-    Pipeline * pipelines = pipelines_parse_pipefile("Pipefile");
+    // Keep log lines timely when stdout is a file or a pipe:
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int single_process = 0;
+    LoopOptions options = { .metrics_fd = -1 };
+    char const * metrics_path = NULL;
+    char const * tail_name = NULL;
+    int tail_kb = -1;
+    char const * record_path = NULL;
+    char const * replay_path = NULL;
+    int replay_speed = 0;
+    char const * timeline_path = NULL;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:w:j:m:l:n:t:r:R:x:h")) != -1) {
+        switch (opt) {
+            case 'e': {
+                if (strcmp(optarg, "epoll") == 0) {
+                    single_process = 1;
+                } else if (strcmp(optarg, "fork") == 0) {
+                    single_process = 0;
+                } else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'w': {
+                if (strcmp(optarg, "fanotify") == 0) {
+                    watch_default_backend = PIPELINE_WATCH_FANOTIFY;
+                } else if (strcmp(optarg, "inotify") == 0) {
+                    watch_default_backend = PIPELINE_WATCH_INOTIFY;
+                } else {
+                    print_usage(argv[0]);
+                    return 1;
+                }
+                break;
+            }
+            case 'j': {
+                options.max_jobs = atoi(optarg);
+                break;
+            }
+            case 'm': {
+                metrics_path = optarg;
+                break;
+            }
+            case 'l': {
+                tail_name = optarg;
+                break;
+            }
+            case 'n': {
+                tail_kb = atoi(optarg);
+                break;
+            }
+            case 't': {
+                timeline_path = optarg;
+                break;
+            }
+            case 'r': {
+                record_path = optarg;
+                break;
+            }
+            case 'R': {
+                replay_path = optarg;
+                break;
+            }
+            case 'x': {
+                replay_speed = atoi(optarg);
+                break;
+            }
+            default: {
+                print_usage(argv[0]);
+                return opt == 'h' ? 0 : 1;
+            }
+        }
+    }
+
+    state_dir_init();
+
+    if (tail_name != NULL) {
+        if (output_print_tail(tail_name, tail_kb < 0 ? -1 : tail_kb * 1024) < 0) {
+            printf("No output recorded for %s\n", tail_name);
+            return 1;
+        }
+        return 0;
+    }
+
+    output_init();
+
+    // The configuration is parsed into an arena and released in one go:
+    Arena config;
+    arena_init(&config, 64 * 1024);
+
+    Pipeline * pipelines = pipelines_parse_pipefile("Pipefile", &config);
     if (pipelines == NULL) {
         printf("Please define a valid Pipefile in the local directory\n");
         return 1;
     }
 
-    Pipeline * pipeline = pipelines;
-    while (pipeline->valid) {
-        pipeline_start(pipeline);
-        ++pipeline;
+    // Timelines and traces are kept in the single-process engine, and
+    // dependencies and workers need it:
+    if (timeline_path != NULL || record_path != NULL || replay_path != NULL) single_process = 1;
+    for (Pipeline * pipeline = pipelines; pipeline->valid && !single_process; ++pipeline) {
+        if (pipeline->depends_on != NULL) {
+            printf(">> Pipeline %s has dependencies, using the epoll engine\n", pipeline->name);
+            single_process = 1;
+        } else if (pipeline->worker) {
+            printf(">> Pipeline %s uses a worker, using the epoll engine\n", pipeline->name);
+            single_process = 1;
+        }
+    }
+
+    // Once some commands are kept in their place, the watcher should stay
+    // ahead of them:
+    for (Pipeline * pipeline = pipelines; pipeline->valid; ++pipeline) {
+        if (isolation_needed(pipeline)) {
+            isolation_raise_watcher();
+            break;
+        }
+    }
+
+    if (options.max_jobs > 0 && jobserver_open(options.max_jobs) < 0) {
+        printf("Unable to create jobserver: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (metrics_init(pipelines) < 0) {
+        printf("Unable to allocate metrics: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (metrics_path != NULL && (options.metrics_fd = metrics_listen(metrics_path)) < 0) {
+        printf("Unable to listen on \"%s\": %s\n", metrics_path, strerror(errno));
+        return 1;
+    }
+
+    if (replay_path != NULL && (options.replay = replay_open(replay_path, replay_speed)) == NULL) {
+        printf("Unable to replay \"%s\": %s\n", replay_path, strerror(errno));
+        return 1;
+    }
+
+    if (timeline_path != NULL && timeline_open(timeline_path) < 0) {
+        printf("Unable to keep a timeline: %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (record_path != NULL && replay_record_open(record_path) < 0) {
+        printf("Unable to record to \"%s\": %s\n", record_path, strerror(errno));
+        return 1;
+    }
+
+    // Edits to the Pipefile are applied as they're saved (a replay keeps
+    // the configuration it started with):
+    Reload reload;
+    if (options.replay == NULL) {
+        if (reload_open(&reload, "Pipefile", &config) < 0) {
+            printf("Unable to watch the Pipefile, edits need a restart: %s\n", strerror(errno));
+        }
+        options.reload = &reload;
+    }
+
+    int result = 0;
+
+    if (single_process) {
+        result = pipelines_run_loop(pipelines, &options);
+        replay_record_close();
+        timeline_close();
+
+    } else {
+
+        Pipeline * pipeline = pipelines;
+        while (pipeline->valid) {
+            if (pipeline_start(pipeline) != 0) printf(">> Error monitoring %s\n", pipeline->name);
+            ++pipeline;
+        }
+
+        result = reload_supervise(&reload, pipelines, options.metrics_fd);
     }
 
-    int result = pipeline_wait_all_finished(pipelines);
-    FREE(pipelines);
+    arena_free(&config);
     return result;
-}
\ No newline at end of file
+}
@@ -0,0 +1,336 @@
+#include "metrics.h"
+#include "pipelines.h"
+#include "arena.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static uint64_t const bucket_bounds_us[METRICS_BUCKETS - 1] = METRICS_BUCKET_BOUNDS_US;
+
+// Every mapping metrics_init() has made and not yet unmapped. Each reload
+// maps blocks for the pipelines it added, so a mapping goes once none of the
+// pipelines left uses a block in it.
+typedef struct {
+    PipelineMetrics * blocks;
+    int count;
+} MetricsRegion;
+
+static struct {
+    MetricsRegion * list;
+    int count;
+    int capacity;
+} regions;
+
+static int metrics_region_add(PipelineMetrics * blocks, int count) {
+
+    if (regions.count == regions.capacity) {
+
+        int capacity = regions.capacity ? regions.capacity * 2 : 8;
+        MetricsRegion * list = ALLOC(sizeof(MetricsRegion) * capacity);
+        if (list == NULL) return -1;
+
+        if (regions.list != NULL) {
+            memcpy(list, regions.list, sizeof(MetricsRegion) * regions.count);
+            FREE(regions.list);
+        }
+        regions.list = list;
+        regions.capacity = capacity;
+    }
+
+    regions.list[regions.count++] = (MetricsRegion) { .blocks = blocks, .count = count };
+    return 0;
+}
+
+// Unmaps the regions no pipeline has a block in any more. Monitor processes
+// forked earlier keep their own mappings until they exit.
+static void metrics_region_prune(Pipeline * pipelines) {
+
+    for (int i = 0; i < regions.count;) {
+
+        MetricsRegion * region = &regions.list[i];
+        int used = 0;
+        for (Pipeline * pipeline = pipelines; pipeline->valid && !used; ++pipeline) {
+            used = pipeline->metrics >= region->blocks && pipeline->metrics < region->blocks + region->count;
+        }
+
+        if (used) {
+            ++i;
+            continue;
+        }
+
+        munmap(region->blocks, sizeof(PipelineMetrics) * region->count);
+        regions.list[i] = regions.list[--regions.count];
+    }
+}
+
+int metrics_init(Pipeline * pipelines) {
+
+    // Pipelines carried over by a reload keep the block they have:
+    int count = 0;
+    for (Pipeline * pipeline = pipelines; pipeline->valid; ++pipeline) count += pipeline->metrics == NULL;
+
+    if (count > 0) {
+
+        PipelineMetrics * blocks = mmap(NULL, sizeof(PipelineMetrics) * count, PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (blocks == MAP_FAILED) return -1;
+
+        if (metrics_region_add(blocks, count) < 0) {
+            munmap(blocks, sizeof(PipelineMetrics) * count);
+            return -1;
+        }
+
+        // Fresh anonymous pages are already zeroed:
+        for (Pipeline * pipeline = pipelines; pipeline->valid; ++pipeline) {
+            if (pipeline->metrics == NULL) pipeline->metrics = blocks++;
+        }
+    }
+
+    metrics_region_prune(pipelines);
+    return 0;
+}
+
+void metrics_observe(MetricsHistogram * histogram, uint64_t ns) {
+
+    int bucket = 0;
+    uint64_t us = ns / 1000;
+    while (bucket < METRICS_BUCKETS - 1 && us > bucket_bounds_us[bucket]) ++bucket;
+
+    METRIC_ADD(histogram, buckets[bucket], 1);
+    METRIC_ADD(histogram, sum_ns, ns);
+    METRIC_ADD(histogram, count, 1);
+}
+
+void metrics_run_finished(Pipeline * pipeline, int exited, int code) {
+
+    PipelineMetrics * metrics = pipeline->metrics;
+    metrics_observe(&metrics->run_duration, now_ns() - pipeline->run_start_ns);
+    METRIC_SET(metrics, running, 0);
+
+    if (!exited) METRIC_ADD(metrics, runs_signaled, 1);
+    else if (code == 0) METRIC_ADD(metrics, runs_succeeded, 1);
+    else METRIC_ADD(metrics, runs_failed, 1);
+}
+
+int metrics_listen(char const * path) {
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+
+    // A socket left behind by a previous instance would make bind() fail:
+    unlink(path);
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+typedef struct {
+    char * data;
+    int len;
+    int capacity;
+} MetricsBuffer;
+
+static void buffer_printf(MetricsBuffer * buf, char const * fmt, ...) __attribute__((format(printf, 2, 3)));
+static void buffer_printf(MetricsBuffer * buf, char const * fmt, ...) {
+
+    for (;;) {
+
+        va_list args;
+        va_start(args, fmt);
+        int n = buf->data ? vsnprintf(buf->data + buf->len, buf->capacity - buf->len, fmt, args) : -1;
+        va_end(args);
+
+        if (n >= 0 && buf->len + n < buf->capacity) {
+            buf->len += n;
+            return;
+        }
+
+        int capacity = buf->capacity ? buf->capacity * 2 : 16384;
+        char * data = ALLOC(capacity);
+        if (data == NULL) return;
+        if (buf->data != NULL) {
+            memcpy(data, buf->data, buf->len);
+            FREE(buf->data);
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+}
+
+// Pipeline names are arbitrary YAML keys, so they're escaped as the text
+// format asks for label values:
+static char * label_value(char const * name) {
+
+    char * label = ALLOC(strlen(name) * 2 + 1);
+    if (label == NULL) return NULL;
+
+    char * at = label;
+    for (; *name; ++name) {
+        if (*name == '\\' || *name == '"') *at++ = '\\';
+        if (*name == '\n') {
+            *at++ = '\\';
+            *at++ = 'n';
+        } else {
+            *at++ = *name;
+        }
+    }
+    *at = '\0';
+    return label;
+}
+
+#define METRICS_OFFSET(field) offsetof(PipelineMetrics, field)
+
+static struct {
+    char const * name;
+    char const * type;
+    char const * help;
+    size_t offset;
+} const metric_fields[] = {
+    { "pipelines_events_received_total", "counter", "Filesystem events read", METRICS_OFFSET(events_received) },
+    { "pipelines_events_filtered_total", "counter", "Events ignored by include/exclude or hash_changes", METRICS_OFFSET(events_filtered) },
+    { "pipelines_changes_total", "counter", "Relevant changes recorded", METRICS_OFFSET(changes) },
+    { "pipelines_changes_coalesced_total", "counter", "Changes folded into an already pending run", METRICS_OFFSET(changes_coalesced) },
+    { "pipelines_event_overflows_total", "counter", "Kernel event queue overflows", METRICS_OFFSET(overflows) },
+    { "pipelines_runs_started_total", "counter", "Commands started", METRICS_OFFSET(runs_started) },
+    { "pipelines_runs_cached_total", "counter", "Runs restored from the action cache", METRICS_OFFSET(runs_cached) },
+    { "pipelines_runs_succeeded_total", "counter", "Commands that exited with status 0", METRICS_OFFSET(runs_succeeded) },
+    { "pipelines_runs_failed_total", "counter", "Commands that exited with a non-zero status", METRICS_OFFSET(runs_failed) },
+    { "pipelines_runs_signaled_total", "counter", "Commands killed by a signal", METRICS_OFFSET(runs_signaled) },
+    { "pipelines_spawn_failures_total", "counter", "Commands that couldn't be started", METRICS_OFFSET(spawn_failures) },
+    { "pipelines_watches", "gauge", "Kernel watches held", METRICS_OFFSET(watches) },
+    { "pipelines_running", "gauge", "Whether the command is running", METRICS_OFFSET(running) },
+};
+
+static void render_histogram(MetricsBuffer * buf, Pipeline * pipelines, char ** labels, char const * name,
+                             char const * help, size_t offset) {
+
+    buffer_printf(buf, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+
+    for (int p = 0; pipelines[p].valid; ++p) {
+
+        Pipeline * pipeline = &pipelines[p];
+        MetricsHistogram * histogram = (MetricsHistogram *) ((char *) pipeline->metrics + offset);
+
+        uint64_t cumulative = 0;
+        for (int i = 0; i < METRICS_BUCKETS; ++i) {
+            cumulative += __atomic_load_n(&histogram->buckets[i], __ATOMIC_RELAXED);
+            if (i < METRICS_BUCKETS - 1) {
+                buffer_printf(buf, "%s_bucket{pipeline=\"%s\",le=\"%g\"} %llu\n", name, labels[p],
+                              bucket_bounds_us[i] / 1e6, (unsigned long long) cumulative);
+            } else {
+                buffer_printf(buf, "%s_bucket{pipeline=\"%s\",le=\"+Inf\"} %llu\n", name, labels[p],
+                              (unsigned long long) cumulative);
+            }
+        }
+
+        buffer_printf(buf, "%s_sum{pipeline=\"%s\"} %.9f\n", name, labels[p],
+                      __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED) / 1e9);
+        buffer_printf(buf, "%s_count{pipeline=\"%s\"} %llu\n", name, labels[p],
+                      (unsigned long long) __atomic_load_n(&histogram->count, __ATOMIC_RELAXED));
+    }
+}
+
+static void render(MetricsBuffer * buf, Pipeline * pipelines) {
+
+    int count = 0;
+    while (pipelines[count].valid) ++count;
+
+    char ** labels = ALLOC(sizeof(char *) * (count + 1));
+    if (labels == NULL) return;
+    for (int p = 0; p < count; ++p) {
+        labels[p] = label_value(pipelines[p].name);
+        if (labels[p] == NULL) return;
+    }
+
+    for (size_t f = 0; f < sizeof(metric_fields) / sizeof(metric_fields[0]); ++f) {
+
+        buffer_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", metric_fields[f].name, metric_fields[f].help,
+                      metric_fields[f].name, metric_fields[f].type);
+
+        for (int p = 0; p < count; ++p) {
+            uint64_t * value = (uint64_t *) ((char *) pipelines[p].metrics + metric_fields[f].offset);
+            buffer_printf(buf, "%s{pipeline=\"%s\"} %llu\n", metric_fields[f].name, labels[p],
+                          (unsigned long long) __atomic_load_n(value, __ATOMIC_RELAXED));
+        }
+    }
+
+#ifdef PIPELINES_ALLOC_STATS
+    // Counted per thread, so these cover the process answering the scrape:
+    buffer_printf(buf, "# HELP pipelines_heap_allocations_total Heap allocations made\n"
+                       "# TYPE pipelines_heap_allocations_total counter\n"
+                       "pipelines_heap_allocations_total %llu\n", (unsigned long long) ctx_stats.allocs);
+    buffer_printf(buf, "# HELP pipelines_heap_frees_total Heap blocks freed\n"
+                       "# TYPE pipelines_heap_frees_total counter\n"
+                       "pipelines_heap_frees_total %llu\n", (unsigned long long) ctx_stats.frees);
+#endif
+
+    render_histogram(buf, pipelines, labels, "pipelines_queue_wait_seconds",
+                     "Time from the first change to the run starting", METRICS_OFFSET(queue_wait));
+    render_histogram(buf, pipelines, labels, "pipelines_run_duration_seconds",
+                     "Time commands took to run", METRICS_OFFSET(run_duration));
+}
+
+void metrics_serve(int listen_fd, Pipeline * pipelines) {
+
+    int client;
+    while ((client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK)) >= 0) {
+
+        // The text is built in scratch memory, so scrapes don't churn the heap:
+        Ctx saved = scratch_begin();
+        MetricsBuffer buf = {0};
+        render(&buf, pipelines);
+        ctx_restore(saved);
+
+        // This runs on the event loop, so nothing waits on a client. The send
+        // buffer is grown to hold the whole text, and a scrape that still
+        // doesn't fit is dropped:
+        if (buf.data != NULL) {
+            int size;
+            socklen_t size_len = sizeof(size);
+            if (getsockopt(client, SOL_SOCKET, SO_SNDBUF, &size, &size_len) == 0 && size < (int) buf.len * 2) {
+                size = buf.len * 2;
+                setsockopt(client, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+            }
+            ssize_t written = write(client, buf.data, buf.len);
+            if (written != (ssize_t) buf.len) {
+                printf(">> Dropped a metrics scrape: %s\n", written < 0 ? strerror(errno) : "client not reading");
+            }
+        }
+        close(client);
+    }
+}
+
+pid_t metrics_start_server(int listen_fd, Pipeline * pipelines) {
+
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    // Stop with the process that started us, which may have SIGTERM blocked:
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_UNBLOCK, &signals, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    for (;;) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        if (poll(&pfd, 1, -1) < 0 && errno != EINTR) _exit(1);
+        metrics_serve(listen_fd, pipelines);
+        scratch_reset();
+    }
+}
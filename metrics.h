@@ -0,0 +1,69 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Upper bounds of the latency histogram buckets, in microseconds. A final
+// bucket catches everything above the last bound.
+#define METRICS_BUCKET_BOUNDS_US { 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, \
+                                   250000, 500000, 1000000, 2500000, 5000000, 10000000, 30000000, 60000000 }
+#define METRICS_BUCKETS 19
+
+typedef struct {
+    uint64_t buckets[METRICS_BUCKETS];  // Not cumulative, summed when rendered
+    uint64_t count;
+    uint64_t sum_ns;
+} MetricsHistogram;
+
+// Everything recorded about one pipeline. The blocks live in a shared anonymous
+// mapping created before the fork engine starts its monitor processes, so the
+// process serving them sees every pipeline's numbers. Each field has a single
+// writer and is updated with relaxed atomics, so recording never takes a lock
+// and a reader never sees a torn value.
+typedef struct {
+    uint64_t events_received;       // inotify events read
+    uint64_t events_filtered;       // Events dropped by include/exclude or hash_changes
+    uint64_t changes;               // Relevant changes recorded
+    uint64_t changes_coalesced;     // Changes folded into a run that was already pending
+    uint64_t overflows;             // Kernel event queue overflows
+    uint64_t runs_started;
+    uint64_t runs_cached;           // Runs satisfied from the action cache
+    uint64_t runs_succeeded;
+    uint64_t runs_failed;           // Non-zero exit status
+    uint64_t runs_signaled;         // Killed by a signal
+    uint64_t spawn_failures;
+    uint64_t watches;               // Gauge
+    uint64_t running;               // Gauge
+    MetricsHistogram queue_wait;    // First change to the run starting
+    MetricsHistogram run_duration;
+} PipelineMetrics;
+
+#define METRIC_ADD(metrics, field, n) __atomic_fetch_add(&(metrics)->field, (n), __ATOMIC_RELAXED)
+#define METRIC_SET(metrics, field, v) __atomic_store_n(&(metrics)->field, (v), __ATOMIC_RELAXED)
+
+struct Pipeline;
+
+// Gives every pipeline that doesn't have one its metrics block, and releases
+// the blocks of pipelines a reload removed. Call before the pipeline's monitor
+// process is forked.
+int metrics_init(struct Pipeline * pipelines);
+
+void metrics_observe(MetricsHistogram * histogram, uint64_t ns);
+
+// Records the end of a run: how long it took and how it exited.
+void metrics_run_finished(struct Pipeline * pipeline, int exited, int code);
+
+// Listens for scrapes on a Unix socket. Returns the listening descriptor.
+int metrics_listen(char const * path);
+
+// Answers every connection waiting on the socket with the current metrics in
+// Prometheus text format. Never blocks: a client the text can't be written to
+// at once gets nothing.
+void metrics_serve(int listen_fd, struct Pipeline * pipelines);
+
+// Serves scrapes from a process of its own, for the fork engine. Returns its
+// pid, or -1.
+pid_t metrics_start_server(int listen_fd, struct Pipeline * pipelines);
+
+#endif // METRICS_H
@@ -0,0 +1,304 @@
+#include "output.h"
+#include "pipelines.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static int terminal_fd = STDOUT_FILENO;
+
+void output_init() {
+
+    // A terminal or a pipe is reopened, so O_NONBLOCK only applies to our own
+    // file description and not to the shell's. A regular file is used as it
+    // is, as writing to it won't stall.
+    struct stat st;
+    if (fstat(STDOUT_FILENO, &st) < 0) return;
+    if (!isatty(STDOUT_FILENO) && !S_ISFIFO(st.st_mode)) return;
+
+    int fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd >= 0) terminal_fd = fd;
+}
+
+static int output_open_log(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+
+    char * path = state_path(pipeline->name, ".log");
+    if (path == NULL) return -1;
+
+    // splice() can't write to an O_APPEND file, so appending is done by
+    // starting at the end:
+    output->log_fd = open(path, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    FREE(path);
+    if (output->log_fd < 0) return -1;
+
+    off_t size = lseek(output->log_fd, 0, SEEK_END);
+    output->log_size = size > 0 ? size : 0;
+    return 0;
+}
+
+static void output_rotate_log(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    close(output->log_fd);
+
+    char * path = state_path(pipeline->name, ".log");
+    char * old_path = state_path(pipeline->name, ".log.1");
+    if (path != NULL && old_path != NULL) rename(path, old_path);
+    FREE(path);
+    FREE(old_path);
+
+    if (output_open_log(pipeline) < 0) output->log_fd = -1;
+}
+
+// Opens the log and maps the ring the first time the pipeline runs.
+static int output_open(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    if (output->ring != NULL) return 0;
+
+    char * path = state_path(pipeline->name, ".output");
+    int fd = path ? open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) : -1;
+    FREE(path);
+    if (fd < 0) return -1;
+
+    void * map = MAP_FAILED;
+    if (ftruncate(fd, sizeof(OutputRing)) == 0) {
+        map = mmap(NULL, sizeof(OutputRing), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    if (pipe2(output->side, O_NONBLOCK | O_CLOEXEC) < 0) {
+        munmap(map, sizeof(OutputRing));
+        return -1;
+    }
+
+    // Without a log the output still goes to the ring and the terminal:
+    if (output_open_log(pipeline) < 0) {
+        printf(">> Pipeline %s: unable to open log (%s)\n", pipeline->name, strerror(errno));
+    }
+
+    output->ring = map;
+    output->line_start = 1;
+    return 0;
+}
+
+int output_begin(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    if (output_open(pipeline) < 0) return -1;
+
+    // Whatever the previous command left behind:
+    output_end(pipeline);
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) < 0) return -1;
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+
+    output->fd = fds[0];
+    return fds[1];
+}
+
+static void ring_write(OutputRing * ring, char const * data, size_t len) {
+
+    uint64_t written = ring->written;
+    if (len > OUTPUT_RING_SIZE) {
+        written += len - OUTPUT_RING_SIZE;
+        data += len - OUTPUT_RING_SIZE;
+        len = OUTPUT_RING_SIZE;
+    }
+
+    size_t at = written % OUTPUT_RING_SIZE;
+    size_t first = len < OUTPUT_RING_SIZE - at ? len : OUTPUT_RING_SIZE - at;
+    memcpy(ring->data + at, data, first);
+    memcpy(ring->data, data + first, len - first);
+
+    // Readers check the count after copying, so the data goes in first:
+    __atomic_store_n(&ring->written, written + len, __ATOMIC_RELEASE);
+}
+
+// Shows output on the terminal with each line prefixed by the pipeline's name.
+// What the terminal won't take right away is dropped and counted.
+static void terminal_write(Pipeline * pipeline, char const * data, size_t len) {
+
+    PipelineOutput * output = &pipeline->output;
+    char buf[8192];
+    int used = 0;
+
+    if (output->skipped > 0) {
+        used = snprintf(buf, sizeof(buf), "%s[%s] (%llu bytes not shown, see .pipelines/%s.log)\n",
+                        output->line_start ? "" : "\n", pipeline->name,
+                        (unsigned long long) output->skipped, pipeline->name);
+        output->line_start = 1;
+        output->skipped = 0;
+    }
+
+    int name_len = strlen(pipeline->name);
+    size_t i = 0;
+    while (i < len) {
+
+        // Room for a prefix and at least one byte:
+        if (used + name_len + 4 > (int) sizeof(buf)) {
+            ssize_t n = write(terminal_fd, buf, used);
+            if (n < used) {
+                output->skipped += len - i + (used - (n > 0 ? n : 0));
+                return;
+            }
+            used = 0;
+        }
+
+        if (output->line_start) {
+            buf[used++] = '[';
+            memcpy(buf + used, pipeline->name, name_len);
+            used += name_len;
+            buf[used++] = ']';
+            buf[used++] = ' ';
+            output->line_start = 0;
+        }
+
+        // Copy up to the end of the line, or as much as fits:
+        char const * end = memchr(data + i, '\n', len - i);
+        size_t chunk = end ? (size_t) (end - (data + i)) + 1 : len - i;
+        if (chunk > sizeof(buf) - used) chunk = sizeof(buf) - used;
+
+        memcpy(buf + used, data + i, chunk);
+        used += chunk;
+        i += chunk;
+        output->line_start = buf[used - 1] == '\n';
+    }
+
+    if (used > 0) {
+        ssize_t n = write(terminal_fd, buf, used);
+        if (n < used) output->skipped += used - (n > 0 ? n : 0);
+    }
+}
+
+// Moves len bytes that are waiting in the command's pipe to the log.
+static void log_move(PipelineOutput * output, size_t len, char * buf, size_t buf_size) {
+
+    while (len > 0) {
+        ssize_t n = splice(output->fd, NULL, output->log_fd, NULL, len, SPLICE_F_MOVE);
+        if (n <= 0) break;
+        output->log_size += n;
+        len -= n;
+    }
+
+    // The log refused some of it. It still has to leave the pipe:
+    while (len > 0) {
+        ssize_t n = read(output->fd, buf, len < buf_size ? len : buf_size);
+        if (n <= 0) break;
+        len -= n;
+    }
+}
+
+int output_drain(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    char buf[16384];
+
+    for (;;) {
+
+        ssize_t n;
+        if (output->log_fd >= 0) {
+
+            // The original goes to the log, the copy is read back here:
+            n = tee(output->fd, output->side[1], sizeof(buf), SPLICE_F_NONBLOCK);
+            if (n > 0) {
+                log_move(output, n, buf, sizeof(buf));
+                n = read(output->side[0], buf, n);
+            }
+
+        } else {
+            n = read(output->fd, buf, sizeof(buf));
+        }
+
+        if (n == 0) return 0;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN ? 1 : -1;
+        }
+
+        ring_write(output->ring, buf, n);
+        terminal_write(pipeline, buf, n);
+
+        if (output->log_fd >= 0 && output->log_size > OUTPUT_LOG_MAX) output_rotate_log(pipeline);
+    }
+}
+
+void output_write(Pipeline * pipeline, char const * data, size_t len) {
+
+    PipelineOutput * output = &pipeline->output;
+    if (len == 0 || output_open(pipeline) < 0) return;
+
+    if (output->log_fd >= 0 && write_all(output->log_fd, data, len) == 0) output->log_size += len;
+    ring_write(output->ring, data, len);
+    terminal_write(pipeline, data, len);
+
+    if (output->log_fd >= 0 && output->log_size > OUTPUT_LOG_MAX) output_rotate_log(pipeline);
+    if (!output->line_start && write(terminal_fd, "\n", 1) == 1) output->line_start = 1;
+}
+
+void output_end(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    if (output->fd < 0) return;
+
+    output_drain(pipeline);
+    close(output->fd);
+    output->fd = -1;
+
+    // Don't let the next line shown run on from an unfinished one:
+    if (!output->line_start && write(terminal_fd, "\n", 1) == 1) output->line_start = 1;
+}
+
+void output_close(Pipeline * pipeline) {
+
+    PipelineOutput * output = &pipeline->output;
+    output_end(pipeline);
+    if (output->ring == NULL) return;
+
+    if (output->log_fd >= 0) close(output->log_fd);
+    close(output->side[0]);
+    close(output->side[1]);
+    munmap(output->ring, sizeof(OutputRing));
+
+    output->log_fd = -1;
+    output->ring = NULL;
+}
+
+int output_print_tail(char const * name, int max_bytes) {
+
+    char * path = state_path(name, ".output");
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    FREE(path);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(OutputRing)) {
+        map = mmap(NULL, sizeof(OutputRing), PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    OutputRing * ring = map;
+    uint64_t written = __atomic_load_n(&ring->written, __ATOMIC_ACQUIRE);
+
+    uint64_t len = written < OUTPUT_RING_SIZE ? written : OUTPUT_RING_SIZE;
+    if (max_bytes >= 0 && len > (uint64_t) max_bytes) len = max_bytes;
+
+    // Copied in at most two pieces, oldest first:
+    uint64_t start = written - len;
+    while (len > 0) {
+        size_t at = start % OUTPUT_RING_SIZE;
+        size_t chunk = len < OUTPUT_RING_SIZE - at ? len : OUTPUT_RING_SIZE - at;
+        write_all(STDOUT_FILENO, ring->data + at, chunk);
+        start += chunk;
+        len -= chunk;
+    }
+
+    munmap(map, sizeof(OutputRing));
+    return 0;
+}
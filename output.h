@@ -0,0 +1,63 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// How much of each pipeline's most recent output is kept for reading back.
+#define OUTPUT_RING_SIZE (64 * 1024)
+
+// Log files are rotated to "<name>.log.1" once they grow past this:
+#define OUTPUT_LOG_MAX (16 * 1024 * 1024)
+
+// The tail of a pipeline's output. It's mapped from .pipelines/<name>.output,
+// so other processes (and "pipelines -l") can read it while it's written.
+typedef struct {
+    uint64_t written;   // Bytes ever written; data holds the last OUTPUT_RING_SIZE of them
+    char data[OUTPUT_RING_SIZE];
+} OutputRing;
+
+// Where a pipeline's output goes. Commands write into a pipe that the engine
+// drains without ever blocking: tee() copies what's there into a side pipe,
+// splice() moves the original into the log file without it passing through
+// user space, and the copy is read into the ring and shown on the terminal.
+typedef struct {
+    int fd;             // Read end of the running command's stdout and stderr, or -1
+    int side[2];        // The tee() copy
+    int log_fd;
+    uint64_t log_size;
+    OutputRing * ring;
+    int line_start;     // The terminal view is at the start of a line
+    uint64_t skipped;   // Bytes the terminal view had to drop
+} PipelineOutput;
+
+struct Pipeline;
+
+// Sets up the terminal view. It writes through its own non-blocking file
+// description, so a slow or paused terminal drops output instead of stalling
+// commands. Call once at startup.
+void output_init();
+
+// Creates the pipe for a command about to be started. Returns the end the
+// command writes to (which the caller closes once it's started), or -1 to
+// let the command inherit the terminal.
+int output_begin(struct Pipeline * pipeline);
+
+// Moves everything waiting in the pipe to the log, the ring and the terminal.
+// Returns 0 at end of file, -1 on error and 1 otherwise.
+int output_drain(struct Pipeline * pipeline);
+
+// Records output that didn't come through a pipe, such as a worker's
+// response (see worker.h), as if a command had printed it.
+void output_write(struct Pipeline * pipeline, char const * data, size_t len);
+
+// Drains what's left once a command has exited and closes its pipe. Output
+// from processes it left running is dropped.
+void output_end(struct Pipeline * pipeline);
+
+void output_close(struct Pipeline * pipeline);
+
+// Prints the recorded tail of a pipeline's output (at most max_bytes).
+int output_print_tail(char const * name, int max_bytes);
+
+#endif // OUTPUT_H
@@ -1,7 +1,9 @@
 #include "pipelines.h"
 #include "parser.h"
+#include "isolation.h"
 
 #include <yaml.h>
+#include <limits.h>
 
 typedef enum {
     STATE_DOCUMENT,
@@ -13,9 +15,10 @@ typedef enum {
     STATE_PIPELINE_FIELDS,
     STATE_PIPELINE_FIELD_NAME,
     STATE_PIPELINE_FIELD_VALUE_WORKDIR,
-    STATE_PIPELINE_FIELD_VALUE_WATCH_PATH,
-    STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE,
+    STATE_PIPELINE_FIELD_VALUE_LIST,
+    STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE,
     STATE_PIPELINE_FIELD_VALUE_CMD,
+    STATE_PIPELINE_FIELD_VALUE_OPTION,
     STATE_FINISHED,
 } PipelineParserState;
 
@@ -49,15 +52,18 @@ static char * state_str(PipelineParserState state) {
         case STATE_PIPELINE_FIELD_VALUE_WORKDIR: {
             return "STATE_PIPELINE_FIELD_VALUE_WORKDIR";
         }
-        case STATE_PIPELINE_FIELD_VALUE_WATCH_PATH: {
-            return "STATE_PIPELINE_FIELD_VALUE_WATCH_PATH";
+        case STATE_PIPELINE_FIELD_VALUE_LIST: {
+            return "STATE_PIPELINE_FIELD_VALUE_LIST";
         }
-        case STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE: {
-            return "STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE";
+        case STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE: {
+            return "STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE";
         }
         case STATE_PIPELINE_FIELD_VALUE_CMD: {
             return "STATE_PIPELINE_FIELD_VALUE_CMD";
         }
+        case STATE_PIPELINE_FIELD_VALUE_OPTION: {
+            return "STATE_PIPELINE_FIELD_VALUE_OPTION";
+        }
         case STATE_FINISHED: {
             return "STATE_FINISHED";
         }
@@ -66,12 +72,126 @@ static char * state_str(PipelineParserState state) {
     return "NO STRING FOR STATE";
 }
 
-Pipeline * pipelines_parse_pipefile(char const * path) {
+static int parse_bool(char const * value, int * result) {
+
+    if (strcmp(value, "true") == 0 || strcmp(value, "yes") == 0 || strcmp(value, "1") == 0) {
+        *result = 1;
+    } else if (strcmp(value, "false") == 0 || strcmp(value, "no") == 0 || strcmp(value, "0") == 0) {
+        *result = 0;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_int(char const * value, int * result) {
+
+    char * end;
+    errno = 0;
+    long v = strtol(value, &end, 10);
+    if (errno != 0 || end == value || *end != '\0' || v < 0 || v > INT_MAX) {
+        return -1;
+    }
+
+    *result = (int) v;
+    return 0;
+}
+
+// Applies a scalar pipeline option such as "recursive: false".
+static int pipeline_set_option(Pipeline * pipeline, char const * option, char const * value) {
+
+    if (strcmp(option, "recursive") == 0) {
+        return parse_bool(value, &pipeline->recursive);
+
+    } else if (strcmp(option, "shell") == 0) {
+        return parse_bool(value, &pipeline->shell);
+
+    } else if (strcmp(option, "hash_changes") == 0) {
+        return parse_bool(value, &pipeline->hash_changes);
+
+    } else if (strcmp(option, "action_cache") == 0) {
+        return parse_bool(value, &pipeline->action_cache);
+
+    } else if (strcmp(option, "debounce_ms") == 0) {
+        return parse_int(value, &pipeline->debounce_ms);
+
+    } else if (strcmp(option, "max_delay_ms") == 0) {
+        return parse_int(value, &pipeline->max_delay_ms);
+
+    } else if (strcmp(option, "stop_timeout_ms") == 0) {
+        return parse_int(value, &pipeline->stop_timeout_ms);
+
+    } else if (strcmp(option, "worker") == 0) {
+        return parse_bool(value, &pipeline->worker);
+
+    } else if (strcmp(option, "worker_pool") == 0) {
+        if (parse_int(value, &pipeline->worker_pool) < 0 || pipeline->worker_pool == 0) return -1;
+        return 0;
+
+    } else if (strcmp(option, "nice") == 0) {
+        // parse_int() only takes counts, and nice values go below zero:
+        char * end;
+        long v = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || v < -20 || v > 19) return -1;
+        pipeline->nice = (int) v;
+        return 0;
+
+    } else if (strcmp(option, "ioprio") == 0) {
+        return isolation_parse_ioprio(value, &pipeline->ioprio);
+
+    } else if (strcmp(option, "cpus") == 0) {
+        cpu_set_t cpus;
+        if (isolation_parse_cpus(value, &cpus) < 0) return -1;
+        FREE(pipeline->cpus);
+        pipeline->cpus = copy_str(value);
+        return pipeline->cpus == NULL ? -1 : 0;
+
+    } else if (strcmp(option, "cgroup") == 0) {
+        if (value[0] != '/') return -1;
+        FREE(pipeline->cgroup);
+        pipeline->cgroup = copy_str(value);
+        return pipeline->cgroup == NULL ? -1 : 0;
+
+    } else if (strcmp(option, "cpu_weight") == 0) {
+        if (parse_int(value, &pipeline->cpu_weight) < 0 || pipeline->cpu_weight < 1 || pipeline->cpu_weight > 10000) {
+            pipeline->cpu_weight = 0;
+            return -1;
+        }
+        return 0;
+
+    } else if (strcmp(option, "memory_high") == 0) {
+        // Bytes with an optional K, M, G or T suffix, as the kernel takes them, or "max":
+        char const * suffix = value + strspn(value, "0123456789");
+        int valid = strcmp(value, "max") == 0 ||
+                    (suffix != value && (*suffix == '\0' || (strchr("KMGT", *suffix) != NULL && suffix[1] == '\0')));
+        if (!valid) return -1;
+
+        FREE(pipeline->memory_high);
+        pipeline->memory_high = copy_str(value);
+        return pipeline->memory_high == NULL ? -1 : 0;
+
+    } else if (strcmp(option, "watch_backend") == 0) {
+        if (strcmp(value, "inotify") == 0) pipeline->watch_backend = PIPELINE_WATCH_INOTIFY;
+        else if (strcmp(value, "fanotify") == 0) pipeline->watch_backend = PIPELINE_WATCH_FANOTIFY;
+        else return -1;
+        return 0;
+
+    } else if (strcmp(option, "on_change") == 0) {
+        if (strcmp(value, "queue") == 0) pipeline->on_change = PIPELINE_ON_CHANGE_QUEUE;
+        else if (strcmp(value, "restart") == 0) pipeline->on_change = PIPELINE_ON_CHANGE_RESTART;
+        else if (strcmp(value, "ignore") == 0) pipeline->on_change = PIPELINE_ON_CHANGE_IGNORE;
+        else return -1;
+        return 0;
+    }
+
+    return -1;
+}
+
+static Pipeline * parse_pipefile(char const * path) {
 
     Pipeline * pipeline = NULL;
-    char const ** watch_path = NULL;
-    int watch_path_count = 0;
-    int watch_paths_allocated = 0;
+    char * option = NULL;
+    char *** list = NULL;
 
     char * contents = read_entire_file(path);
     if (contents == NULL) return NULL;
@@ -199,47 +319,60 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
                             state = STATE_PIPELINE_FIELD_VALUE_WORKDIR;
 
                         } else if (strcmp(event.data.scalar.value, "watch_paths") == 0) {
-                            state = STATE_PIPELINE_FIELD_VALUE_WATCH_PATH;
-                            
+                            list = &pipeline->watch_paths;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
+                        } else if (strcmp(event.data.scalar.value, "include") == 0) {
+                            list = &pipeline->include;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
+                        } else if (strcmp(event.data.scalar.value, "exclude") == 0) {
+                            list = &pipeline->exclude;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
+                        } else if (strcmp(event.data.scalar.value, "depends_on") == 0) {
+                            list = &pipeline->depends_on;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
+                        } else if (strcmp(event.data.scalar.value, "outputs") == 0) {
+                            list = &pipeline->outputs;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
+                        } else if (strcmp(event.data.scalar.value, "env") == 0) {
+                            list = &pipeline->env;
+                            state = STATE_PIPELINE_FIELD_VALUE_LIST;
+
                         } else if (strcmp(event.data.scalar.value, "cmd") == 0) {
                             state = STATE_PIPELINE_FIELD_VALUE_CMD;
+
+                        } else {
+                            FREE(option);
+                            option = copy_str(event.data.scalar.value);
+                            state = STATE_PIPELINE_FIELD_VALUE_OPTION;
                         }
                         break;
                     }
 
                     case STATE_PIPELINE_FIELD_VALUE_WORKDIR: {
+                        // Relative workdirs are relative to the Pipefile's directory:
+                        char cwd[PATH_MAX];
                         FREE(pipeline->workdir);
-                        pipeline->workdir = copy_str(event.data.scalar.value);
+                        pipeline->workdir = getcwd(cwd, sizeof(cwd)) == NULL
+                            ? copy_str(event.data.scalar.value)
+                            : join_path(cwd, event.data.scalar.value);
                         state = STATE_PIPELINE_FIELD_NAME;
                         break;
                     }
 
-                    case STATE_PIPELINE_FIELD_VALUE_WATCH_PATH:
-                    case STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE: {
-                        
-                        ++watch_path_count;
-                        if (watch_paths_allocated < watch_path_count + 1) {
-
-                            if (watch_paths_allocated == 0) ++watch_paths_allocated;
-                            watch_paths_allocated *= 2;
+                    case STATE_PIPELINE_FIELD_VALUE_LIST:
+                    case STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE: {
 
-                            char ** watch_paths = ALLOC(sizeof(char *) * watch_paths_allocated);
-                            if (watch_paths == NULL) {
-                                goto error;
-                            }
-
-                            if (pipeline->watch_paths != NULL) {
-                                memcpy(watch_paths, pipeline->watch_paths, sizeof(char *) * watch_path_count);
-                                FREE(pipeline->watch_paths);
-                            }
-
-                            pipeline->watch_paths = watch_paths;
+                        // A list field takes either a single scalar or a sequence of them:
+                        if (str_list_append(list, event.data.scalar.value) < 0) {
+                            goto error;
                         }
 
-                        pipeline->watch_paths[watch_path_count - 1] = copy_str(event.data.scalar.value);
-                        pipeline->watch_paths[watch_path_count] = NULL;
-
-                        if (state == STATE_PIPELINE_FIELD_VALUE_WATCH_PATH) {
+                        if (state == STATE_PIPELINE_FIELD_VALUE_LIST) {
                             state = STATE_PIPELINE_FIELD_NAME;
                         }
                         break;
@@ -251,6 +384,15 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
                         state = STATE_PIPELINE_FIELD_NAME;
                         break;
                     }
+
+                    case STATE_PIPELINE_FIELD_VALUE_OPTION: {
+                        if (pipeline_set_option(pipeline, option, event.data.scalar.value) != 0) {
+                            printf("Pipeline %s: ignoring invalid option \"%s: %s\"\n",
+                                   pipeline->name, option, event.data.scalar.value);
+                        }
+                        state = STATE_PIPELINE_FIELD_NAME;
+                        break;
+                    }
                 }
 
                 break;
@@ -264,8 +406,8 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
                 if (state == STATE_PIPELINES_SEQUENCE) {
                     state = STATE_PIPELINE;
 
-                } else if (state == STATE_PIPELINE_FIELD_VALUE_WATCH_PATH) {
-                    state = STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE;
+                } else if (state == STATE_PIPELINE_FIELD_VALUE_LIST) {
+                    state = STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE;
                 }
                 break;
             }
@@ -275,7 +417,7 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
                 snprintf(debug_line, sizeof(debug_line), "Sequence end\n");
                 #endif
 
-                if (state == STATE_PIPELINE_FIELD_VALUE_WATCH_PATH_SEQUENCE) {
+                if (state == STATE_PIPELINE_FIELD_VALUE_LIST_SEQUENCE) {
                     state = STATE_PIPELINE_FIELD_NAME;
                 }
 
@@ -303,20 +445,29 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
                             if (pipelines_allocated == 0) ++pipelines_allocated;
                             pipelines_allocated *= 2;
 
-                            Pipeline * new_pipelines = ALLOC(pipelines_allocated);
+                            Pipeline * new_pipelines = ALLOC(sizeof(Pipeline) * pipelines_allocated);
                             if (new_pipelines == NULL) {
                                 goto error;
                             }
 
-                            memcpy(new_pipelines, pipelines, sizeof(Pipeline) * (pipeline_count + 1));
+                            // Everything up to and including the old terminator, which is
+                            // the entry being started:
+                            memcpy(new_pipelines, pipelines, sizeof(Pipeline) * pipeline_count);
                             FREE(pipelines);
                             pipelines = new_pipelines;
                         }
 
                         pipeline = &pipelines[pipeline_count - 1];
                         pipeline->valid = 1;
-                        watch_paths_allocated = 0;
-                        watch_path_count = 0;
+                        pipeline->notify_fd = -1;
+                        pipeline->pidfd = -1;
+                        pipeline->output.fd = -1;
+                        pipeline->output.log_fd = -1;
+                        pipeline->recursive = 1;
+                        pipeline->shell = 1;
+                        pipeline->stop_timeout_ms = PIPELINE_STOP_TIMEOUT_MS;
+                        pipeline->worker_pool = 1;
+                        pipeline->worker_slot = -1;
 
                         memset(&pipelines[pipeline_count], 0, sizeof(Pipeline));
 
@@ -358,17 +509,50 @@ Pipeline * pipelines_parse_pipefile(char const * path) {
         yaml_event_delete(&event);
     }
 
+    // Compile each pipeline's include/exclude globs and its command line once, up front:
+    for (pipeline = pipelines; pipeline->valid; ++pipeline) {
+
+        // The cgroup's settings have nowhere to go without one:
+        if (pipeline->cgroup == NULL && (pipeline->cpu_weight != 0 || pipeline->memory_high != NULL)) {
+            printf("Pipeline %s: cpu_weight and memory_high need a cgroup, ignoring them\n", pipeline->name);
+            pipeline->cpu_weight = 0;
+            FREE(pipeline->memory_high);
+            pipeline->memory_high = NULL;
+        }
+
+        if (filter_compile(&pipeline->filter, pipeline->include, pipeline->exclude, pipeline->workdir) < 0) {
+            printf("Pipeline %s has an invalid include or exclude list\n", pipeline->name);
+            goto error;
+        }
+
+        if (pipeline->cmd == NULL || pipeline_prepare(pipeline) < 0) {
+            printf("Pipeline %s has an invalid cmd or env\n", pipeline->name);
+            goto error;
+        }
+
+        // Without declared outputs there's nothing to restore on a hit:
+        if (pipeline->action_cache && pipeline->outputs == NULL) {
+            printf("Pipeline %s: action_cache needs outputs, disabling it\n", pipeline->name);
+            pipeline->action_cache = 0;
+        }
+    }
+
+    FREE(option);
+    yaml_parser_delete(&parser);
     return pipelines;
 
 error:
 
+    // Everything else goes with the arena:
     yaml_parser_delete(&parser);
+    return NULL;
+}
 
-    pipeline = pipelines;
-    while (pipeline->valid) {
-        pipeline_free(pipeline);
-    }
+Pipeline * pipelines_parse_pipefile(char const * path, Arena * arena) {
 
-    FREE(pipelines);
-    return NULL;
+    Ctx saved = ctx_use_arena(arena);
+    Pipeline * pipelines = parse_pipefile(path);
+    ctx_restore(saved);
+
+    return pipelines;
 }
\ No newline at end of file
@@ -1,6 +1,11 @@
 #ifndef PARSER_H
 #define PARSER_H
 
-Pipeline * pipelines_parse_pipefile(char const * path);
+#include "pipelines.h"
+#include "arena.h"
+
+// Parses the Pipefile at path. Everything the returned pipelines' configuration
+// points to is allocated from arena, so it's all released by arena_free().
+Pipeline * pipelines_parse_pipefile(char const * path, Arena * arena);
 
 #endif // PARSER_H
\ No newline at end of file
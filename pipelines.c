@@ -1,179 +1,628 @@
 #include "pipelines.h"
-
+#include "watch.h"
+#include "jobserver.h"
+#include "actioncache.h"
+#include "arena.h"
+#include "graph.h"
+#include "worker.h"
+#include "isolation.h"
+
+#include <poll.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
-#include <sys/inotify.h>
+#include <sys/pidfd.h>
+#include <signal.h>
+#include <time.h>
+#include <spawn.h>
 
 char const * pipelines_strerror(PIPELINES_ERROR error);
 
+void pipeline_mark_dirty(Pipeline * pipeline) {
+
+    uint64_t now = now_ns();
+    if (!pipeline->dirty) pipeline->first_change_ns = now;
+    pipeline->last_change_ns = now;
+    pipeline->dirty = 1;
+}
+
+void pipeline_clear_dirty(Pipeline * pipeline) {
+
+    // Clearing a dirty pipeline means its run is about to start:
+    if (pipeline->dirty) metrics_observe(&pipeline->metrics->queue_wait, now_ns() - pipeline->first_change_ns);
+
+    pipeline->dirty = 0;
+    pipeline->first_change_ns = 0;
+    pipeline->last_change_ns = 0;
+}
+
+uint64_t pipeline_due_ns(Pipeline * pipeline) {
+
+    // Wait for a quiet period after the latest change, but never let a steady
+    // stream of changes hold the run back for longer than max_delay_ms:
+    uint64_t due = pipeline->last_change_ns + (uint64_t) pipeline->debounce_ms * 1000000;
+    if (pipeline->max_delay_ms > 0) {
+        uint64_t cap = pipeline->first_change_ns + (uint64_t) pipeline->max_delay_ms * 1000000;
+        if (cap < due) due = cap;
+    }
+    return due;
+}
+
+int pipeline_trigger_delay(Pipeline * pipeline) {
+
+    if (!pipeline->dirty) return -1;
+
+    uint64_t due = pipeline_due_ns(pipeline);
+    uint64_t now = now_ns();
+    if (due <= now) return 0;
+
+    // Round up so a poll() timeout never wakes just short of the deadline:
+    return (due - now + 999999) / 1000000;
+}
+
+void pipeline_stop_run(Pipeline * pipeline) {
+
+    if (pipeline->pid == 0 || pipeline->stop_deadline_ns != 0) return;
+
+    // The whole group, so nothing the command started is left running:
+    kill(-pipeline->pid, SIGTERM);
+    pipeline->stop_deadline_ns = now_ns() + (uint64_t) pipeline->stop_timeout_ms * 1000000;
+}
+
+int pipeline_supervise_run(Pipeline * pipeline) {
+
+    if (pipeline->stop_deadline_ns == 0) {
+
+        if (pipeline->on_change != PIPELINE_ON_CHANGE_RESTART) return -1;
+
+        // Changes are debounced as usual before the stale run is cut short:
+        int delay = pipeline_trigger_delay(pipeline);
+        if (delay != 0) return delay;
+
+        printf(">> Pipeline %s: changed while running, restarting\n", pipeline->name);
+        pipeline_stop_run(pipeline);
+    }
+
+    // Already sent SIGKILL, which it can't outlast:
+    if (pipeline->stop_deadline_ns == UINT64_MAX) return -1;
+
+    uint64_t now = now_ns();
+    if (pipeline->stop_deadline_ns > now) return (pipeline->stop_deadline_ns - now + 999999) / 1000000;
+
+    printf(">> Pipeline %s: still running %d ms after SIGTERM, killing it\n", pipeline->name,
+           pipeline->stop_timeout_ms);
+    kill(-pipeline->pid, SIGKILL);
+    pipeline->stop_deadline_ns = UINT64_MAX;
+    return -1;
+}
+
+int pipeline_end_run(Pipeline * pipeline) {
+
+    int stopped = pipeline->stop_deadline_ns != 0;
+    pipeline->stop_deadline_ns = 0;
+
+    // The changes the run was handed were cleared when it started, so the
+    // next one can't be given an accurate list. It runs straight away if it
+    // was already due.
+    if (stopped) {
+        pipeline->changes.incomplete = 1;
+        if (!pipeline->dirty) pipeline_mark_dirty(pipeline);
+
+    } else if (pipeline->on_change == PIPELINE_ON_CHANGE_IGNORE && pipeline->dirty) {
+        changeset_clear(&pipeline->changes);
+        pipeline->dirty = 0;
+        pipeline->first_change_ns = 0;
+        pipeline->last_change_ns = 0;
+    }
+
+    return stopped;
+}
+
+// Set by SIGINT or SIGTERM in a monitor process. Both stay blocked except
+// while the monitor sleeps in ppoll(), so a stop request can't slip in between
+// checking the flag and going to sleep.
+static volatile sig_atomic_t monitor_stopping;
+
+static void monitor_on_signal(int sig) {
+    (void) sig;
+    monitor_stopping = 1;
+}
+
+static int monitor_poll(struct pollfd * fds, int count, int timeout_ms) {
+
+    struct timespec timeout = { .tv_sec = timeout_ms / 1000, .tv_nsec = (timeout_ms % 1000) * 1000000L };
+
+    sigset_t unblocked;
+    sigemptyset(&unblocked);
+    return ppoll(fds, count, timeout_ms < 0 ? NULL : &timeout, &unblocked);
+}
+
+// Waits for a job slot. Returns 0 once one is taken, 1 if the monitor was
+// asked to stop meanwhile and -1 on error.
+static int monitor_acquire_token() {
+
+    for (;;) {
+        if (jobserver_try_acquire()) return 0;
+        if (monitor_stopping) return 1;
+
+        struct pollfd pfd = { .fd = jobserver.poll_fd, .events = POLLIN };
+        if (monitor_poll(&pfd, 1, -1) < 0 && errno != EINTR) return -1;
+    }
+}
+
 int pipeline_monitor(Pipeline * pipeline) {
 
-    int res = 0;
-
-    // Init inotify:
-    int fd = inotify_init();
-    if (fd < 0) {
-        res = fd;
-        goto exit;
-    }
-
-    // Calculate the number of paths:
-    int path_count = 0;
-    char ** path = pipeline->watch_paths;
-    while (*path++) {
-        ++path_count;
-    }
-
-    // Allocate an array with one watch descriptor for each path:
-    int * watches = ALLOC(sizeof(int) * path_count);
-    if (watches == NULL) {
-        res = -1;
-        goto exit;
-    }
-    
-    // Add watch descriptors:
-    int * wd = watches;
-    for (int i = 0; i < path_count; ++i) {
-        wd[i] = inotify_add_watch(fd, pipeline->watch_paths[i], IN_CLOSE_WRITE);
-        if (wd[i] < 0) {
-            printf("Error: %s\n", strerror(errno));
-            res = wd[i];
-            goto exit;
+    // The watch set is created once and kept for the life of the process:
+    if (pipeline->notify_fd < 0 && watch_open(pipeline) < 0) {
+        return -1;
+    }
+
+    // Changes made while the previous command ran are already queued, in
+    // which case this returns once they've settled and they cause one more
+    // run. Events keep being drained while waiting out the debounce period,
+    // so a burst collapses into a single run.
+    int delay;
+    while (!monitor_stopping && (delay = pipeline_trigger_delay(pipeline)) != 0) {
+
+        struct pollfd pfd = { .fd = pipeline->notify_fd, .events = POLLIN };
+        if (monitor_poll(&pfd, 1, delay) < 0 && errno != EINTR) {
+            return -1;
+        }
+
+        if (watch_drain(pipeline) < 0) {
+            return -1;
         }
     }
 
-    // Output log message stating that we're watching:
-    printf("(%d) >> Pipeline %s monitoring ", getpid(), pipeline->name);
-    for (int i = 0; i < path_count; ++i) {
-        printf("\"%s\"", pipeline->watch_paths[i]);
-        if (i < path_count - 1) printf(", ");
+    if (monitor_stopping) return 1;
+
+    pipeline_clear_dirty(pipeline);
+    return 0;
+}
+
+// Launches argv[0] in workdir. posix_spawn() runs the child on the parent's
+// address space (CLONE_VM | CLONE_VFORK) until it execs, so the cost of a
+// launch doesn't grow with the size of the watcher's directory index the way
+// fork() does.
+pid_t pipeline_spawn_argv(char const * workdir, char * const * argv, char * const * envp,
+                          int input_fd, int output_fd, int error_fd) {
+
+    // Flush pending output so it appears before anything the command prints:
+    fflush(stdout);
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) return PIPELINES_ERR_FORK;
+
+    // The engines keep SIGINT and SIGTERM blocked; commands get them as usual.
+    // Each command leads a process group of its own, so it can be stopped
+    // along with everything it started.
+    posix_spawnattr_t attr;
+    sigset_t unblocked;
+    sigemptyset(&unblocked);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &unblocked);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETPGROUP);
+
+    // A background process group that reads the terminal gets stopped, so
+    // commands read from /dev/null unless given something else:
+    int err = input_fd >= 0
+        ? posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO)
+        : posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    if (err == 0 && workdir != NULL) err = posix_spawn_file_actions_addchdir_np(&actions, workdir);
+    if (err == 0 && output_fd >= 0) err = posix_spawn_file_actions_adddup2(&actions, output_fd, STDOUT_FILENO);
+    if (err == 0 && error_fd >= 0) err = posix_spawn_file_actions_adddup2(&actions, error_fd, STDERR_FILENO);
+
+    pid_t pid;
+    if (err == 0) err = posix_spawn(&pid, argv[0], &actions, &attr, argv, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+
+    if (err != 0) {
+        errno = err;
+        return err == EAGAIN || err == ENOMEM ? PIPELINES_ERR_FORK : PIPELINES_ERR_EXEC;
     }
-    printf(" for changes\n");
+    return pid;
+}
+
+// A command can skip the shell if it's nothing but words separated by spaces:
+// no quoting, expansion, redirection or variable assignment.
+static int pipeline_cmd_is_simple(char const * cmd) {
+
+    if (strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~{}!\n\t") != NULL) return 0;
+
+    char const * end = strchr(cmd, ' ');
+    char const * eq = strchr(cmd, '=');
+    return eq == NULL || (end != NULL && eq > end);
+}
 
-    // Read some data from the file descriptor:
-    // TODO(ross): Actually parse the event and use its metadata.
-    char buf[2048];
-    int r = read(fd, buf, sizeof(buf));
-    if (r <= 0) {
-        res = r;
-        goto exit;
+// Finds an executable in the pipeline's PATH, as the shell would.
+static char * pipeline_find_executable(Pipeline * pipeline, char const * name) {
+
+    if (strchr(name, '/') != NULL) return join_path(pipeline->workdir, name);
+
+    char const * path = PIPELINES_DEFAULT_PATH;
+    for (int i = 0; i < pipeline->envp_count; ++i) {
+        if (strncmp(pipeline->envp[i], "PATH=", 5) == 0) path = pipeline->envp[i];
     }
+    path += 5;
 
-exit:
-    FREE(watches);
-    close(fd);
-    return res;
+    char candidate[PATH_MAX];
+    while (*path) {
+
+        int len = strcspn(path, ":");
+        if (snprintf(candidate, sizeof(candidate), "%.*s/%s", len, path, name) < (int) sizeof(candidate)) {
+
+            // Relative PATH entries are relative to the workdir the command runs in:
+            char * full_path = join_path(pipeline->workdir, candidate);
+            if (full_path != NULL && access(full_path, X_OK) == 0) return full_path;
+            FREE(full_path);
+        }
+
+        path += len;
+        if (*path == ':') ++path;
+    }
+    return NULL;
+}
+
+int pipeline_prepare(Pipeline * pipeline) {
+
+    // The environment is every "env" entry, behind a default PATH unless the
+    // pipeline sets its own. Spare slots at the end take the variables that
+    // change from run to run.
+    int count = 0;
+    int has_path = 0;
+    for (char ** var = pipeline->env; var && *var; ++var, ++count) {
+        if (strchr(*var, '=') == NULL || **var == '=') {
+            printf("Pipeline %s: invalid env entry \"%s\", expected NAME=value\n", pipeline->name, *var);
+            return -1;
+        }
+        has_path |= strncmp(*var, "PATH=", 5) == 0;
+    }
+
+    pipeline->envp = ALLOC(sizeof(char *) * (count + 1 + PIPELINE_RUN_ENV_SLOTS + 1));
+    if (pipeline->envp == NULL) return -1;
+
+    pipeline->envp_count = 0;
+    if (!has_path) pipeline->envp[pipeline->envp_count++] = copy_str(PIPELINES_DEFAULT_PATH);
+    for (char ** var = pipeline->env; var && *var; ++var) {
+        pipeline->envp[pipeline->envp_count++] = copy_str(*var);
+    }
+    pipeline->envp[pipeline->envp_count] = NULL;
+
+    for (int i = 0; i < pipeline->envp_count; ++i) {
+        if (pipeline->envp[i] == NULL) return -1;
+    }
+
+    // Simple commands can be run directly, with the executable looked up once
+    // here rather than by a shell on every run:
+    if (!pipeline->shell && pipeline_cmd_is_simple(pipeline->cmd)) {
+
+        char * cmd_copy = copy_str(pipeline->cmd);
+        if (cmd_copy == NULL) return -1;
+
+        for (char * word = strtok(cmd_copy, " "); word; word = strtok(NULL, " ")) {
+            if (str_list_append(&pipeline->argv, word) < 0) {
+                FREE(cmd_copy);
+                return -1;
+            }
+        }
+        FREE(cmd_copy);
+
+        char * executable = pipeline->argv ? pipeline_find_executable(pipeline, pipeline->argv[0]) : NULL;
+        if (executable != NULL) {
+            FREE(pipeline->argv[0]);
+            pipeline->argv[0] = executable;
+            return isolation_wrap(pipeline);
+        }
+
+        printf("Pipeline %s: \"%s\" not found in PATH, running through /bin/sh\n",
+               pipeline->name, pipeline->argv ? pipeline->argv[0] : "");
+        for (char ** arg = pipeline->argv; arg && *arg; ++arg) FREE(*arg);
+        FREE(pipeline->argv);
+        pipeline->argv = NULL;
+
+    } else if (!pipeline->shell) {
+        printf("Pipeline %s: command needs a shell, running through /bin/sh\n", pipeline->name);
+    }
+
+    if (str_list_append(&pipeline->argv, "/bin/sh") < 0 ||
+        str_list_append(&pipeline->argv, "-c") < 0 ||
+        str_list_append(&pipeline->argv, pipeline->cmd) < 0) {
+        return -1;
+    }
+    return isolation_wrap(pipeline);
 }
 
-int pipeline_run_cmd(char const * command, PIPELINES_RUN_FLAGS flags) {
+void pipeline_run_started(Pipeline * pipeline) {
 
-    int res = 0;
-    char ** arg_list;
-    char * cmd_copy;
+    changeset_clear(&pipeline->changes);
 
-    int const cmd_len = strlen(command);
-    if (cmd_len == 0) return PIPELINES_ERR_ARG_INVALID;
+    // Persist the hashes behind this run so they survive a restart:
+    if (pipeline->hash_changes && hashcache_save(&pipeline->hashes) < 0) {
+        printf(">> Pipeline %s: unable to save hash cache (%s)\n", pipeline->name, strerror(errno));
+    }
+
+    pipeline->run_start_ns = now_ns();
+    METRIC_ADD(pipeline->metrics, runs_started, 1);
+    METRIC_SET(pipeline->metrics, running, 1);
+}
 
-    // Copy command string:
-    cmd_copy = ALLOC(cmd_len + 1);
-    if (cmd_copy == NULL) {
-        res = PIPELINES_ERR_ALLOC;
-        goto exit;
+pid_t pipeline_spawn(Pipeline * pipeline) {
+
+    char changed_file[64];
+    char changed_count[64];
+    int env_count = pipeline->envp_count;
+
+    // Hand the changed paths to the command as a file list. It lives in an
+    // anonymous memfd the child inherits, so there's nothing to clean up. If
+    // the set is incomplete the variables are left unset, meaning "assume
+    // everything changed".
+    int fd = -1;
+    if (!pipeline->changes.incomplete) {
+
+        fd = memfd_create("pipelines-changed", 0);
+        if (fd >= 0 && changeset_write(&pipeline->changes, fd) == 0) {
+            snprintf(changed_file, sizeof(changed_file), "PIPELINES_CHANGED_FILE=/dev/fd/%d", fd);
+            snprintf(changed_count, sizeof(changed_count), "PIPELINES_CHANGED_COUNT=%d", pipeline->changes.count);
+            pipeline->envp[env_count++] = changed_file;
+            pipeline->envp[env_count++] = changed_count;
+        }
     }
-    memcpy(cmd_copy, command, cmd_len + 1);
 
-    // Prepare command-line arguments:
-    if (flags & PIPELINES_RUN_IN_SHELL) {
+    // Let any make the command runs share the global job budget:
+    if (jobserver_enabled()) {
+        pipeline->envp[env_count++] = (char *) jobserver_makeflags();
+    }
 
-        // Command will execute in a shell, so pass it as a single argument.
-        char const * shell_args[4] = {
-            "/bin/sh", "-c", cmd_copy, NULL
-        };
+    // Its output is captured through a pipe the engine drains:
+    int output_fd = output_begin(pipeline);
 
-        arg_list = ALLOC(sizeof(shell_args));
-        if (arg_list == NULL) { res = PIPELINES_ERR_ALLOC; goto exit; }
+    // The per-run variables only live in the spare slots for this call:
+    pipeline->envp[env_count] = NULL;
+    pid_t pid = pipeline_spawn_argv(pipeline->workdir, pipeline->argv, pipeline->envp, -1, output_fd, output_fd);
+    pipeline->envp[pipeline->envp_count] = NULL;
 
-        memcpy(arg_list, shell_args, sizeof(char const *) * 4);
+    if (output_fd >= 0) close(output_fd);
 
+    // A command that couldn't be started keeps its changes, so the next run
+    // is still given them:
+    if (pid > 0) {
+        pipeline_run_started(pipeline);
     } else {
+        METRIC_ADD(pipeline->metrics, spawn_failures, 1);
+        output_end(pipeline);
+    }
 
-        // Split the command by whitespace so that argv[] is correct:
-        arg_list = ALLOC((count_in_str(command, ' ') + 2) * sizeof(char const *));
-        if (arg_list == NULL) { res = PIPELINES_ERR_ALLOC; goto exit; }
-
-        split_str(arg_list, cmd_copy, ' ');
-    }
-    
-    // Fork a child process:
-    switch (fork()) {
-        case 0: break;
-        case -1: res = PIPELINES_ERR_FORK; goto exit;
-        default: {
-            int status;
-            wait(&status);
-            res = status == 0 ? PIPELINES_ERR_NONE : PIPELINES_ERR_NONZERO_STATUS;
-            goto exit;
-        }
+    if (fd >= 0) close(fd);
+    return pid;
+}
+
+static uint64_t stamp_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+// Adds the metadata of everything at and below path to the stamp. Entries are
+// summed so that directory listing order doesn't matter.
+static void stamp_path(char * path, int len, uint64_t * stamp) {
+
+    struct stat st;
+    if (lstat(path, &st) < 0) return;
+
+    uint64_t h = 1469598103934665603ull;
+    for (int i = 0; i < len; ++i) h = (h ^ (unsigned char) path[i]) * 1099511628211ull;
+    h = stamp_mix(h ^ st.st_ino);
+    h = stamp_mix(h ^ st.st_size);
+    h = stamp_mix(h ^ ((uint64_t) st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec));
+    *stamp += h;
+
+    if (!S_ISDIR(st.st_mode)) return;
+
+    DIR * dir = opendir(path);
+    if (dir == NULL) return;
+
+    struct dirent * entry;
+    while ((entry = readdir(dir)) != NULL) {
+
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+        int name_len = strlen(entry->d_name);
+        if (len + name_len + 2 > PATH_MAX) continue;
+
+        path[len] = '/';
+        memcpy(path + len + 1, entry->d_name, name_len + 1);
+        stamp_path(path, len + name_len + 1, stamp);
+        path[len] = '\0';
     }
 
-    // Specify environment:
-    char const * const env[] = {
-        "PATH=/usr/bin",
-        NULL
-    };
+    closedir(dir);
+}
+
+uint64_t pipeline_outputs_stamp(Pipeline * pipeline) {
 
-    // Replace forked child process with program specified in command:
-    if (execve(arg_list[0], (char **) arg_list, (char **) env) < 0) {
-        printf("Error trying to execute command: %s\n", strerror(errno));
-        res = PIPELINES_ERR_EXEC;
-        goto exit;
+    uint64_t stamp = 0;
+    char path[PATH_MAX];
+
+    for (char ** output = pipeline->outputs; output && *output; ++output) {
+
+        char * full_path = scratch_join_path(pipeline->workdir, *output);
+        if (full_path == NULL) continue;
+
+        int len = strlen(full_path);
+        if (len < PATH_MAX) {
+            memcpy(path, full_path, len + 1);
+            stamp_path(path, len, &stamp);
+        }
     }
 
-exit:
-    FREE(arg_list);
-    FREE(cmd_copy);
-    return res;
+    return stamp;
+}
+
+void pipeline_move_state(Pipeline * to, Pipeline * from) {
+
+    to->tree = from->tree;
+    to->notify_fd = from->notify_fd;
+    to->dirty = from->dirty;
+    to->first_change_ns = from->first_change_ns;
+    to->last_change_ns = from->last_change_ns;
+    to->changes = from->changes;
+    to->hashes = from->hashes;
+    to->inputs = from->inputs;
+    to->action_key = from->action_key;
+    to->outputs_stamp = from->outputs_stamp;
+    to->pid = from->pid;
+    to->pidfd = from->pidfd;
+    to->run_start_ns = from->run_start_ns;
+    to->stop_deadline_ns = from->stop_deadline_ns;
+    to->worker_slot = from->worker_slot;
+    to->metrics = from->metrics;
+    to->output = from->output;
+    watch_move(to);
+    worker_move(to);
+
+    // Leave nothing behind for pipeline_free() to release a second time:
+    from->tree = NULL;
+    from->notify_fd = -1;
+    memset(&from->changes, 0, sizeof(ChangeSet));
+    memset(&from->hashes, 0, sizeof(HashCache));
+    memset(&from->inputs, 0, sizeof(HashCache));
+    from->pid = 0;
+    from->pidfd = -1;
+    from->stop_deadline_ns = 0;
+    from->worker_slot = -1;
+    from->metrics = NULL;
+    memset(&from->output, 0, sizeof(PipelineOutput));
+    from->output.fd = -1;
+    from->output.log_fd = -1;
 }
 
 void pipeline_free(Pipeline * pipeline) {
 
-    FREE(pipeline->name);
-    char ** path = pipeline->watch_paths;
-    while (*path++) FREE(path);
-    FREE(pipeline->watch_paths);
-    FREE(pipeline->cmd);
+    // The configuration itself lives in the Pipefile's arena:
+    watch_close(pipeline);
+    changeset_free(&pipeline->changes);
+    graph_free(pipeline);
+    output_close(pipeline);
+
+    if (pipeline->pidfd >= 0) close(pipeline->pidfd);
+    pipeline->pidfd = -1;
+}
+
+// Waits for a command the monitor started. If the monitor is asked to stop
+// meanwhile, so is the command, and the run counts as still to be done.
+// stopped is set if the command was stopped rather than left to finish.
+static pid_t monitor_wait(Pipeline * pipeline, pid_t pid, int * status, int * stopped) {
+
+    pipeline->pid = pid;
+
+    // Until the command exits its output is drained, and changes are picked
+    // up as they come for its on_change policy. Without a pidfd, the end of
+    // its output stands in for the exit:
+    int pidfd = pidfd_open(pid, 0);
+    struct pollfd fds[3] = {
+        { .fd = pidfd, .events = POLLIN },
+        { .fd = pipeline->output.fd, .events = POLLIN },
+        { .fd = pipeline->notify_fd, .events = POLLIN },
+    };
+
+    while (fds[0].fd >= 0 || fds[1].fd >= 0) {
+
+        if (monitor_stopping) pipeline_stop_run(pipeline);
+        int timeout = pipeline_supervise_run(pipeline);
+
+        if (monitor_poll(fds, 3, timeout) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) break;
+        if (fds[1].revents && output_drain(pipeline) <= 0) fds[1].fd = -1;
+        if (fds[2].revents && watch_drain(pipeline) < 0) fds[2].fd = -1;
+    }
+
+    if (monitor_stopping) pipeline_stop_run(pipeline);
+    if (pidfd >= 0) close(pidfd);
+
+    pid_t res = waitpid(pid, status, 0);
+    pipeline->pid = 0;
+    output_end(pipeline);
+    *stopped = pipeline_end_run(pipeline);
+    return res;
 }
 
 int pipeline_start(Pipeline * pipeline) {
 
-    switch (fork()) {
+    pid_t pid = fork();
+    switch (pid) {
         case -1: return 1;
         case 0: {
 
+            // See monitor_stopping:
+            struct sigaction action = { .sa_handler = monitor_on_signal };
+            sigaction(SIGINT, &action, NULL);
+            sigaction(SIGTERM, &action, NULL);
+
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            sigprocmask(SIG_BLOCK, &signals, NULL);
+
             chdir(pipeline->workdir);
-            while (pipeline_monitor(pipeline) == 0) {
-                pipeline_run_cmd(pipeline->cmd, PIPELINES_RUN_IN_SHELL);
+            if (isolation_watcher_raised()) isolation_raise_watcher();
+
+            int res;
+            while ((res = pipeline_monitor(pipeline)) == 0) {
+
+                // Each running command holds one job slot:
+                if (jobserver_enabled() && (res = monitor_acquire_token()) != 0) break;
+
+                if (actioncache_lookup(pipeline)) {
+                    METRIC_ADD(pipeline->metrics, runs_cached, 1);
+
+                } else {
+
+                    int status = -1, stopped = 0;
+                    pid_t pid = pipeline_spawn(pipeline);
+                    if (pid > 0 && monitor_wait(pipeline, pid, &status, &stopped) == pid) {
+                        metrics_run_finished(pipeline, WIFEXITED(status), WEXITSTATUS(status));
+                    }
+
+                    if (status == 0 && !stopped) actioncache_store(pipeline);
+                }
+
+                if (jobserver_enabled()) jobserver_release();
+                scratch_reset();
             }
+
+            if (res > 0) {
+                watch_save_snapshot(pipeline);
+                watch_close(pipeline);
+                exit(0);
+            }
+
             printf(">> Error monitoring %s\n", pipeline->name);
             exit(1);
         }
     }
-    return 0;
-}
-
-int pipeline_wait_all_finished(Pipeline * pipelines) {
 
-    int count = 0;
-    while (pipelines->valid) {
-        ++pipelines;
-        ++count;
+    // The supervisor follows each monitor through a pidfd:
+    int pidfd = pidfd_open(pid, 0);
+    if (pidfd < 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        return 1;
     }
 
-    int result = 0;
-    int status = 0;
-
-    while (count--) {
-        wait(&status);
-        result += status;
-    }
-    return result;
+    pipeline->pid = pid;
+    pipeline->pidfd = pidfd;
+    return 0;
 }
\ No newline at end of file
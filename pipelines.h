@@ -3,19 +3,97 @@
 
 #include "ctx.h"
 #include "util.h"
+#include "changeset.h"
+#include "filter.h"
+#include "hashcache.h"
+#include "metrics.h"
+#include "output.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <stdint.h>
 
-typedef struct {
+// What a change does to a pipeline whose command is still running:
+typedef enum {
+    PIPELINE_ON_CHANGE_QUEUE = 0,       // Run again once it's finished (the default)
+    PIPELINE_ON_CHANGE_RESTART = 1,     // Stop it and start a fresh run
+    PIPELINE_ON_CHANGE_IGNORE = 2       // Let it finish and drop the change
+} PipelineOnChange;
+
+// How a pipeline is told about changes (see watch.h):
+typedef enum {
+    PIPELINE_WATCH_DEFAULT = 0,     // Whatever -w picked, which is inotify unless told otherwise
+    PIPELINE_WATCH_INOTIFY = 1,     // A kernel watch per directory
+    PIPELINE_WATCH_FANOTIFY = 2     // A mark per filesystem (see fanotify.h)
+} PipelineWatchBackend;
+
+// How long a command gets to exit after SIGTERM before it's sent SIGKILL:
+#define PIPELINE_STOP_TIMEOUT_MS 5000
+
+typedef struct Pipeline {
     char * name;
     char * workdir;
     char ** watch_paths;
+    char ** include;
+    char ** exclude;
+    Filter filter;
+    char ** depends_on;
+    char ** outputs;
     char * cmd;
+    char ** env;        // Extra "NAME=value" variables for the command
+    int shell;          // Run cmd through /bin/sh (simple commands can opt out)
+    int recursive;
+    int watch_backend;  // PipelineWatchBackend
+    int hash_changes;   // Ignore writes that leave a file's contents unchanged
+    int action_cache;   // Restore outputs for inputs that have been built before
+    int debounce_ms;    // Quiet period required before a run starts
+    int max_delay_ms;   // Upper bound on that wait while changes keep coming (0 = none)
+    int on_change;      // PipelineOnChange
+    int stop_timeout_ms;
+    int worker;         // Keep cmd running and send it each run (see worker.h)
+    int worker_pool;    // Most workers running cmd at once
+    int nice;           // The command's resource class (see isolation.h): 0 = as pipelines
+    int ioprio;         // As ioprio_set() takes it, 0 = as pipelines
+    char * cpus;        // CPU list the command may run on, such as "0-3,6"
+    char * cgroup;      // cgroup v2 directory the command runs in
+    int cpu_weight;     // Its cpu.weight (0 = leave as is)
+    char * memory_high; // Its memory.high
     int valid;
+
+    // Prepared once at load time by pipeline_prepare():
+    char ** argv;
+    char ** envp;       // Has room for PIPELINE_RUN_ENV_SLOTS more entries
+    int envp_count;
+
+    // Runtime state:
+    struct WatchTree * tree;
+    int notify_fd;
+    int dirty;
+    uint64_t first_change_ns;
+    uint64_t last_change_ns;
+    ChangeSet changes;
+    HashCache hashes;
+    HashCache inputs;   // Memoised input hashes for the action cache
+    uint64_t action_key;
+
+    // Dependency graph, resolved by the single-process engine:
+    int * upstream;
+    int upstream_count;
+    int * downstream;
+    int downstream_count;
+    int blocked;
+    uint64_t outputs_stamp;
+    pid_t pid;          // Also the command's process group
+    int pidfd;
+    uint64_t run_start_ns;
+    uint64_t stop_deadline_ns;  // When a command being stopped gets SIGKILL (0 = not stopping)
+    int worker_slot;    // The worker handling the current run, or -1
+
+    PipelineMetrics * metrics;
+    PipelineOutput output;
 } Pipeline;
 
 typedef enum {
@@ -39,14 +117,53 @@ inline char const * pipelines_strerror(PIPELINES_ERROR error) {
     return "NO_STRING_FOR_ERROR";
 }
 
-typedef enum {
-    PIPELINES_RUN_IN_SHELL = 1
-} PIPELINES_RUN_FLAGS;
+// The PATH commands get unless their pipeline sets one:
+#define PIPELINES_DEFAULT_PATH "PATH=/usr/bin"
+
+// Variables set per run: the changed file list, its length and MAKEFLAGS.
+#define PIPELINE_RUN_ENV_SLOTS 3
 
+// Builds the pipeline's argv and environment from its configuration, so that
+// nothing needs allocating or parsing when a change triggers a run.
+int pipeline_prepare(Pipeline * pipeline);
+
+// Hands the runtime state (watches, pending changes, caches, the running
+// command and metrics) of a pipeline over to its entry in a reloaded Pipefile.
+void pipeline_move_state(Pipeline * to, Pipeline * from);
+
+// Releases the runtime state a pipeline holds outside the Pipefile's arena.
 void pipeline_free(Pipeline * pipeline);
+void pipeline_mark_dirty(Pipeline * pipeline);
+void pipeline_clear_dirty(Pipeline * pipeline);
+
+// When a dirty pipeline's changes have settled and it's due to run.
+uint64_t pipeline_due_ns(Pipeline * pipeline);
+int pipeline_trigger_delay(Pipeline * pipeline);
+// Sends SIGTERM to the running command's process group, unless it's already
+// being stopped.
+void pipeline_stop_run(Pipeline * pipeline);
+// For a pipeline whose command is running: applies its on_change policy to the
+// changes that came in meanwhile, and sends SIGKILL to a command that hasn't
+// stopped in time. Returns the ms until it needs calling again, or -1.
+int pipeline_supervise_run(Pipeline * pipeline);
+// Called once the command has been reaped. A run that was stopped is counted
+// as still to be done; one under on_change: ignore forgets what changed while
+// it ran. Returns 1 if the run was stopped.
+int pipeline_end_run(Pipeline * pipeline);
+// Forks the pipeline's monitor process, for the fork engine. The parent keeps
+// its pid and a pidfd in the pipeline's pid and pidfd.
 int pipeline_start(Pipeline * pipeline);
+// Waits for the fork engine's next run. Returns 0 when one is due, 1 if the
+// monitor process was asked to stop and -1 on error.
 int pipeline_monitor(Pipeline * pipeline);
-int pipeline_run_cmd(char const * command, PIPELINES_RUN_FLAGS flags);
-int pipeline_wait_all_finished(Pipeline * pipelines);
+// Launches argv in workdir, in a process group of its own. Descriptors that
+// are -1 are left as they are, except stdin, which is /dev/null.
+pid_t pipeline_spawn_argv(char const * workdir, char * const * argv, char * const * envp,
+                          int input_fd, int output_fd, int error_fd);
+// Settles the bookkeeping for a run that has just started, by a command or
+// a worker: its changes are handed over, and the hashes behind them saved.
+void pipeline_run_started(Pipeline * pipeline);
+pid_t pipeline_spawn(Pipeline * pipeline);
+uint64_t pipeline_outputs_stamp(Pipeline * pipeline);
 
 #endif
\ No newline at end of file
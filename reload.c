@@ -0,0 +1,291 @@
+#include "reload.h"
+#include "parser.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+int reload_open(Reload * reload, char const * path, Arena * config) {
+
+    reload->path = path;
+    reload->config = config;
+
+    char const * slash = strrchr(path, '/');
+    reload->name = slash ? slash + 1 : path;
+
+    char dir[PATH_MAX];
+    if (slash == NULL) {
+        strcpy(dir, ".");
+    } else if (snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path) >= (int) sizeof(dir)) {
+        errno = ENAMETOOLONG;
+        reload->notify_fd = -1;
+        return -1;
+    }
+
+    reload->notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reload->notify_fd < 0) return -1;
+
+    if (inotify_add_watch(reload->notify_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) < 0) {
+        close(reload->notify_fd);
+        reload->notify_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int reload_pending(Reload * reload) {
+
+    int pending = 0;
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t r = read(reload->notify_fd, buf, sizeof(buf));
+        if (r <= 0) break;
+
+        for (char * p = buf; p < buf + r; ) {
+            struct inotify_event * ev = (struct inotify_event *) p;
+            if (ev->len > 0 && strcmp(ev->name, reload->name) == 0) pending = 1;
+            p += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+    return pending;
+}
+
+Pipeline * reload_parse(Reload * reload, Arena * next) {
+
+    arena_init(next, 64 * 1024);
+
+    Pipeline * pipelines = pipelines_parse_pipefile(reload->path, next);
+    if (pipelines == NULL) {
+        printf(">> %s is invalid, keeping the current configuration\n", reload->path);
+        arena_free(next);
+    }
+    return pipelines;
+}
+
+void reload_commit(Reload * reload, Arena * next) {
+    arena_free(reload->config);
+    *reload->config = *next;
+}
+
+int reload_find(Pipeline * pipelines, char const * name) {
+    for (int i = 0; pipelines[i].valid; ++i) {
+        if (strcmp(pipelines[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+static int str_equal(char const * a, char const * b) {
+    return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static int str_list_equal(char ** a, char ** b) {
+
+    while (a && *a && b && *b) {
+        if (strcmp(*a++, *b++) != 0) return 0;
+    }
+    return (a == NULL || *a == NULL) && (b == NULL || *b == NULL);
+}
+
+ReloadChange reload_diff(Pipeline const * old, Pipeline const * new) {
+
+    // Anything that decides what is watched, or what's kept per watched file:
+    if (!str_equal(old->workdir, new->workdir) ||
+        !str_list_equal(old->watch_paths, new->watch_paths) ||
+        !str_list_equal(old->include, new->include) ||
+        !str_list_equal(old->exclude, new->exclude) ||
+        old->recursive != new->recursive ||
+        old->watch_backend != new->watch_backend ||
+        old->hash_changes != new->hash_changes ||
+        old->action_cache != new->action_cache) {
+        return RELOAD_CHANGED_WATCH;
+    }
+
+    if (!str_equal(old->cmd, new->cmd) ||
+        !str_list_equal(old->env, new->env) ||
+        !str_list_equal(old->depends_on, new->depends_on) ||
+        !str_list_equal(old->outputs, new->outputs) ||
+        old->shell != new->shell ||
+        old->debounce_ms != new->debounce_ms ||
+        old->max_delay_ms != new->max_delay_ms ||
+        old->on_change != new->on_change ||
+        old->stop_timeout_ms != new->stop_timeout_ms ||
+        old->worker != new->worker ||
+        old->worker_pool != new->worker_pool ||
+        old->nice != new->nice ||
+        old->ioprio != new->ioprio ||
+        !str_equal(old->cpus, new->cpus) ||
+        !str_equal(old->cgroup, new->cgroup) ||
+        old->cpu_weight != new->cpu_weight ||
+        !str_equal(old->memory_high, new->memory_high)) {
+        return RELOAD_CHANGED;
+    }
+
+    return RELOAD_UNCHANGED;
+}
+
+// Stops a monitor process and waits for it to go.
+static void stop_monitor(Pipeline * pipeline) {
+
+    if (pipeline->pid == 0) return;
+
+    kill(pipeline->pid, SIGTERM);
+    siginfo_t info;
+    waitid(P_PIDFD, pipeline->pidfd, &info, WEXITED);
+
+    close(pipeline->pidfd);
+    pipeline->pidfd = -1;
+    pipeline->pid = 0;
+}
+
+// Applies an edited Pipefile to the fork engine. Returns the pipelines now
+// live, which are the old ones if the Pipefile couldn't be used.
+static Pipeline * reload_forked(Reload * reload, Pipeline * pipelines) {
+
+    Arena next;
+    Pipeline * updated = reload_parse(reload, &next);
+    if (updated == NULL) return pipelines;
+
+    int added = 0, changed = 0, removed = 0;
+
+    for (Pipeline * old = pipelines; old->valid; ++old) {
+
+        int index = reload_find(updated, old->name);
+        if (index < 0) {
+            printf(">> Pipeline %s removed\n", old->name);
+            stop_monitor(old);
+            ++removed;
+            continue;
+        }
+
+        // A monitor runs with the configuration it was forked with, so a
+        // changed pipeline gets a new one. Its metrics carry over either way.
+        if (reload_diff(old, &updated[index]) != RELOAD_UNCHANGED) {
+            printf(">> Pipeline %s changed, restarting it\n", old->name);
+            stop_monitor(old);
+            ++changed;
+        }
+        pipeline_move_state(&updated[index], old);
+    }
+
+    if (metrics_init(updated) < 0) {
+        printf("Unable to allocate metrics: %s\n", strerror(errno));
+    }
+
+    for (Pipeline * pipeline = updated; pipeline->valid; ++pipeline) {
+
+        if (reload_find(pipelines, pipeline->name) < 0) ++added;
+        if (pipeline->depends_on != NULL) {
+            printf(">> Pipeline %s: depends_on needs the epoll engine, ignoring it until restarted\n",
+                   pipeline->name);
+        }
+        if (pipeline->worker) {
+            printf(">> Pipeline %s: worker needs the epoll engine, running cmd directly until restarted\n",
+                   pipeline->name);
+        }
+
+        if (pipeline->pid == 0 && pipeline_start(pipeline) != 0) {
+            printf(">> Error monitoring %s\n", pipeline->name);
+        }
+    }
+
+    printf(">> Reloaded %s: %d added, %d changed, %d removed\n", reload->path, added, changed, removed);
+    reload_commit(reload, &next);
+    return updated;
+}
+
+// (Re)starts the metrics server so it serves the current set of pipelines.
+static pid_t restart_metrics(int metrics_fd, Pipeline * pipelines, pid_t pid) {
+
+    if (metrics_fd < 0) return 0;
+
+    if (pid > 0) {
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+    }
+
+    pid = metrics_start_server(metrics_fd, pipelines);
+    if (pid < 0) printf("Unable to start metrics server: %s\n", strerror(errno));
+    return pid;
+}
+
+int reload_supervise(Reload * reload, Pipeline * pipelines, int metrics_fd) {
+
+    int result = 0;
+    pid_t metrics_pid = restart_metrics(metrics_fd, pipelines, 0);
+
+    // SIGINT and SIGTERM stop every monitor, so each saves its snapshot:
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigprocmask(SIG_BLOCK, &signals, NULL);
+    int signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    for (;;) {
+
+        int count = 0, running = 0;
+        while (pipelines[count].valid) running += pipelines[count++].pid != 0;
+        if (running == 0) break;
+
+        // Slots 0 and 1 are the Pipefile and signals, then each pipeline's
+        // monitor by index:
+        struct pollfd * fds = ALLOC(sizeof(struct pollfd) * (count + 2));
+        if (fds == NULL) {
+            result = 1;
+            break;
+        }
+
+        fds[0] = (struct pollfd) { .fd = reload->notify_fd, .events = POLLIN };
+        fds[1] = (struct pollfd) { .fd = signal_fd, .events = POLLIN };
+        for (int i = 0; i < count; ++i) {
+            fds[i + 2] = (struct pollfd) { .fd = pipelines[i].pidfd, .events = POLLIN };
+        }
+
+        if (poll(fds, count + 2, -1) < 0 && errno != EINTR) {
+            FREE(fds);
+            result = 1;
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            printf(">> Stopping\n");
+            for (int i = 0; i < count; ++i) stop_monitor(&pipelines[i]);
+            FREE(fds);
+            break;
+        }
+
+        for (int i = 0; i < count; ++i) {
+
+            if (!(fds[i + 2].revents & POLLIN)) continue;
+
+            siginfo_t info = {0};
+            waitid(P_PIDFD, pipelines[i].pidfd, &info, WEXITED);
+            if (info.si_code != CLD_EXITED || info.si_status != 0) result = 1;
+
+            close(pipelines[i].pidfd);
+            pipelines[i].pidfd = -1;
+            pipelines[i].pid = 0;
+        }
+
+        if (fds[0].revents & POLLIN && reload_pending(reload)) {
+            Pipeline * updated = reload_forked(reload, pipelines);
+            if (updated != pipelines) {
+                pipelines = updated;
+                metrics_pid = restart_metrics(metrics_fd, pipelines, metrics_pid);
+            }
+        }
+
+        FREE(fds);
+    }
+
+    if (metrics_pid > 0) {
+        kill(metrics_pid, SIGTERM);
+        waitpid(metrics_pid, NULL, 0);
+    }
+    if (signal_fd >= 0) close(signal_fd);
+    return result;
+}
@@ -0,0 +1,48 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include "pipelines.h"
+#include "arena.h"
+
+// Watches the Pipefile so edits are applied without a restart. The directory
+// holding it is watched rather than the file itself, since most editors save
+// by writing a new file and renaming it over the old one.
+typedef struct {
+    char const * path;
+    char const * name;      // The Pipefile's name within its directory
+    int notify_fd;          // -1 if the Pipefile isn't being watched
+    Arena * config;         // Holds the live pipelines' configuration
+} Reload;
+
+// How a pipeline's configuration differs between two versions of the Pipefile.
+typedef enum {
+    RELOAD_UNCHANGED = 0,
+    RELOAD_CHANGED = 1,         // Runs differently, but watches the same files
+    RELOAD_CHANGED_WATCH = 2    // Its watches have to be rebuilt
+} ReloadChange;
+
+int reload_open(Reload * reload, char const * path, Arena * config);
+
+// Drains the watch. Returns 1 if the Pipefile was written or replaced.
+int reload_pending(Reload * reload);
+
+// Parses the Pipefile into next. Returns NULL, leaving the live configuration
+// in place, if it doesn't parse.
+Pipeline * reload_parse(Reload * reload, Arena * next);
+
+// Releases the previous configuration once the pipelines parsed into next
+// have taken over from it.
+void reload_commit(Reload * reload, Arena * next);
+
+// Returns the index of the pipeline with this name, or -1.
+int reload_find(Pipeline * pipelines, char const * name);
+
+ReloadChange reload_diff(Pipeline const * old, Pipeline const * new);
+
+// Supervises the monitor processes of the fork engine until they've all
+// exited, serving metrics from a process of its own if metrics_fd is open.
+// Edits to the Pipefile restart the monitors of changed pipelines, stop those
+// of removed ones and start new ones; the rest carry on untouched.
+int reload_supervise(Reload * reload, Pipeline * pipelines, int metrics_fd);
+
+#endif // RELOAD_H
@@ -0,0 +1,365 @@
+#include "replay.h"
+#include "reload.h"
+#include "watch.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define REPLAY_MAGIC "PLTRACE1"
+#define REPLAY_MAGIC_LEN 8
+
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+
+// The longest record: a type byte, three varints and a path with its length.
+#define REPLAY_RECORD_MAX (1 + 3 * 10 + 10 + PATH_MAX)
+
+static struct {
+    int fd;
+    uint64_t last_ns;
+    NameIndex names;    // Pipeline numbers in the trace
+    int used;
+    uint8_t buf[REPLAY_BUFFER_SIZE];
+} recorder = { .fd = -1 };
+
+static void record_flush() {
+    if (recorder.used > 0) write_all(recorder.fd, recorder.buf, recorder.used);
+    recorder.used = 0;
+}
+
+static void record_varint(uint64_t value) {
+    while (value >= 0x80) {
+        recorder.buf[recorder.used++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    recorder.buf[recorder.used++] = (uint8_t) value;
+}
+
+static void record_bytes(char const * data, int len) {
+    record_varint(len);
+    memcpy(recorder.buf + recorder.used, data, len);
+    recorder.used += len;
+}
+
+static void record_header(int type, int id) {
+
+    if (recorder.used + REPLAY_RECORD_MAX > REPLAY_BUFFER_SIZE) record_flush();
+
+    uint64_t now = now_ns();
+    recorder.buf[recorder.used++] = type;
+    record_varint(now - recorder.last_ns);
+    record_varint(id);
+    recorder.last_ns = now;
+}
+
+// Returns the pipeline's number in the trace, naming it the first time.
+static int record_id(Pipeline * pipeline) {
+
+    int added;
+    int id = name_index_find(&recorder.names, pipeline->name, &added);
+    if (added) {
+        record_header(REPLAY_NAME, id);
+        record_bytes(pipeline->name, strlen(pipeline->name));
+    }
+    return id;
+}
+
+int replay_record_open(char const * path) {
+
+    recorder.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (recorder.fd < 0) return -1;
+
+    memcpy(recorder.buf, REPLAY_MAGIC, REPLAY_MAGIC_LEN);
+    recorder.used = REPLAY_MAGIC_LEN;
+    recorder.last_ns = now_ns();
+    return 0;
+}
+
+void replay_record_change(Pipeline * pipeline, char const * path) {
+
+    if (recorder.fd < 0) return;
+
+    int len = strlen(path);
+    int id = record_id(pipeline);
+    if (id < 0 || len >= PATH_MAX) return;
+
+    record_header(REPLAY_CHANGE, id);
+    record_bytes(path, len);
+}
+
+void replay_record_drain(Pipeline * pipeline, int count, int received, int filtered) {
+
+    if (recorder.fd < 0) return;
+
+    int id = record_id(pipeline);
+    if (id < 0) return;
+
+    record_header(REPLAY_DRAIN | (pipeline->changes.incomplete ? REPLAY_INCOMPLETE : 0), id);
+    record_varint(count);
+    record_varint(received);
+    record_varint(filtered);
+
+    // One write per wakeup, so a trace survives pipelines being killed:
+    record_flush();
+}
+
+void replay_record_close() {
+
+    if (recorder.fd < 0) return;
+
+    record_flush();
+    close(recorder.fd);
+    recorder.fd = -1;
+
+    name_index_free(&recorder.names);
+}
+
+struct Replay {
+    uint8_t * data;
+    size_t size;
+    size_t pos;         // Start of the next record's body
+    int speed;
+
+    // The next record, whose type and delay have been read already:
+    int type;
+    int id;
+    uint64_t due_ns;    // Trace time it's due at
+    int done;
+
+    uint64_t origin_ns; // now_ns() at trace time 0
+    uint64_t wake_ns;   // See replay_wait()
+    uint64_t start_real_ns;
+
+    int * pipelines;    // Trace number -> index in the pipelines, or -1
+    int pipeline_count;
+    uint64_t records;
+    uint64_t skipped;   // Records for pipelines that aren't in the Pipefile
+};
+
+static int replay_varint(Replay * replay, uint64_t * value) {
+
+    *value = 0;
+    for (int shift = 0; shift < 64 && replay->pos < replay->size; shift += 7) {
+        uint8_t byte = replay->data[replay->pos++];
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return 0;
+    }
+    return -1;
+}
+
+// Reads a length-prefixed string into buf, which holds PATH_MAX bytes.
+static int replay_bytes(Replay * replay, char * buf) {
+
+    uint64_t len;
+    if (replay_varint(replay, &len) < 0 || len >= PATH_MAX || replay->size - replay->pos < len) return -1;
+    memcpy(buf, replay->data + replay->pos, len);
+    buf[len] = '\0';
+    replay->pos += len;
+    return 0;
+}
+
+// Reads the type, delay and pipeline number of the next record.
+static void replay_peek(Replay * replay) {
+
+    if (replay->pos >= replay->size) {
+        replay->done = 1;
+        return;
+    }
+
+    uint64_t delay, id;
+    replay->type = replay->data[replay->pos++];
+    if (replay_varint(replay, &delay) < 0 || replay_varint(replay, &id) < 0 || id > INT_MAX) {
+        printf(">> Trace is truncated at byte %zu\n", replay->pos);
+        replay->done = 1;
+        return;
+    }
+    replay->due_ns += delay;
+    replay->id = id;
+}
+
+Replay * replay_open(char const * path, int speed) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return NULL;
+
+    struct stat st;
+    void * map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size >= REPLAY_MAGIC_LEN) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    Replay * replay = ALLOC(sizeof(Replay));
+    if (replay == NULL || memcmp(map, REPLAY_MAGIC, REPLAY_MAGIC_LEN) != 0) {
+        FREE(replay);
+        munmap(map, st.st_size);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    memset(replay, 0, sizeof(Replay));
+    replay->data = map;
+    replay->size = st.st_size;
+    replay->pos = REPLAY_MAGIC_LEN;
+    replay->speed = speed;
+    replay_peek(replay);
+    return replay;
+}
+
+void replay_begin(Replay * replay, Pipeline * pipelines) {
+
+    for (Pipeline * pipeline = pipelines; pipeline->valid; ++pipeline) {
+        pipeline->hash_changes = 0;
+        pipeline->action_cache = 0;
+        pipeline->outputs = NULL;
+    }
+
+    clock_warp(replay->speed);
+    replay->origin_ns = now_ns();
+    replay->start_real_ns = real_now_ns();
+}
+
+// Records which pipeline a trace number stands for.
+static int replay_name(Replay * replay, Pipeline * pipelines, char const * name) {
+
+    if (replay->id >= replay->pipeline_count) {
+
+        int count = replay->id + 16;
+        int * map = ALLOC(sizeof(int) * count);
+        if (map == NULL) return -1;
+
+        memset(map, 0xff, sizeof(int) * count);
+        if (replay->pipelines != NULL) {
+            memcpy(map, replay->pipelines, sizeof(int) * replay->pipeline_count);
+            FREE(replay->pipelines);
+        }
+        replay->pipelines = map;
+        replay->pipeline_count = count;
+    }
+
+    replay->pipelines[replay->id] = reload_find(pipelines, name);
+    return 0;
+}
+
+int replay_feed(Replay * replay, Pipeline * pipelines) {
+
+    int delivered = 0;
+    char path[PATH_MAX];
+    uint64_t now = now_ns();
+
+    while (!replay->done && replay->origin_ns + replay->due_ns <= now) {
+
+        int index = replay->id < replay->pipeline_count ? replay->pipelines[replay->id] : -1;
+        Pipeline * pipeline = index >= 0 ? &pipelines[index] : NULL;
+        int malformed = 0;
+
+        switch (replay->type & ~REPLAY_INCOMPLETE) {
+
+            case REPLAY_NAME: {
+                malformed = replay_bytes(replay, path) < 0 || replay_name(replay, pipelines, path) < 0;
+                break;
+            }
+
+            case REPLAY_CHANGE: {
+                malformed = replay_bytes(replay, path) < 0;
+                if (!malformed && pipeline != NULL) changeset_add(&pipeline->changes, path);
+                break;
+            }
+
+            case REPLAY_DRAIN: {
+                uint64_t count, received, filtered;
+                malformed = replay_varint(replay, &count) < 0 || replay_varint(replay, &received) < 0 ||
+                            replay_varint(replay, &filtered) < 0;
+                if (malformed || pipeline == NULL) break;
+
+                if (replay->type & REPLAY_INCOMPLETE) pipeline->changes.incomplete = 1;
+                watch_drained(pipeline, count, received, filtered);
+                break;
+            }
+
+            default: malformed = 1;
+        }
+
+        if (malformed) {
+            printf(">> Trace is malformed at byte %zu\n", replay->pos);
+            replay->done = 1;
+            break;
+        }
+
+        replay->skipped += pipeline == NULL && replay->type != REPLAY_NAME;
+        ++replay->records;
+        ++delivered;
+        replay_peek(replay);
+    }
+
+    return delivered;
+}
+
+int replay_wait(Replay * replay, int timeout_ms) {
+
+    uint64_t now = now_ns();
+    uint64_t wake = replay->done ? UINT64_MAX : replay->origin_ns + replay->due_ns;
+    if (timeout_ms >= 0 && now + (uint64_t) timeout_ms * 1000000 < wake) {
+        wake = now + (uint64_t) timeout_ms * 1000000;
+    }
+
+    replay->wake_ns = wake;
+    if (wake == UINT64_MAX) return -1;
+    if (replay->speed == 0 || wake <= now) return 0;
+
+    // Round up so the wait never ends just short of it:
+    return ((wake - now) / replay->speed + 999999) / 1000000;
+}
+
+void replay_waited(Replay * replay) {
+    if (replay->wake_ns != UINT64_MAX) clock_advance(replay->wake_ns);
+}
+
+int replay_done(Replay * replay) {
+    return replay->done;
+}
+
+void replay_run(Replay * replay, Pipeline * pipeline) {
+
+    uint64_t now = now_ns();
+    double at = (now - replay->origin_ns) / 1e9;
+    if (pipeline->changes.incomplete) {
+        printf(">> %.6f Pipeline %s: run with every path changed\n", at, pipeline->name);
+    } else {
+        int count = pipeline->changes.count;
+        printf(">> %.6f Pipeline %s: run with %d change%s\n", at, pipeline->name, count, count == 1 ? "" : "s");
+    }
+
+    changeset_clear(&pipeline->changes);
+    pipeline->run_start_ns = now;
+    METRIC_ADD(pipeline->metrics, runs_started, 1);
+    metrics_run_finished(pipeline, 1, 0);
+}
+
+void replay_close(Replay * replay, Pipeline * pipelines) {
+
+    double traced = (now_ns() - replay->origin_ns) / 1e9;
+    double took = (real_now_ns() - replay->start_real_ns) / 1e9;
+    printf(">> Replayed %llu records covering %.3f s in %.3f s", (unsigned long long) replay->records, traced, took);
+    if (took > 0) printf(" (%.0fx)", traced / took);
+    if (replay->skipped > 0) printf(", %llu for pipelines not in the Pipefile", (unsigned long long) replay->skipped);
+    printf("\n");
+
+    for (Pipeline * pipeline = pipelines; pipeline->valid; ++pipeline) {
+
+        PipelineMetrics * metrics = pipeline->metrics;
+        MetricsHistogram * wait = &metrics->queue_wait;
+        printf(">> Pipeline %s: %llu runs, %llu changes (%llu coalesced), mean queue wait %.3f ms\n",
+               pipeline->name, (unsigned long long) metrics->runs_started, (unsigned long long) metrics->changes,
+               (unsigned long long) metrics->changes_coalesced, wait->count ? wait->sum_ns / 1e6 / wait->count : 0);
+    }
+
+    munmap(replay->data, replay->size);
+    FREE(replay->pipelines);
+    FREE(replay);
+}
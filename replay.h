@@ -0,0 +1,71 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "pipelines.h"
+
+// Event traces, for reproducing scheduling problems offline. Recording (-r)
+// logs every change the watches decode, and the end of every batch of them,
+// with monotonic timestamps. Replaying (-R) feeds a trace into the epoll
+// engine's scheduler in place of the watches. The clock runs at real time, a
+// multiple of it, or jumps straight from one event or deadline to the next.
+// Commands are stubbed out and finish as soon as they start, so a replay
+// exercises debouncing, coalescing and dependency ordering without touching
+// the filesystem, and a frozen-clock replay prints the same runs every time.
+//
+// A trace starts with the 8 bytes "PLTRACE1". Each record is a type byte,
+// then the nanoseconds since the previous record and the number of the
+// pipeline it concerns as LEB128 varints, then:
+//   REPLAY_NAME    Length and bytes of the name that number stands for
+//   REPLAY_CHANGE  Length and bytes of a path that changed
+//   REPLAY_DRAIN   Relevant changes, events received and events filtered
+typedef enum {
+    REPLAY_NAME = 0,
+    REPLAY_CHANGE = 1,
+    REPLAY_DRAIN = 2
+} ReplayRecord;
+
+// Set on a REPLAY_DRAIN record when the pipeline's change list is incomplete:
+#define REPLAY_INCOMPLETE 0x80
+
+// Starts recording to path, replacing anything there. Returns -1 on error.
+int replay_record_open(char const * path);
+
+// Called as each relevant change is added to a pipeline's change set, and
+// once a batch of events has been handed to it. Both do nothing unless
+// recording.
+void replay_record_change(Pipeline * pipeline, char const * path);
+void replay_record_drain(Pipeline * pipeline, int count, int received, int filtered);
+
+void replay_record_close();
+
+typedef struct Replay Replay;
+
+// Loads a trace to replay at speed times real time, or as fast as possible
+// with a speed of 0. Returns NULL on error.
+Replay * replay_open(char const * path, int speed);
+
+// Starts the clock. Caches, hashing and output stamps all depend on the
+// filesystem, so they're turned off for the pipelines being replayed into.
+void replay_begin(Replay * replay, Pipeline * pipelines);
+
+// Delivers every record that's due. Returns the number delivered.
+int replay_feed(Replay * replay, Pipeline * pipelines);
+
+// Works out how long to wait for the next record, given the scheduler's own
+// timeout. Returns the real timeout in milliseconds (-1 for none).
+int replay_wait(Replay * replay, int timeout_ms);
+
+// Called when that wait ended with nothing else to do. A frozen clock is
+// moved on to the time it was waiting for.
+void replay_waited(Replay * replay);
+
+// True once every record has been delivered.
+int replay_done(Replay * replay);
+
+// Stands in for running the pipeline's command.
+void replay_run(Replay * replay, Pipeline * pipeline);
+
+// Prints a summary for each pipeline and frees the trace.
+void replay_close(Replay * replay, Pipeline * pipelines);
+
+#endif // REPLAY_H
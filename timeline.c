@@ -0,0 +1,290 @@
+#include "timeline.h"
+
+#include <fcntl.h>
+
+// A power of two, so positions wrap with a mask. 32 bytes each:
+#define TIMELINE_CAPACITY (64 * 1024)
+
+typedef enum {
+    TIMELINE_CHANGES = 0,   // value: relevant changes
+    TIMELINE_QUEUED = 1,    // From the first change to the run starting. value: the upstream
+                            // thread that queued it, or -1 for changes
+    TIMELINE_CACHED = 2,
+    TIMELINE_SPAWN = 3,
+    TIMELINE_RUN = 4        // value: exit status, or -1 if it was killed
+} TimelineKind;
+
+typedef struct {
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t mark_ns;       // TIMELINE_QUEUED: when that upstream run started, or when it was due
+    int32_t value;
+    uint16_t thread;
+    uint8_t kind;
+} TimelineRecord;
+
+// Kept for each pipeline by name, as their indices change when the Pipefile
+// is reloaded:
+typedef struct {
+    int cause;              // Thread of the upstream whose run queued the next run, or -1
+    uint64_t cause_ns;      // When that upstream run started
+    uint64_t run_ns;        // When the running command was started
+} TimelineThread;
+
+static struct {
+    char * path;
+    TimelineRecord * records;
+    uint64_t head;          // Records written so far; the ring holds the last TIMELINE_CAPACITY
+    NameIndex threads;      // Of TimelineThread
+} timeline = { .threads.item_size = sizeof(TimelineThread) };
+
+int timeline_open(char const * path) {
+
+    timeline.path = copy_str(path);
+    timeline.records = ALLOC(sizeof(TimelineRecord) * TIMELINE_CAPACITY);
+    if (timeline.path == NULL || timeline.records == NULL) {
+        FREE(timeline.path);
+        FREE(timeline.records);
+        timeline.path = NULL;
+        timeline.records = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int timeline_enabled() {
+    return timeline.records != NULL;
+}
+
+static TimelineThread * timeline_state(int thread) {
+    return name_index_item(&timeline.threads, thread);
+}
+
+// Returns the pipeline's thread, adding it the first time it's seen.
+static int timeline_thread(Pipeline * pipeline) {
+
+    int added;
+    int id = name_index_find(&timeline.threads, pipeline->name, &added);
+    if (added) timeline_state(id)->cause = -1;
+    return id;
+}
+
+static void timeline_add(int thread, TimelineKind kind, uint64_t start, uint64_t end, uint64_t mark, int value) {
+    timeline.records[timeline.head++ & (TIMELINE_CAPACITY - 1)] = (TimelineRecord) {
+        .start_ns = start, .end_ns = end, .mark_ns = mark, .value = value, .thread = thread, .kind = kind
+    };
+}
+
+void timeline_changes(Pipeline * pipeline, int count) {
+
+    if (timeline.records == NULL) return;
+
+    int thread = timeline_thread(pipeline);
+    if (thread < 0) return;
+
+    uint64_t now = now_ns();
+    timeline_add(thread, TIMELINE_CHANGES, now, now, 0, count);
+}
+
+void timeline_triggered(Pipeline * downstream, Pipeline * upstream) {
+
+    if (timeline.records == NULL) return;
+
+    int up = timeline_thread(upstream);
+    int down = timeline_thread(downstream);
+    if (up < 0 || down < 0) return;
+
+    timeline_state(down)->cause = up;
+    timeline_state(down)->cause_ns = timeline_state(up)->run_ns;
+}
+
+void timeline_queued(Pipeline * pipeline) {
+
+    if (timeline.records == NULL || !pipeline->dirty) return;
+
+    int thread = timeline_thread(pipeline);
+    if (thread < 0) return;
+
+    TimelineThread * t = timeline_state(thread);
+    uint64_t now = now_ns();
+    uint64_t due = pipeline_due_ns(pipeline);
+    if (due > now) due = now;
+
+    // The upstream run's start goes in the due time's place. The due time is
+    // then only worth keeping when it came after the first change:
+    if (t->cause >= 0) {
+        timeline_add(thread, TIMELINE_QUEUED, pipeline->first_change_ns, now, t->cause_ns, t->cause);
+    } else {
+        timeline_add(thread, TIMELINE_QUEUED, pipeline->first_change_ns, now, due, -1);
+    }
+    t->cause = -1;
+}
+
+void timeline_cached(Pipeline * pipeline) {
+
+    if (timeline.records == NULL) return;
+
+    int thread = timeline_thread(pipeline);
+    if (thread < 0) return;
+
+    uint64_t now = now_ns();
+    timeline_add(thread, TIMELINE_CACHED, now, now, 0, 0);
+}
+
+void timeline_spawned(Pipeline * pipeline, uint64_t start_ns) {
+
+    if (timeline.records == NULL) return;
+
+    int thread = timeline_thread(pipeline);
+    if (thread < 0) return;
+
+    uint64_t now = now_ns();
+    timeline_add(thread, TIMELINE_SPAWN, start_ns, now, 0, 0);
+    timeline_state(thread)->run_ns = now;
+}
+
+void timeline_exited(Pipeline * pipeline, int exited, int code) {
+
+    if (timeline.records == NULL) return;
+
+    int thread = timeline_thread(pipeline);
+    if (thread < 0) return;
+
+    timeline_add(thread, TIMELINE_RUN, timeline_state(thread)->run_ns, now_ns(), 0, exited ? code : -1);
+}
+
+// Pipeline names are YAML keys, so anything could be in them:
+static void timeline_print_string(FILE * f, char const * s) {
+
+    fputc('"', f);
+    for (; *s; ++s) {
+        if (*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+        else if ((unsigned char) *s < 0x20) fprintf(f, "\\u%04x", *s);
+        else fputc(*s, f);
+    }
+    fputc('"', f);
+}
+
+// Trace timestamps are in microseconds:
+static double timeline_us(uint64_t ns) {
+    return ns / 1000.0;
+}
+
+static void timeline_print_span(FILE * f, char const * name, int thread, uint64_t start, uint64_t end) {
+    fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f", name, thread + 1,
+            timeline_us(start), timeline_us(end - start));
+}
+
+static void timeline_print_record(FILE * f, TimelineRecord const * record, uint64_t id) {
+
+    int thread = record->thread;
+
+    switch ((TimelineKind) record->kind) {
+
+        case TIMELINE_CHANGES: {
+            fprintf(f, ",\n{\"name\":\"changes\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,"
+                    "\"args\":{\"count\":%d}}", thread + 1, timeline_us(record->start_ns), record->value);
+            break;
+        }
+
+        case TIMELINE_QUEUED: {
+            timeline_print_span(f, "queued", thread, record->start_ns, record->end_ns);
+            fprintf(f, "}");
+
+            // Split into the wait for changes to settle, and for upstreams to
+            // finish or a job slot to come free after that:
+            if (record->value < 0) {
+                if (record->mark_ns > record->start_ns) {
+                    timeline_print_span(f, "debounce", thread, record->start_ns, record->mark_ns);
+                    fprintf(f, "}");
+                }
+                if (record->end_ns > record->mark_ns) {
+                    timeline_print_span(f, "waiting", thread, record->mark_ns, record->end_ns);
+                    fprintf(f, "}");
+                }
+            }
+
+            // The arrow starts at the change, or inside the upstream run, and
+            // ends at whatever comes next on this thread (the spawn):
+            int from = record->value < 0 ? thread : record->value;
+            uint64_t from_ns = record->value < 0 ? record->start_ns : record->mark_ns + 1;
+            fprintf(f, ",\n{\"name\":\"trigger\",\"cat\":\"trigger\",\"ph\":\"s\",\"id\":%llu,\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f}", (unsigned long long) id, from + 1, timeline_us(from_ns));
+            fprintf(f, ",\n{\"name\":\"trigger\",\"cat\":\"trigger\",\"ph\":\"f\",\"id\":%llu,\"pid\":1,\"tid\":%d,"
+                    "\"ts\":%.3f}", (unsigned long long) id, thread + 1, timeline_us(record->end_ns));
+            break;
+        }
+
+        case TIMELINE_CACHED: {
+            timeline_print_span(f, "restored from cache", thread, record->start_ns, record->end_ns);
+            fprintf(f, "}");
+            break;
+        }
+
+        case TIMELINE_SPAWN: {
+            timeline_print_span(f, "spawn", thread, record->start_ns, record->end_ns);
+            fprintf(f, "}");
+            break;
+        }
+
+        case TIMELINE_RUN: {
+            timeline_print_span(f, "run", thread, record->start_ns, record->end_ns);
+            if (record->value < 0) fprintf(f, ",\"args\":{\"killed\":true}}");
+            else fprintf(f, ",\"args\":{\"status\":%d}}", record->value);
+            break;
+        }
+    }
+}
+
+void timeline_dump() {
+
+    if (timeline.records == NULL) return;
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", timeline.path) >= (int) sizeof(tmp_path)) return;
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    FILE * f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (f == NULL) {
+        if (fd >= 0) close(fd);
+        printf(">> Unable to write the timeline to %s: %s\n", timeline.path, strerror(errno));
+        return;
+    }
+
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"pipelines\"}}");
+    for (int i = 0; i < timeline.threads.count; ++i) {
+        fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", i + 1);
+        timeline_print_string(f, timeline.threads.names[i]);
+        fprintf(f, "}}");
+    }
+
+    uint64_t first = timeline.head > TIMELINE_CAPACITY ? timeline.head - TIMELINE_CAPACITY : 0;
+    for (uint64_t i = first; i < timeline.head; ++i) {
+        timeline_print_record(f, &timeline.records[i & (TIMELINE_CAPACITY - 1)], i);
+    }
+    fprintf(f, "\n]}\n");
+
+    int ok = fflush(f) == 0 && !ferror(f);
+    fclose(f);
+
+    if (!ok || rename(tmp_path, timeline.path) < 0) {
+        printf(">> Unable to write the timeline to %s: %s\n", timeline.path, strerror(errno));
+        unlink(tmp_path);
+        return;
+    }
+    printf(">> Wrote %llu timeline records to %s\n", (unsigned long long) (timeline.head - first), timeline.path);
+}
+
+void timeline_close() {
+
+    if (timeline.records == NULL) return;
+
+    timeline_dump();
+
+    name_index_free(&timeline.threads);
+    FREE(timeline.records);
+    FREE(timeline.path);
+    memset(&timeline, 0, sizeof(timeline));
+    timeline.threads.item_size = sizeof(TimelineThread);
+}
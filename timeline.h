@@ -0,0 +1,46 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include "pipelines.h"
+
+// A timeline of recent runs, for finding where the time between saving a file
+// and its run finishing went. Each run is broken into the time spent
+// debouncing, waiting on upstreams or a job slot, spawning and running, with
+// an arrow from the change or upstream run that queued it. Records go into a
+// fixed ring in memory and only the most recent are kept, so it can stay on.
+// timeline_dump() writes them out in the Chrome trace event format, which
+// Perfetto (ui.perfetto.dev) and chrome://tracing open.
+//
+// Every function does nothing unless timeline_open() was called.
+
+// Starts keeping a timeline, to be written to path. Returns -1 on error.
+int timeline_open(char const * path);
+
+int timeline_enabled();
+
+// Relevant changes were recorded for the pipeline.
+void timeline_changes(Pipeline * pipeline, int count);
+
+// A run of upstream is about to mark downstream dirty. Only called when
+// downstream isn't dirty already, as that's what queues its run.
+void timeline_triggered(Pipeline * downstream, Pipeline * upstream);
+
+// The pipeline's run is starting. Called before pipeline_clear_dirty().
+void timeline_queued(Pipeline * pipeline);
+
+// Its outputs were restored from the action cache instead.
+void timeline_cached(Pipeline * pipeline);
+
+// Its command was started, which began at start_ns.
+void timeline_spawned(Pipeline * pipeline, uint64_t start_ns);
+
+// Its command finished, as for metrics_run_finished().
+void timeline_exited(Pipeline * pipeline, int exited, int code);
+
+// Writes the timeline to its path, replacing the last one written.
+void timeline_dump();
+
+// Writes the timeline a last time and frees it.
+void timeline_close();
+
+#endif // TIMELINE_H
@@ -1,8 +1,16 @@
 #include "util.h"
 #include "ctx.h"
+#include "arena.h"
 
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static char state_dir[PATH_MAX];
 
 int count_in_str(char const * str, char c);
 void split_str(char ** dest, char * src, char c);
@@ -17,6 +25,126 @@ char * copy_str(char const * str) {
     return result;
 }
 
+char * join_path(char const * dir, char const * path) {
+
+    // Absolute paths (or no directory at all) are used as-is:
+    if (dir == NULL || path[0] == '/') return copy_str(path);
+
+    // Drop leading "./" components so joined paths stay tidy:
+    while (path[0] == '.' && path[1] == '/') {
+        path += 2;
+        while (*path == '/') ++path;
+    }
+    if (path[0] == '\0' || strcmp(path, ".") == 0) return copy_str(dir);
+
+    size_t dir_len = strlen(dir);
+    while (dir_len > 1 && dir[dir_len - 1] == '/') --dir_len;
+    size_t path_len = strlen(path);
+    char * result = ALLOC(dir_len + path_len + 2);
+    if (result == NULL) return NULL;
+
+    memcpy(result, dir, dir_len);
+    result[dir_len] = '/';
+    memcpy(result + dir_len + 1, path, path_len);
+    result[dir_len + path_len + 1] = '\0';
+
+    return result;
+}
+
+char * scratch_join_path(char const * dir, char const * path) {
+
+    Ctx saved = scratch_begin();
+    char * result = join_path(dir, path);
+    ctx_restore(saved);
+    return result;
+}
+
+int str_list_append(char *** list, char const * str) {
+
+    // Lists are NULL-terminated and short, so they're sized exactly:
+    int count = 0;
+    while (*list && (*list)[count]) ++count;
+
+    char ** new_list = ALLOC(sizeof(char *) * (count + 2));
+    if (new_list == NULL) return -1;
+
+    new_list[count] = copy_str(str);
+    if (new_list[count] == NULL) {
+        FREE(new_list);
+        return -1;
+    }
+    new_list[count + 1] = NULL;
+
+    if (*list != NULL) {
+        memcpy(new_list, *list, sizeof(char *) * count);
+        FREE(*list);
+    }
+    *list = new_list;
+    return 0;
+}
+
+int name_index_find(NameIndex * index, char const * name, int * added) {
+
+    *added = 0;
+
+    int id = index->last;
+    if (id < index->count && strcmp(index->names[id], name) == 0) return id;
+
+    for (id = 0; id < index->count; ++id) {
+        if (strcmp(index->names[id], name) == 0) break;
+    }
+
+    if (id == index->count) {
+
+        if (index->count == index->capacity) {
+
+            int capacity = index->capacity ? index->capacity * 2 : 16;
+            char ** names = ALLOC(sizeof(char *) * capacity);
+            void * items = index->item_size > 0 ? ALLOC((size_t) index->item_size * capacity) : NULL;
+            if (names == NULL || (index->item_size > 0 && items == NULL)) {
+                FREE(names);
+                FREE(items);
+                return -1;
+            }
+
+            if (index->names != NULL) {
+                memcpy(names, index->names, sizeof(char *) * index->count);
+                if (items != NULL) memcpy(items, index->items, (size_t) index->item_size * index->count);
+                FREE(index->names);
+                FREE(index->items);
+            }
+            index->names = names;
+            index->items = items;
+            index->capacity = capacity;
+        }
+
+        char * copy = copy_str(name);
+        if (copy == NULL) return -1;
+
+        index->names[index->count++] = copy;
+        if (index->item_size > 0) memset(name_index_item(index, id), 0, index->item_size);
+        *added = 1;
+    }
+
+    index->last = id;
+    return id;
+}
+
+void * name_index_item(NameIndex * index, int id) {
+    return (char *) index->items + (size_t) index->item_size * id;
+}
+
+void name_index_free(NameIndex * index) {
+
+    for (int i = 0; i < index->count; ++i) FREE(index->names[i]);
+    FREE(index->names);
+    FREE(index->items);
+
+    int item_size = index->item_size;
+    memset(index, 0, sizeof(*index));
+    index->item_size = item_size;
+}
+
 char * read_entire_file(char const * path) {
 
     FILE * f = fopen(path, "r");
@@ -39,8 +167,71 @@ char * read_entire_file(char const * path) {
     return content;
 }
 
+int write_all(int fd, void const * data, size_t len) {
+
+    char const * p = data;
+    while (len > 0) {
+        ssize_t w = write(fd, p, len);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += w;
+        len -= w;
+    }
+    return 0;
+}
+
+int state_dir_init() {
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) return -1;
+    if (snprintf(state_dir, sizeof(state_dir), "%s/.pipelines", cwd) >= (int) sizeof(state_dir)) return -1;
+    return 0;
+}
+
+char * state_path(char const * name, char const * suffix) {
+
+    if (state_dir[0] == '\0') return NULL;
+    if (mkdir(state_dir, 0755) < 0 && errno != EEXIST) return NULL;
+
+    size_t len = strlen(state_dir) + strlen(name) + strlen(suffix) + 2;
+    char * path = ALLOC(len);
+    if (path == NULL) return NULL;
+
+    snprintf(path, len, "%s/%s%s", state_dir, name, suffix);
+    return path;
+}
+
 void print_repeated(char const * str, int count) {
     for (int i = 0; i < count; ++i) {
         printf("%s", str);
     }
-}
\ No newline at end of file
+}
+
+// See clock_warp(). A speed of 1 is the real clock.
+static int clock_speed = 1;
+static uint64_t clock_origin;
+static uint64_t clock_origin_real;
+
+uint64_t real_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+uint64_t now_ns() {
+    if (clock_speed == 1) return real_now_ns();
+    if (clock_speed == 0) return clock_origin;
+    return clock_origin + (real_now_ns() - clock_origin_real) * clock_speed;
+}
+
+void clock_warp(int speed) {
+    clock_origin = now_ns();
+    clock_origin_real = real_now_ns();
+    clock_speed = speed;
+}
+
+void clock_advance(uint64_t ns) {
+    if (clock_speed == 0 && ns > clock_origin) clock_origin = ns;
+}
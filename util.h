@@ -1,6 +1,9 @@
 #ifndef UTIL_H
 #define UTIL_H
 
+#include <stdint.h>
+#include <stddef.h>
+
 inline int count_in_str(char const * str, char c) {
     int result = 0;
     char const * c_ = str;
@@ -21,8 +24,57 @@ inline void split_str(char ** dest, char * src, char c) {
 
 char * copy_str(char const * str);
 
+char * join_path(char const * dir, char const * path);
+
+// join_path() into the scratch arena (see arena.h). Don't FREE the result.
+char * scratch_join_path(char const * dir, char const * path);
+
+int str_list_append(char *** list, char const * str);
+
 char * read_entire_file(char const * path);
 
+// Numbers names in the order they're first seen, for records that refer to
+// pipelines by number and have to outlast a Pipefile reload. Each name can
+// carry item_size bytes of data, zeroed when it's added. Zero-initialised
+// apart from item_size, and searched linearly, so for a few hundred names
+// at most.
+typedef struct {
+    char ** names;
+    void * items;
+    int item_size;
+    int count;
+    int capacity;
+    int last;           // Most lookups are for the same name as the one before
+} NameIndex;
+
+// Returns the name's number, adding it if it's new and setting *added to
+// say whether it was. Returns -1 if it couldn't be added.
+int name_index_find(NameIndex * index, char const * name, int * added);
+
+// The data kept for a number.
+void * name_index_item(NameIndex * index, int id);
+
+void name_index_free(NameIndex * index);
+
+int write_all(int fd, void const * data, size_t len);
+
+// Records the current directory as the home of pipelines' state directory
+// (".pipelines", next to the Pipefile). Call before anything changes directory.
+int state_dir_init();
+
+// Returns "<state dir>/<name><suffix>", creating the state directory if needed.
+char * state_path(char const * name, char const * suffix);
+
 void print_repeated(char const * str, int count);
 
+uint64_t now_ns();
+
+// Runs now_ns() at speed times real time from here on, or with a speed of 0
+// stops it until clock_advance() moves it on. For replays (see replay.h).
+void clock_warp(int speed);
+void clock_advance(uint64_t ns);
+
+// The monotonic clock, however now_ns() is running.
+uint64_t real_now_ns();
+
 #endif // UTIL_H
\ No newline at end of file
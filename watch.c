@@ -0,0 +1,1400 @@
+#include "watch.h"
+#include "fanotify.h"
+#include "arena.h"
+#include "hash.h"
+#include "replay.h"
+#include "timeline.h"
+
+#include <stdint.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+// Directories are watched for anything that changes their contents, plus
+// their own deletion so the index can drop them. Roots may be symlinks to the
+// directory they name; only the ones found by crawling are never followed.
+#define WATCH_ROOT_MASK (IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | \
+                         IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR)
+#define WATCH_DIR_MASK (WATCH_ROOT_MASK | IN_DONT_FOLLOW)
+#define WATCH_FILE_MASK (IN_CLOSE_WRITE)
+
+// Events are read in batches this large, so a burst of thousands of events is
+// drained in a handful of reads:
+#define WATCH_READ_SIZE (64 * 1024)
+
+// Events which cause the pipeline to run:
+#define WATCH_TRIGGER_MASK (IN_CLOSE_WRITE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)
+
+// Name slot sizes. Directory names fit the largest class (NAME_MAX + 1); only
+// roots, which hold a full path, can be bigger and go to the heap.
+#define WATCH_NAME_CLASSES 4
+static int const watch_name_sizes[WATCH_NAME_CLASSES] = { 32, 64, 128, NAME_MAX + 1 };
+
+// One watched directory. Roots store their full path in `name`, every other
+// node stores a single path component and links to its parent, so renaming a
+// directory is O(1) no matter how much is below it.
+typedef struct {
+    int wd;             // -1 if the node is free
+    int parent;         // -1 for a root
+    int first_child;
+    int next_sibling;
+    int prev_sibling;
+    int next_by_wd;     // Also threads the free list
+    int next_by_name;
+    uint32_t name_hash;
+    char * name;
+
+    // The next pipeline's node on the same kernel watch (see WatchSession):
+    struct WatchTree * share_tree;
+    int share_node;
+} WatchNode;
+
+// A kernel watch and the nodes subscribed to it, at most one per pipeline.
+// They're chained through WatchNode.share_tree and share_node.
+typedef struct {
+    int wd;             // -1 if the entry is free
+    int next;           // Next entry in the bucket, or on the free list
+    struct WatchTree * first_tree;
+    int first_node;
+} WatchShare;
+
+// An inotify descriptor and the kernel watches on it. Under the fork engine
+// every pipeline has one of its own. In a single process, every pipeline
+// using inotify shares one (see watch_share()): a directory watched by
+// several pipelines costs one kernel watch, and each event is read once and
+// handed to every pipeline subscribed to its wd with a single lookup.
+typedef struct {
+    int fd;
+    struct WatchTree * trees;   // Threaded through WatchTree.next_tree
+
+    WatchShare * entries;
+    int entry_count;
+    int entry_capacity;
+    int free_entry;
+    int live_entries;
+    int * buckets;
+    int bucket_count;   // Power of two
+
+    // Every event for changes made before this has been read (see watch_drain()):
+    struct timespec synced;
+} WatchSession;
+
+// The directory index for one pipeline. Both lookups used on the event path,
+// wd -> node and (parent, name) -> node, are hash tables, so resolving an
+// event never involves a scan of the tree.
+struct WatchTree {
+    WatchNode * nodes;
+    int node_count;
+    int node_capacity;
+    int free_node;
+    int live_nodes;
+
+    int * by_wd;
+    int * by_name;
+    int bucket_count;   // Power of two, shared by both tables
+
+    int * scan;
+    int scan_count;
+    int scan_capacity;
+
+    // Node names come from pools of fixed-size slots (see tree_name_alloc()):
+    Pool name_pools[WATCH_NAME_CLASSES];
+
+    // A directory moved out of a watched directory is held here until the
+    // matching IN_MOVED_TO (same cookie) shows where it went:
+    uint32_t move_cookie;
+    int move_node;
+
+    // Set when the fanotify backend is in use, in which case there are no
+    // nodes and no session:
+    FanotifyWatch * fanotify;
+
+    WatchSession * session;
+    struct WatchTree * next_tree;
+    Pipeline * pipeline;
+
+    // Counts for the events handed to this pipeline by the current drain:
+    int received;
+    int filtered;
+    int count;
+};
+
+PipelineWatchBackend watch_default_backend = PIPELINE_WATCH_INOTIFY;
+
+// The session every pipeline in this process joins, once watch_share() is called:
+static WatchSession * watch_shared;
+
+static uint32_t hash_wd(int wd) {
+    return (uint32_t) wd * 2654435761u;
+}
+
+static uint32_t hash_name(int parent, char const * name) {
+    uint32_t h = 2166136261u ^ (uint32_t) parent;
+    while (*name) {
+        h ^= (unsigned char) *name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static char * tree_name_alloc(WatchTree * tree, char const * name) {
+
+    int len = strlen(name);
+    for (int i = 0; i < WATCH_NAME_CLASSES; ++i) {
+        if (len < watch_name_sizes[i]) {
+            char * slot = pool_alloc(&tree->name_pools[i]);
+            if (slot != NULL) memcpy(slot, name, len + 1);
+            return slot;
+        }
+    }
+    return copy_str(name);
+}
+
+static void tree_name_release(WatchTree * tree, char * name) {
+
+    int len = strlen(name);
+    for (int i = 0; i < WATCH_NAME_CLASSES; ++i) {
+        if (len < watch_name_sizes[i]) {
+            pool_release(&tree->name_pools[i], name);
+            return;
+        }
+    }
+    FREE(name);
+}
+
+static void tree_link_buckets(WatchTree * tree, int node) {
+
+    WatchNode * n = &tree->nodes[node];
+    uint32_t mask = tree->bucket_count - 1;
+
+    int * slot = &tree->by_wd[hash_wd(n->wd) & mask];
+    n->next_by_wd = *slot;
+    *slot = node;
+
+    slot = &tree->by_name[n->name_hash & mask];
+    n->next_by_name = *slot;
+    *slot = node;
+}
+
+static int tree_grow_buckets(WatchTree * tree) {
+
+    int count = tree->bucket_count ? tree->bucket_count * 2 : 64;
+    int * by_wd = ALLOC(sizeof(int) * count);
+    int * by_name = ALLOC(sizeof(int) * count);
+    if (by_wd == NULL || by_name == NULL) {
+        FREE(by_wd);
+        FREE(by_name);
+        return -1;
+    }
+
+    memset(by_wd, 0xff, sizeof(int) * count);
+    memset(by_name, 0xff, sizeof(int) * count);
+    FREE(tree->by_wd);
+    FREE(tree->by_name);
+    tree->by_wd = by_wd;
+    tree->by_name = by_name;
+    tree->bucket_count = count;
+
+    for (int i = 0; i < tree->node_count; ++i) {
+        if (tree->nodes[i].wd >= 0) tree_link_buckets(tree, i);
+    }
+    return 0;
+}
+
+static int tree_find_wd(WatchTree * tree, int wd) {
+
+    if (tree->bucket_count == 0) return -1;
+
+    int node = tree->by_wd[hash_wd(wd) & (tree->bucket_count - 1)];
+    while (node >= 0 && tree->nodes[node].wd != wd) {
+        node = tree->nodes[node].next_by_wd;
+    }
+    return node;
+}
+
+static int tree_find_child(WatchTree * tree, int parent, char const * name) {
+
+    if (tree->bucket_count == 0) return -1;
+
+    uint32_t h = hash_name(parent, name);
+    int node = tree->by_name[h & (tree->bucket_count - 1)];
+    while (node >= 0) {
+        WatchNode * n = &tree->nodes[node];
+        if (n->name_hash == h && n->parent == parent && strcmp(n->name, name) == 0) break;
+        node = n->next_by_name;
+    }
+    return node;
+}
+
+static void tree_unlink_buckets(WatchTree * tree, int node) {
+
+    WatchNode * n = &tree->nodes[node];
+    uint32_t mask = tree->bucket_count - 1;
+
+    int * slot = &tree->by_wd[hash_wd(n->wd) & mask];
+    while (*slot != node) slot = &tree->nodes[*slot].next_by_wd;
+    *slot = n->next_by_wd;
+
+    slot = &tree->by_name[n->name_hash & mask];
+    while (*slot != node) slot = &tree->nodes[*slot].next_by_name;
+    *slot = n->next_by_name;
+}
+
+static void tree_attach(WatchTree * tree, int node, int parent, char * name) {
+
+    WatchNode * n = &tree->nodes[node];
+    n->parent = parent;
+    n->name = name;
+    n->name_hash = hash_name(parent, name);
+    n->prev_sibling = -1;
+    n->next_sibling = -1;
+
+    if (parent >= 0) {
+        WatchNode * p = &tree->nodes[parent];
+        n->next_sibling = p->first_child;
+        if (p->first_child >= 0) tree->nodes[p->first_child].prev_sibling = node;
+        p->first_child = node;
+    }
+
+    tree_link_buckets(tree, node);
+}
+
+static void tree_detach(WatchTree * tree, int node) {
+
+    tree_unlink_buckets(tree, node);
+
+    WatchNode * n = &tree->nodes[node];
+    if (n->prev_sibling >= 0) {
+        tree->nodes[n->prev_sibling].next_sibling = n->next_sibling;
+    } else if (n->parent >= 0) {
+        tree->nodes[n->parent].first_child = n->next_sibling;
+    }
+    if (n->next_sibling >= 0) {
+        tree->nodes[n->next_sibling].prev_sibling = n->prev_sibling;
+    }
+
+    tree_name_release(tree, n->name);
+    n->name = NULL;
+}
+
+static int tree_add(WatchTree * tree, int wd, int parent, char const * name) {
+
+    // Keep the tables no more than fully loaded:
+    if (tree->live_nodes >= tree->bucket_count && tree_grow_buckets(tree) < 0) {
+        return -1;
+    }
+
+    int node = tree->free_node;
+    if (node >= 0) {
+        tree->free_node = tree->nodes[node].next_by_wd;
+
+    } else {
+
+        if (tree->node_count == tree->node_capacity) {
+
+            int capacity = tree->node_capacity ? tree->node_capacity * 2 : 64;
+            WatchNode * nodes = ALLOC(sizeof(WatchNode) * capacity);
+            if (nodes == NULL) return -1;
+
+            if (tree->nodes != NULL) {
+                memcpy(nodes, tree->nodes, sizeof(WatchNode) * tree->node_count);
+                FREE(tree->nodes);
+            }
+            tree->nodes = nodes;
+            tree->node_capacity = capacity;
+        }
+        node = tree->node_count++;
+    }
+
+    char * name_copy = tree_name_alloc(tree, name);
+    if (name_copy == NULL) {
+        tree->nodes[node].wd = -1;
+        tree->nodes[node].next_by_wd = tree->free_node;
+        tree->free_node = node;
+        return -1;
+    }
+
+    tree->nodes[node].wd = wd;
+    tree->nodes[node].first_child = -1;
+    tree_attach(tree, node, parent, name_copy);
+    ++tree->live_nodes;
+    return node;
+}
+
+static void tree_release(WatchTree * tree, int node) {
+
+    tree_detach(tree, node);
+    tree->nodes[node].wd = -1;
+    tree->nodes[node].next_by_wd = tree->free_node;
+    tree->free_node = node;
+    --tree->live_nodes;
+}
+
+static int tree_push_scan(WatchTree * tree, int node) {
+
+    if (tree->scan_count == tree->scan_capacity) {
+
+        int capacity = tree->scan_capacity ? tree->scan_capacity * 2 : 64;
+        int * scan = ALLOC(sizeof(int) * capacity);
+        if (scan == NULL) return -1;
+
+        if (tree->scan != NULL) {
+            memcpy(scan, tree->scan, sizeof(int) * tree->scan_count);
+            FREE(tree->scan);
+        }
+        tree->scan = scan;
+        tree->scan_capacity = capacity;
+    }
+
+    tree->scan[tree->scan_count++] = node;
+    return 0;
+}
+
+static WatchSession * session_open() {
+
+    WatchSession * session = ALLOC(sizeof(WatchSession));
+    if (session == NULL) return NULL;
+    memset(session, 0, sizeof(WatchSession));
+    session->free_entry = -1;
+
+    session->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (session->fd < 0) {
+        FREE(session);
+        return NULL;
+    }
+    clock_gettime(CLOCK_REALTIME_COARSE, &session->synced);
+    return session;
+}
+
+static void session_close(WatchSession * session) {
+    close(session->fd);
+    FREE(session->entries);
+    FREE(session->buckets);
+    FREE(session);
+}
+
+static int session_find(WatchSession * session, int wd) {
+
+    if (session->bucket_count == 0) return -1;
+
+    int entry = session->buckets[hash_wd(wd) & (session->bucket_count - 1)];
+    while (entry >= 0 && session->entries[entry].wd != wd) {
+        entry = session->entries[entry].next;
+    }
+    return entry;
+}
+
+static int session_grow_buckets(WatchSession * session) {
+
+    int count = session->bucket_count ? session->bucket_count * 2 : 64;
+    int * buckets = ALLOC(sizeof(int) * count);
+    if (buckets == NULL) return -1;
+
+    memset(buckets, 0xff, sizeof(int) * count);
+    FREE(session->buckets);
+    session->buckets = buckets;
+    session->bucket_count = count;
+
+    for (int i = 0; i < session->entry_count; ++i) {
+        WatchShare * entry = &session->entries[i];
+        if (entry->wd < 0) continue;
+        int * slot = &buckets[hash_wd(entry->wd) & (count - 1)];
+        entry->next = *slot;
+        *slot = i;
+    }
+    return 0;
+}
+
+// Adds a tree's node to the subscribers of its kernel watch.
+static int session_subscribe(WatchSession * session, WatchTree * tree, int node) {
+
+    int wd = tree->nodes[node].wd;
+    int entry = session_find(session, wd);
+
+    if (entry < 0) {
+
+        if (session->live_entries >= session->bucket_count && session_grow_buckets(session) < 0) {
+            return -1;
+        }
+
+        entry = session->free_entry;
+        if (entry >= 0) {
+            session->free_entry = session->entries[entry].next;
+
+        } else {
+
+            if (session->entry_count == session->entry_capacity) {
+
+                int capacity = session->entry_capacity ? session->entry_capacity * 2 : 64;
+                WatchShare * entries = ALLOC(sizeof(WatchShare) * capacity);
+                if (entries == NULL) return -1;
+
+                if (session->entries != NULL) {
+                    memcpy(entries, session->entries, sizeof(WatchShare) * session->entry_count);
+                    FREE(session->entries);
+                }
+                session->entries = entries;
+                session->entry_capacity = capacity;
+            }
+            entry = session->entry_count++;
+        }
+
+        int * slot = &session->buckets[hash_wd(wd) & (session->bucket_count - 1)];
+        session->entries[entry] = (WatchShare) { .wd = wd, .next = *slot, .first_tree = NULL, .first_node = -1 };
+        *slot = entry;
+        ++session->live_entries;
+    }
+
+    WatchShare * share = &session->entries[entry];
+    tree->nodes[node].share_tree = share->first_tree;
+    tree->nodes[node].share_node = share->first_node;
+    share->first_tree = tree;
+    share->first_node = node;
+    return 0;
+}
+
+// Takes a tree's node off its kernel watch. Returns 1 if nothing else uses
+// the watch any more, in which case it's up to the caller to remove it.
+static int session_unsubscribe(WatchSession * session, WatchTree * tree, int node) {
+
+    int wd = tree->nodes[node].wd;
+    int entry = session_find(session, wd);
+    if (entry < 0) return 1;
+
+    WatchShare * share = &session->entries[entry];
+    WatchTree ** link_tree = &share->first_tree;
+    int * link_node = &share->first_node;
+    while (*link_tree != NULL && (*link_tree != tree || *link_node != node)) {
+        WatchNode * n = &(*link_tree)->nodes[*link_node];
+        link_tree = &n->share_tree;
+        link_node = &n->share_node;
+    }
+    if (*link_tree != NULL) {
+        *link_tree = tree->nodes[node].share_tree;
+        *link_node = tree->nodes[node].share_node;
+    }
+    if (share->first_tree != NULL) return 0;
+
+    int * slot = &session->buckets[hash_wd(wd) & (session->bucket_count - 1)];
+    while (*slot != entry) slot = &session->entries[*slot].next;
+    *slot = share->next;
+
+    share->wd = -1;
+    share->next = session->free_entry;
+    session->free_entry = entry;
+    --session->live_entries;
+    return 1;
+}
+
+static int tree_path(WatchTree * tree, int node, char const * name, char * buf, int size) {
+
+    // Measure first so the path can be written back to front in place:
+    int len = name && *name ? strlen(name) + 1 : 0;
+    for (int n = node; n >= 0; n = tree->nodes[n].parent) {
+        len += strlen(tree->nodes[n].name) + (tree->nodes[n].parent >= 0);
+    }
+    if (len + 1 > size) return -1;
+
+    char * end = buf + len;
+    *end = '\0';
+
+    if (name && *name) {
+        int name_len = strlen(name);
+        end -= name_len;
+        memcpy(end, name, name_len);
+        *--end = '/';
+    }
+
+    for (int n = node; n >= 0; n = tree->nodes[n].parent) {
+        int component_len = strlen(tree->nodes[n].name);
+        end -= component_len;
+        memcpy(end, tree->nodes[n].name, component_len);
+        if (tree->nodes[n].parent >= 0) *--end = '/';
+    }
+
+    return len;
+}
+
+int watch_path(Pipeline * pipeline, int wd, char const * name, char * buf, int size) {
+
+    int node = tree_find_wd(pipeline->tree, wd);
+    if (node < 0) return -1;
+    return tree_path(pipeline->tree, node, name, buf, size);
+}
+
+// Removes a kernel watch the tree just asked for, unless a node (this or
+// another pipeline's) is using it.
+static void watch_drop_wd(Pipeline * pipeline, int wd) {
+    if (session_find(pipeline->tree->session, wd) < 0) inotify_rm_watch(pipeline->notify_fd, wd);
+}
+
+static int watch_add(Pipeline * pipeline, char const * path, int parent, char const * name, uint32_t mask) {
+
+    // Excluded directories aren't watched at all, so nothing below them can
+    // generate events:
+    if (parent >= 0 && filter_excludes_dir(&pipeline->filter, path)) {
+        errno = EPERM;
+        return -1;
+    }
+
+    int wd = inotify_add_watch(pipeline->notify_fd, path, mask);
+    if (wd < 0) {
+
+        // Running out of watches is worth reporting, anything else is most
+        // likely a race with the directory being removed again.
+        if (errno == ENOSPC) {
+            printf(">> Pipeline %s: out of inotify watches at \"%s\" "
+                   "(raise fs.inotify.max_user_watches)\n", pipeline->name, path);
+        }
+        return -1;
+    }
+
+    // The same directory reached twice (bind mounts, overlapping roots):
+    if (tree_find_wd(pipeline->tree, wd) >= 0) {
+        errno = EEXIST;
+        return -1;
+    }
+
+    int node = tree_add(pipeline->tree, wd, parent, name);
+    if (node >= 0 && session_subscribe(pipeline->tree->session, pipeline->tree, node) < 0) {
+        tree_release(pipeline->tree, node);
+        node = -1;
+    }
+    if (node < 0) watch_drop_wd(pipeline, wd);
+    return node;
+}
+
+// Adds watches for every directory below the given node. Works from an explicit
+// stack rather than recursion so deep trees can't exhaust the C stack.
+static void watch_crawl(Pipeline * pipeline, int root) {
+
+    WatchTree * tree = pipeline->tree;
+    char path[PATH_MAX];
+
+    tree->scan_count = 0;
+    if (tree_push_scan(tree, root) < 0) return;
+
+    while (tree->scan_count > 0) {
+
+        int node = tree->scan[--tree->scan_count];
+        int len = watch_path(pipeline, tree->nodes[node].wd, NULL, path, sizeof(path));
+        if (len < 0) continue;
+
+        DIR * dir = opendir(path);
+        if (dir == NULL) continue;
+
+        struct dirent * entry;
+        while ((entry = readdir(dir)) != NULL) {
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            int is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode);
+            }
+            if (!is_dir) continue;
+
+            int name_len = strlen(entry->d_name);
+            if (len + name_len + 2 > (int) sizeof(path)) continue;
+
+            path[len] = '/';
+            memcpy(path + len + 1, entry->d_name, name_len + 1);
+
+            // Only indices are held across this call, as the pool may be reallocated:
+            int child = watch_add(pipeline, path, node, entry->d_name, WATCH_DIR_MASK);
+            path[len] = '\0';
+
+            if (child >= 0) tree_push_scan(tree, child);
+        }
+
+        closedir(dir);
+    }
+}
+
+// Forgets a node and everything below it. Watches on descendants are removed
+// from the kernel once no other pipeline uses them; the node's own watch is
+// removed too unless the kernel has already dropped it.
+static void watch_remove(Pipeline * pipeline, int node, int kernel_removed) {
+
+    WatchTree * tree = pipeline->tree;
+
+    tree->scan_count = 0;
+    if (tree_push_scan(tree, node) < 0) return;
+
+    // Collect the subtree first, then release it deepest first:
+    for (int i = 0; i < tree->scan_count; ++i) {
+        for (int c = tree->nodes[tree->scan[i]].first_child; c >= 0; c = tree->nodes[c].next_sibling) {
+            if (tree_push_scan(tree, c) < 0) break;
+        }
+    }
+
+    while (tree->scan_count > 0) {
+        int n = tree->scan[--tree->scan_count];
+        if (session_unsubscribe(tree->session, tree, n) && (n != node || !kernel_removed)) {
+            inotify_rm_watch(pipeline->notify_fd, tree->nodes[n].wd);
+        }
+        tree_release(tree, n);
+    }
+}
+
+static void watch_finish_move(Pipeline * pipeline) {
+
+    // A directory moved out of the watched tree entirely:
+    if (pipeline->tree->move_node >= 0) {
+        watch_remove(pipeline, pipeline->tree->move_node, 0);
+        pipeline->tree->move_node = -1;
+    }
+}
+
+static int watch_handle_dir_event(Pipeline * pipeline, int node, struct inotify_event const * ev) {
+
+    WatchTree * tree = pipeline->tree;
+
+    if (ev->mask & IN_MOVED_FROM) {
+        watch_finish_move(pipeline);
+        tree->move_node = tree_find_child(tree, node, ev->name);
+        tree->move_cookie = ev->cookie;
+        return 0;
+    }
+
+    if (ev->mask & IN_MOVED_TO && tree->move_node >= 0 && tree->move_cookie == ev->cookie) {
+
+        // Renamed within the tree: the kernel watch follows the inode, so the
+        // node just needs reattaching under its new parent and name.
+        char * name = tree_name_alloc(tree, ev->name);
+        if (name == NULL) return -1;
+
+        int moved = tree->move_node;
+        tree->move_node = -1;
+        tree_detach(tree, moved);
+        tree_attach(tree, moved, node, name);
+
+        // Renamed to something that's excluded:
+        char path[PATH_MAX];
+        if (watch_path(pipeline, tree->nodes[moved].wd, NULL, path, sizeof(path)) >= 0
+            && filter_excludes_dir(&pipeline->filter, path)) {
+            watch_remove(pipeline, moved, 0);
+        }
+        return 0;
+    }
+
+    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+
+        char path[PATH_MAX];
+        if (watch_path(pipeline, ev->wd, ev->name, path, sizeof(path)) < 0) return -1;
+
+        int child = watch_add(pipeline, path, node, ev->name, WATCH_DIR_MASK);
+        if (child >= 0) watch_crawl(pipeline, child);
+    }
+
+    return 0;
+}
+
+static int timestamp_since(struct statx_timestamp const * ts, struct timespec const * since) {
+    return ts->tv_sec > since->tv_sec || (ts->tv_sec == since->tv_sec && ts->tv_nsec >= since->tv_nsec);
+}
+
+// The snapshot keeps, per watched file, a stamp of the metadata that changes
+// whenever it's written or replaced. Nothing is read from the files themselves.
+static uint64_t snapshot_stamp(struct statx const * stx) {
+    uint64_t fields[5] = { stx->stx_ino, stx->stx_size, stx->stx_mtime.tv_sec, stx->stx_mtime.tv_nsec, stx->stx_mode };
+    return hash_bytes(fields, sizeof(fields), 0);
+}
+
+typedef enum {
+    SNAPSHOT_RECORD,    // Store every file's stamp
+    SNAPSHOT_COMPARE,   // Record files whose stamp differs as changes
+    SNAPSHOT_SINCE      // Record files modified or changed since a point in time
+} SnapshotMode;
+
+typedef struct {
+    HashCache * snapshot;
+    SnapshotMode mode;
+    struct timespec since;
+    int matched;        // Files that were in the snapshot
+    int changed;
+} SnapshotScan;
+
+static void snapshot_visit(Pipeline * pipeline, SnapshotScan * scan, int dir_fd, char const * name,
+                           char const * path) {
+
+    if (!filter_match(&pipeline->filter, path)) return;
+
+    struct statx stx;
+    if (statx(dir_fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+              STATX_TYPE | STATX_MODE | STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME, &stx) < 0) {
+        return;
+    }
+    if (S_ISDIR(stx.stx_mode)) return;
+
+    if (scan->mode == SNAPSHOT_SINCE) {
+
+        // A rename into place only moves ctime, so both are checked:
+        if (!timestamp_since(&stx.stx_mtime, &scan->since) && !timestamp_since(&stx.stx_ctime, &scan->since)) return;
+        if (pipeline->hash_changes && hashcache_update(&pipeline->hashes, path) == 0) return;
+
+        changeset_add(&pipeline->changes, path);
+        replay_record_change(pipeline, path);
+        ++scan->changed;
+        return;
+    }
+
+    uint64_t key = hashcache_key(path);
+    uint64_t stamp = snapshot_stamp(&stx);
+
+    if (scan->mode == SNAPSHOT_RECORD) {
+        hashcache_put(scan->snapshot, key, stamp);
+
+        // So that a file touched while stopped can be told apart from one that
+        // was edited. Files are hashed once, then kept current by the events:
+        uint64_t content;
+        if (pipeline->hash_changes && !hashcache_get(&pipeline->hashes, key, &content)) {
+            hashcache_update(&pipeline->hashes, path);
+        }
+        return;
+    }
+
+    uint64_t previous;
+    int found = hashcache_get(scan->snapshot, key, &previous);
+    scan->matched += found;
+    if (found && previous == stamp) return;
+
+    // Touched, but its contents are what they were:
+    if (found && pipeline->hash_changes && hashcache_update(&pipeline->hashes, path) == 0) return;
+
+    changeset_add(&pipeline->changes, path);
+    ++scan->changed;
+}
+
+// Directories still to be scanned when there's no watch tree to go by:
+typedef struct SnapshotDir {
+    struct SnapshotDir * next;
+    char path[];
+} SnapshotDir;
+
+static void snapshot_push(SnapshotDir ** dirs, char const * path, int len) {
+
+    SnapshotDir * dir = ALLOC(sizeof(SnapshotDir) + len + 1);
+    if (dir == NULL) return;
+    memcpy(dir->path, path, len + 1);
+    dir->next = *dirs;
+    *dirs = dir;
+}
+
+// Visits every file directly inside one directory, whose path is in the first
+// len bytes of path. Entries are read with getdents64() into one large buffer,
+// so a directory takes a handful of system calls however big it is, and each
+// file is stat'ed relative to its directory rather than by full path. With
+// dirs given, subdirectories that are to be watched are pushed onto it.
+// Returns -1 with errno set if the directory can't be opened.
+static int snapshot_scan_dir(Pipeline * pipeline, SnapshotScan * scan, char * path, int len,
+                              char * buf, size_t buf_size, SnapshotDir ** dirs) {
+
+    int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t n;
+    while ((n = getdents64(fd, buf, buf_size)) > 0) {
+
+        struct dirent64 * entry;
+        for (ssize_t offset = 0; offset < n; offset += entry->d_reclen) {
+
+            entry = (struct dirent64 *) (buf + offset);
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            int name_len = strlen(entry->d_name);
+            if (len + name_len + 2 > PATH_MAX) continue;
+
+            path[len] = '/';
+            memcpy(path + len + 1, entry->d_name, name_len + 1);
+
+            if (entry->d_type != DT_DIR) {
+                snapshot_visit(pipeline, scan, fd, entry->d_name, path);
+            } else if (dirs != NULL && !filter_excludes_dir(&pipeline->filter, path)) {
+                snapshot_push(dirs, path, len + name_len + 1);
+            }
+            path[len] = '\0';
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Visits every watched file, plus roots that are single files. Under inotify
+// every watched directory is a node of the tree. A fanotify filesystem mark
+// leaves nothing to go by, so the watch paths are walked instead.
+static void snapshot_scan(Pipeline * pipeline, SnapshotScan * scan) {
+
+    WatchTree * tree = pipeline->tree;
+    char path[PATH_MAX];
+
+    size_t buf_size = 64 * 1024;
+    char * buf = ALLOC(buf_size);
+    if (buf == NULL) return;
+
+    if (tree->fanotify == NULL) {
+        for (int node = 0; node < tree->node_count; ++node) {
+
+            if (tree->nodes[node].wd < 0) continue;
+
+            int len = watch_path(pipeline, tree->nodes[node].wd, NULL, path, sizeof(path));
+            if (len < 0) continue;
+
+            if (snapshot_scan_dir(pipeline, scan, path, len, buf, buf_size, NULL) < 0
+                && errno == ENOTDIR && tree->nodes[node].parent < 0) {
+                snapshot_visit(pipeline, scan, AT_FDCWD, path, path);
+            }
+        }
+
+        FREE(buf);
+        return;
+    }
+
+    for (char ** watch_path = pipeline->watch_paths; watch_path && *watch_path; ++watch_path) {
+
+        char * full_path = join_path(pipeline->workdir, *watch_path);
+        if (full_path == NULL) continue;
+
+        int len = strlen(full_path);
+        SnapshotDir * dirs = NULL;
+        if (len < PATH_MAX) snapshot_push(&dirs, full_path, len);
+
+        while (dirs != NULL) {
+            SnapshotDir * dir = dirs;
+            dirs = dir->next;
+
+            int dir_len = strlen(dir->path);
+            memcpy(path, dir->path, dir_len + 1);
+            FREE(dir);
+
+            if (snapshot_scan_dir(pipeline, scan, path, dir_len, buf, buf_size, pipeline->recursive ? &dirs : NULL) < 0
+                && errno == ENOTDIR && strcmp(path, full_path) == 0) {
+                snapshot_visit(pipeline, scan, AT_FDCWD, path, path);
+            }
+        }
+        FREE(full_path);
+    }
+
+    FREE(buf);
+}
+
+// Compares the watched files against the snapshot saved when pipelines last
+// stopped, so edits made in the meantime cause a run. A file that's gone can't
+// be named, so deletions mark the change set incomplete.
+static void watch_reconcile(Pipeline * pipeline) {
+
+    char * snapshot_path = state_path(pipeline->name, ".snapshot");
+    if (snapshot_path == NULL) return;
+
+    HashCache snapshot;
+    int loaded = hashcache_load(&snapshot, snapshot_path) == 0;
+    FREE(snapshot_path);
+    if (!loaded) return;
+
+    // Not mapped means there was no snapshot, so this is the first start:
+    if (snapshot.map != NULL) {
+
+        SnapshotScan scan = { .snapshot = &snapshot, .mode = SNAPSHOT_COMPARE };
+        snapshot_scan(pipeline, &scan);
+
+        int deleted = snapshot.count - scan.matched;
+        if (deleted > 0) pipeline->changes.incomplete = 1;
+
+        if (scan.changed > 0 || deleted > 0) {
+            printf(">> Pipeline %s: %d files changed and %d deleted since the last snapshot\n",
+                   pipeline->name, scan.changed, deleted);
+            pipeline_mark_dirty(pipeline);
+        }
+    }
+
+    hashcache_close(&snapshot);
+}
+
+int watch_open(Pipeline * pipeline) {
+
+    pipeline->tree = ALLOC(sizeof(WatchTree));
+    if (pipeline->tree == NULL) return -1;
+    memset(pipeline->tree, 0, sizeof(WatchTree));
+    pipeline->tree->free_node = -1;
+    pipeline->tree->move_node = -1;
+    for (int i = 0; i < WATCH_NAME_CLASSES; ++i) {
+        pool_init(&pipeline->tree->name_pools[i], watch_name_sizes[i], 256);
+    }
+
+    WatchTree * tree = pipeline->tree;
+    tree->pipeline = pipeline;
+
+    int backend = pipeline->watch_backend ? pipeline->watch_backend : (int) watch_default_backend;
+    if (backend == PIPELINE_WATCH_FANOTIFY) {
+        tree->fanotify = fanotify_watch_open(pipeline);
+        if (tree->fanotify == NULL) {
+            printf(">> Pipeline %s: fanotify unavailable (%s), using inotify\n", pipeline->name, strerror(errno));
+        }
+    }
+
+    if (tree->fanotify == NULL) {
+        tree->session = watch_shared ? watch_shared : session_open();
+        if (tree->session == NULL) {
+            printf("Error: %s\n", strerror(errno));
+            goto error;
+        }
+        tree->next_tree = tree->session->trees;
+        tree->session->trees = tree;
+    }
+    pipeline->notify_fd = tree->fanotify ? fanotify_watch_fd(tree->fanotify) : tree->session->fd;
+
+    if (pipeline->hash_changes) {
+        char * cache_path = state_path(pipeline->name, ".hashes");
+        if (cache_path == NULL || hashcache_load(&pipeline->hashes, cache_path) < 0) {
+            printf("Error loading hash cache for %s\n", pipeline->name);
+            FREE(cache_path);
+            goto error;
+        }
+        FREE(cache_path);
+    }
+
+    if (pipeline->action_cache) {
+        char * cache_path = state_path(pipeline->name, ".inputs");
+        if (cache_path == NULL || hashcache_load(&pipeline->inputs, cache_path) < 0) {
+            printf("Error loading input hashes for %s\n", pipeline->name);
+            FREE(cache_path);
+            goto error;
+        }
+        FREE(cache_path);
+    }
+
+    // Add a watch for each path. Relative paths are relative to the workdir.
+    // Filesystem marks already cover everything below them.
+    for (char ** path = pipeline->watch_paths; !pipeline->tree->fanotify && path && *path; ++path) {
+
+        char * full_path = join_path(pipeline->workdir, *path);
+        if (full_path == NULL) goto error;
+
+        struct stat st;
+        int is_dir = stat(full_path, &st) == 0 && S_ISDIR(st.st_mode);
+
+        int root = watch_add(pipeline, full_path, -1, full_path, is_dir ? WATCH_ROOT_MASK : WATCH_FILE_MASK);
+        if (root < 0 && errno != EEXIST) {
+            printf("Error watching \"%s\": %s\n", full_path, strerror(errno));
+            FREE(full_path);
+            goto error;
+        }
+
+        if (root >= 0 && is_dir && pipeline->recursive) {
+            watch_crawl(pipeline, root);
+        }
+
+        FREE(full_path);
+    }
+
+    // Catch up on anything edited while pipelines wasn't running:
+    watch_reconcile(pipeline);
+
+    // Output log message stating that we're watching:
+    printf("(%d) >> Pipeline %s monitoring ", getpid(), pipeline->name);
+    for (char ** path = pipeline->watch_paths; path && *path; ++path) {
+        printf("\"%s\"%s", *path, path[1] ? ", " : "");
+    }
+    if (pipeline->tree->fanotify) {
+        printf(" for changes (fanotify, %d filesystems)\n", watch_count(pipeline));
+    } else {
+        printf(" for changes (%d watches)\n", watch_count(pipeline));
+    }
+    METRIC_SET(pipeline->metrics, watches, watch_count(pipeline));
+
+    return 0;
+
+error:
+    watch_close(pipeline);
+    return -1;
+}
+
+int watch_record_path(Pipeline * pipeline, char const * path, int is_dir, int removed) {
+
+    if (!filter_match(&pipeline->filter, path)) return 0;
+    if (is_dir && filter_excludes_dir(&pipeline->filter, path)) return 0;
+
+    // A write that left the contents as they were isn't a change:
+    if (pipeline->hash_changes && !is_dir) {
+        if (removed) {
+            hashcache_remove(&pipeline->hashes, path);
+        } else if (hashcache_update(&pipeline->hashes, path) == 0) {
+            return 0;
+        }
+    }
+
+    changeset_add(&pipeline->changes, path);
+    replay_record_change(pipeline, path);
+    return 1;
+}
+
+// Adds the path an event refers to to the pipeline's change set, unless the
+// pipeline's filter rejects it. Returns 1 if the event is relevant.
+static int watch_record(Pipeline * pipeline, int node, struct inotify_event const * ev) {
+
+    char path[PATH_MAX];
+    if (tree_path(pipeline->tree, node, ev->len ? ev->name : NULL, path, sizeof(path)) < 0) {
+        pipeline->changes.incomplete = 1;
+        return 1;
+    }
+
+    return watch_record_path(pipeline, path, (ev->mask & IN_ISDIR) != 0, (ev->mask & (IN_DELETE | IN_MOVED_FROM)) != 0);
+}
+
+// Files in /proc report a size of 0, so they're read with a plain read():
+static int read_proc_int(char const * path) {
+
+    char buf[32];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    ssize_t n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) return -1;
+
+    buf[n] = '\0';
+    return atoi(buf);
+}
+
+// Brings the watch tree back in line with the directories on disk after the
+// kernel dropped events, then records the files modified since `since`. Only
+// this pipeline's roots are scanned, and only file metadata is read.
+static void watch_rescan(Pipeline * pipeline, struct timespec since) {
+
+    WatchTree * tree = pipeline->tree;
+    char path[PATH_MAX];
+
+    printf(">> Pipeline %s: event queue overflowed, rescanning (fs.inotify.max_queued_events is %d)\n",
+           pipeline->name, read_proc_int("/proc/sys/fs/inotify/max_queued_events"));
+
+    // Directories that were deleted, moved away or replaced. Asking for a
+    // watch on the path gives back the same wd only if it's still the same
+    // directory. One that moved elsewhere in the tree is found again below
+    // under its new name:
+    for (int node = 0; node < tree->node_count; ++node) {
+
+        if (tree->nodes[node].wd < 0 || tree->nodes[node].parent < 0) continue;
+
+        int wd = -1;
+        if (watch_path(pipeline, tree->nodes[node].wd, NULL, path, sizeof(path)) >= 0) {
+            wd = inotify_add_watch(pipeline->notify_fd, path, WATCH_DIR_MASK);
+        }
+        if (wd == tree->nodes[node].wd) continue;
+
+        if (wd >= 0) watch_drop_wd(pipeline, wd);
+        watch_remove(pipeline, node, 0);
+    }
+
+    // Timestamps are coarse, so allow for a change stamped slightly early:
+    since.tv_sec -= 1;
+
+    // Directories that appeared. They're recorded themselves, as their
+    // creation would have been. A directory whose contents changed may have
+    // lost files, which can't be named any more:
+    for (int node = 0; node < tree->node_count; ++node) {
+
+        if (tree->nodes[node].wd < 0) continue;
+
+        int len = watch_path(pipeline, tree->nodes[node].wd, NULL, path, sizeof(path));
+        if (len < 0) continue;
+
+        DIR * dir = opendir(path);
+        if (dir == NULL) continue;
+
+        struct statx stx;
+        if (statx(dirfd(dir), "", AT_EMPTY_PATH, STATX_MTIME, &stx) == 0 && timestamp_since(&stx.stx_mtime, &since)) {
+            pipeline->changes.incomplete = 1;
+        }
+
+        struct dirent * entry;
+        while (pipeline->recursive && (entry = readdir(dir)) != NULL) {
+
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+
+            int is_dir = entry->d_type == DT_DIR;
+            if (entry->d_type == DT_UNKNOWN) {
+                struct stat st;
+                is_dir = fstatat(dirfd(dir), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0
+                    && S_ISDIR(st.st_mode);
+            }
+            if (!is_dir || tree_find_child(tree, node, entry->d_name) >= 0) continue;
+
+            int name_len = strlen(entry->d_name);
+            if (len + name_len + 2 > (int) sizeof(path)) continue;
+
+            path[len] = '/';
+            memcpy(path + len + 1, entry->d_name, name_len + 1);
+
+            int child = watch_add(pipeline, path, node, entry->d_name, WATCH_DIR_MASK);
+            if (child >= 0) {
+                if (filter_match(&pipeline->filter, path)) {
+                    changeset_add(&pipeline->changes, path);
+                    replay_record_change(pipeline, path);
+                }
+                watch_crawl(pipeline, child);
+            }
+            path[len] = '\0';
+        }
+
+        closedir(dir);
+    }
+
+    SnapshotScan scan = { .mode = SNAPSHOT_SINCE, .since = since };
+    snapshot_scan(pipeline, &scan);
+
+    printf(">> Pipeline %s: rescan found %d changed files%s\n", pipeline->name, scan.changed,
+           pipeline->changes.incomplete ? ", and possibly deletions" : "");
+}
+
+// Hands one event to a pipeline subscribed to its wd, through its node.
+static void watch_handle_event(Pipeline * pipeline, int node, struct inotify_event const * ev) {
+
+    WatchTree * tree = pipeline->tree;
+    ++tree->received;
+
+    // The kernel has dropped this watch (directory deleted or unmounted):
+    if (ev->mask & IN_IGNORED) {
+        if (tree->move_node == node) tree->move_node = -1;
+        watch_remove(pipeline, node, 1);
+        return;
+    }
+
+    if (ev->mask & IN_ISDIR && pipeline->recursive) {
+        watch_handle_dir_event(pipeline, node, ev);
+    }
+
+    if (ev->mask & WATCH_TRIGGER_MASK || (ev->mask & IN_CREATE && ev->mask & IN_ISDIR)) {
+        int relevant = watch_record(pipeline, node, ev);
+        tree->count += relevant;
+        tree->filtered += !relevant;
+    }
+}
+
+void watch_drained(Pipeline * pipeline, int count, int received, int filtered) {
+
+    replay_record_drain(pipeline, count, received, filtered);
+
+    PipelineMetrics * metrics = pipeline->metrics;
+    METRIC_ADD(metrics, events_received, received);
+    METRIC_ADD(metrics, events_filtered, filtered);
+    METRIC_SET(metrics, watches, watch_count(pipeline));
+
+    if (count > 0) {
+
+        // Only the first change of a pending run is what triggers it:
+        METRIC_ADD(metrics, changes, count);
+        METRIC_ADD(metrics, changes_coalesced, pipeline->dirty ? count : count - 1);
+        timeline_changes(pipeline, count);
+        pipeline_mark_dirty(pipeline);
+    }
+}
+
+static int watch_session_drain(WatchSession * session) {
+
+    static char buf[WATCH_READ_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int read_count = 0;
+    int overflowed = 0;
+
+    // Whatever changed after the last time the queue was read empty is what
+    // an overflow could have lost:
+    struct timespec since = session->synced;
+
+    for (;;) {
+
+        struct timespec before;
+        clock_gettime(CLOCK_REALTIME_COARSE, &before);
+
+        ssize_t r = read(session->fd, buf, sizeof(buf));
+        if (r < 0) {
+            if (errno == EAGAIN) {
+                session->synced = before;
+                break;
+            }
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (r == 0) break;
+
+        struct inotify_event const * ev;
+        for (char * p = buf; p < buf + r; p += sizeof(struct inotify_event) + ev->len) {
+
+            ev = (struct inotify_event const *) p;
+            ++read_count;
+
+            // Events were lost. The trees are rescanned once the queue is empty:
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflowed = 1;
+                continue;
+            }
+
+            int entry = session_find(session, ev->wd);
+            if (entry < 0) continue;
+
+            // A pipeline handling the event only ever changes its own tree's
+            // subscriptions, so the next one in the chain stays valid:
+            WatchTree * tree = session->entries[entry].first_tree;
+            int node = session->entries[entry].first_node;
+            while (tree != NULL) {
+                WatchTree * next_tree = tree->nodes[node].share_tree;
+                int next_node = tree->nodes[node].share_node;
+                watch_handle_event(tree->pipeline, node, ev);
+                tree = next_tree;
+                node = next_node;
+            }
+        }
+    }
+
+    for (WatchTree * tree = session->trees; tree != NULL; tree = tree->next_tree) {
+
+        if (tree->received == 0 && !overflowed) continue;
+
+        Pipeline * pipeline = tree->pipeline;
+        watch_finish_move(pipeline);
+        if (overflowed) {
+            METRIC_ADD(pipeline->metrics, overflows, 1);
+            ++tree->received;
+            ++tree->count;
+            watch_rescan(pipeline, since);
+        }
+
+        watch_drained(pipeline, tree->count, tree->received, tree->filtered);
+        tree->received = tree->filtered = tree->count = 0;
+    }
+
+    return read_count;
+}
+
+int watch_drain(Pipeline * pipeline) {
+
+    FanotifyWatch * fanotify = pipeline->tree->fanotify;
+    if (fanotify == NULL) return watch_session_drain(pipeline->tree->session);
+
+    int received = 0;
+    int filtered = 0;
+    int count = fanotify_watch_drain(pipeline, fanotify, &received, &filtered);
+    if (count < 0) return -1;
+
+    watch_drained(pipeline, count, received, filtered);
+    return count;
+}
+
+int watch_share() {
+
+    if (watch_shared == NULL) watch_shared = session_open();
+    return watch_shared ? watch_shared->fd : -1;
+}
+
+int watch_drain_shared() {
+    return watch_shared ? watch_session_drain(watch_shared) : 0;
+}
+
+int watch_shared_count() {
+    return watch_shared ? watch_shared->live_entries : 0;
+}
+
+void watch_move(Pipeline * pipeline) {
+    if (pipeline->tree != NULL) pipeline->tree->pipeline = pipeline;
+}
+
+int watch_count(Pipeline * pipeline) {
+    if (pipeline->tree == NULL) return 0;
+    return pipeline->tree->fanotify ? fanotify_watch_count(pipeline->tree->fanotify) : pipeline->tree->live_nodes;
+}
+
+void watch_save_snapshot(Pipeline * pipeline) {
+
+    if (pipeline->tree == NULL) return;
+
+    char * snapshot_path = state_path(pipeline->name, ".snapshot");
+    if (snapshot_path == NULL) return;
+
+    HashCache snapshot;
+    int ready = hashcache_init(&snapshot, snapshot_path) == 0;
+    FREE(snapshot_path);
+    if (!ready) return;
+
+    SnapshotScan scan = { .snapshot = &snapshot, .mode = SNAPSHOT_RECORD };
+    snapshot_scan(pipeline, &scan);
+
+    // Anything changed up to the end of the scan is now queued, and whatever
+    // is pending must still look changed on the next start. If that can't be
+    // said file by file, everything has to.
+    watch_drain(pipeline);
+    if (pipeline->changes.incomplete) {
+        hashcache_clear(&snapshot);
+    } else {
+        ChangeSet * changes = &pipeline->changes;
+        for (char * path = changes->strings; path < changes->strings + changes->strings_len; path += strlen(path) + 1) {
+            hashcache_remove(&snapshot, path);
+        }
+    }
+
+    if (hashcache_save(&snapshot) < 0) {
+        printf(">> Pipeline %s: unable to save snapshot (%s)\n", pipeline->name, strerror(errno));
+    }
+    hashcache_close(&snapshot);
+}
+
+// Takes a tree off its session, closing the session unless it's shared.
+static void session_leave(WatchSession * session, WatchTree * tree) {
+
+    // The other pipelines keep a shared session running, so this tree's
+    // watches are taken off it one by one:
+    if (session == watch_shared) {
+        for (int node = 0; node < tree->node_count; ++node) {
+            if (tree->nodes[node].wd >= 0 && session_unsubscribe(session, tree, node)) {
+                inotify_rm_watch(session->fd, tree->nodes[node].wd);
+            }
+        }
+    }
+
+    WatchTree ** link = &session->trees;
+    while (*link != NULL && *link != tree) link = &(*link)->next_tree;
+    if (*link != NULL) *link = tree->next_tree;
+
+    if (session != watch_shared) session_close(session);
+    tree->session = NULL;
+}
+
+void watch_close(Pipeline * pipeline) {
+
+    // The fanotify descriptor belongs to its watch, and the inotify one to
+    // the session:
+    WatchTree * tree = pipeline->tree;
+    if (tree != NULL && tree->fanotify != NULL) {
+        fanotify_watch_close(tree->fanotify);
+        tree->fanotify = NULL;
+    } else if (tree != NULL && tree->session != NULL) {
+        session_leave(tree->session, tree);
+    }
+    pipeline->notify_fd = -1;
+
+    if (pipeline->hashes.path != NULL) {
+        hashcache_save(&pipeline->hashes);
+        hashcache_close(&pipeline->hashes);
+    }
+
+    if (pipeline->inputs.path != NULL) {
+        hashcache_save(&pipeline->inputs);
+        hashcache_close(&pipeline->inputs);
+    }
+
+    if (tree == NULL) return;
+
+    for (int i = 0; i < tree->node_count; ++i) {
+        if (tree->nodes[i].wd >= 0) tree_name_release(tree, tree->nodes[i].name);
+    }
+    for (int i = 0; i < WATCH_NAME_CLASSES; ++i) pool_free(&tree->name_pools[i]);
+    FREE(tree->nodes);
+    FREE(tree->by_wd);
+    FREE(tree->by_name);
+    FREE(tree->scan);
+    FREE(tree);
+    pipeline->tree = NULL;
+}
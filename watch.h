@@ -0,0 +1,70 @@
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "pipelines.h"
+
+typedef struct WatchTree WatchTree;
+
+// The backend for pipelines that don't set watch_backend (see -w):
+extern PipelineWatchBackend watch_default_backend;
+
+// Opens the pipeline's inotify session and registers its watch paths. With the
+// fanotify backend their filesystems are marked instead, falling back to
+// inotify if that isn't possible. The session is kept for the life of the
+// process, so changes made while a command is running are queued by the
+// kernel instead of being lost.
+// Directories are watched recursively unless the pipeline sets
+// "recursive: false"; the watch tree is then kept up to date from the
+// events themselves rather than by rescanning. Files that changed since the
+// last snapshot was saved are recorded as changes straight away.
+int watch_open(Pipeline * pipeline);
+
+// Reads every event currently queued on the session without blocking. The
+// paths of relevant events are added to the change set of each pipeline
+// they concern, and those pipelines are marked dirty. Returns the number of
+// events read, or -1 on error.
+int watch_drain(Pipeline * pipeline);
+
+// Has every pipeline that's opened from here on with inotify share one
+// session, so directories watched by several pipelines take one kernel watch
+// and each event is read once. Only for engines that run every pipeline in
+// one process. Returns the shared descriptor for the caller to poll, or -1.
+int watch_share();
+
+// watch_drain() for the shared session.
+int watch_drain_shared();
+
+// Returns the number of kernel watches in the shared session.
+int watch_shared_count();
+
+// Points the watches at a pipeline whose state was moved into it from
+// another (see pipeline_move_state()).
+void watch_move(Pipeline * pipeline);
+
+// Records a change to the file or directory at path, as reported by either
+// backend. Returns 1 if it's relevant, or 0 if the pipeline's filter or
+// hash_changes rules it out.
+int watch_record_path(Pipeline * pipeline, char const * path, int is_dir, int removed);
+
+// Updates the metrics after a batch of events has been recorded, and marks the
+// pipeline dirty if count of them were relevant. Event sources other than the
+// watches (see replay.h) call this once they've added their changes.
+void watch_drained(Pipeline * pipeline, int count, int received, int filtered);
+
+// Writes the full path of a watched directory, optionally followed by an entry
+// name, into buf. Returns the path length, or -1 if the wd is unknown or the
+// path doesn't fit.
+int watch_path(Pipeline * pipeline, int wd, char const * name, char * buf, int size);
+
+// Returns the number of directories and files the pipeline watches (or, with
+// fanotify, the number of filesystems marked).
+int watch_count(Pipeline * pipeline);
+
+// Saves a snapshot of the watched files for the next start to be compared
+// against (see watch_open()), leaving out changes that haven't been run yet.
+// A run that's being cut short should be marked dirty and incomplete first.
+void watch_save_snapshot(Pipeline * pipeline);
+
+void watch_close(Pipeline * pipeline);
+
+#endif // WATCH_H
@@ -0,0 +1,562 @@
+#include "worker.h"
+#include "jobserver.h"
+#include "arena.h"
+#include "isolation.h"
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/pidfd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// A response's header line, and the most output it can carry, which is what
+// the output ring keeps of a run anyway:
+#define WORKER_HEADER_MAX 64
+#define WORKER_BODY_MAX OUTPUT_RING_SIZE
+#define WORKER_RESPONSE_MAX (WORKER_HEADER_MAX + WORKER_BODY_MAX)
+
+// A worker that exits sooner than this after starting waits for a run to need
+// it before it's started again, so one that can't start doesn't spin:
+#define WORKER_MIN_UPTIME_NS 1000000000ull
+
+// Everything a worker is started with. Pipelines whose commands would be
+// started the same way share one.
+typedef struct WorkerPool {
+    char * workdir;
+    char ** argv;
+    char ** envp;
+    int size;
+    struct WorkerPool * next;
+} WorkerPool;
+
+typedef struct {
+    WorkerPool * pool;      // NULL if the slot is unused
+    pid_t pid;              // 0 if it isn't running
+    int pidfd;
+    int fd;                 // Its stdin and stdout
+    uint64_t started_ns;
+    Pipeline * pipeline;    // The pipeline whose run it's handling, or NULL
+    char * response;        // WORKER_RESPONSE_MAX bytes, allocated on first use
+    int response_len;
+} Worker;
+
+static struct {
+    int epfd;
+    WorkerPool * pools;
+    Worker * slots;
+    int count;
+    int capacity;
+} workers = { .epfd = -1 };
+
+int worker_open() {
+    workers.epfd = epoll_create1(EPOLL_CLOEXEC);
+    return workers.epfd;
+}
+
+static int str_equal(char const * a, char const * b) {
+    if (a == NULL || b == NULL) return a == b;
+    return strcmp(a, b) == 0;
+}
+
+static int str_list_equal(char ** a, char ** b) {
+    while (a && *a && b && *b) {
+        if (strcmp(*a++, *b++) != 0) return 0;
+    }
+    return (a == NULL || *a == NULL) && (b == NULL || *b == NULL);
+}
+
+static void str_list_free(char ** list) {
+    for (char ** s = list; s && *s; ++s) FREE(*s);
+    FREE(list);
+}
+
+static int worker_pool_matches(WorkerPool * pool, Pipeline * pipeline) {
+    return str_equal(pool->workdir, pipeline->workdir) &&
+           str_list_equal(pool->argv, pipeline->argv) &&
+           str_list_equal(pool->envp, pipeline->envp);
+}
+
+// Finds the pool for the pipeline's command, creating it the first time.
+static WorkerPool * worker_pool_find(Pipeline * pipeline) {
+
+    WorkerPool * pool = workers.pools;
+    while (pool != NULL && !worker_pool_matches(pool, pipeline)) pool = pool->next;
+
+    if (pool == NULL) {
+
+        pool = ALLOC(sizeof(WorkerPool));
+        if (pool == NULL) return NULL;
+        memset(pool, 0, sizeof(WorkerPool));
+
+        int failed = pipeline->workdir != NULL && (pool->workdir = copy_str(pipeline->workdir)) == NULL;
+        for (char ** arg = pipeline->argv; arg && *arg && !failed; ++arg) failed = str_list_append(&pool->argv, *arg) < 0;
+        for (char ** var = pipeline->envp; var && *var && !failed; ++var) failed = str_list_append(&pool->envp, *var) < 0;
+        if (failed) {
+            FREE(pool->workdir);
+            str_list_free(pool->argv);
+            str_list_free(pool->envp);
+            FREE(pool);
+            return NULL;
+        }
+
+        pool->next = workers.pools;
+        workers.pools = pool;
+    }
+
+    if (pipeline->worker_pool > pool->size) pool->size = pipeline->worker_pool;
+    return pool;
+}
+
+// What to call a pool in messages: the command, as the shell would get it.
+static char const * worker_pool_name(WorkerPool * pool) {
+    char * const * argv = isolation_unwrap(pool->argv);
+    if (strcmp(argv[0], "/bin/sh") == 0 && argv[1] != NULL && argv[2] != NULL) return argv[2];
+    return argv[0];
+}
+
+// Returns an unused slot, or -1.
+static int worker_slot_new() {
+
+    for (int i = 0; i < workers.count; ++i) {
+        if (workers.slots[i].pool == NULL) return i;
+    }
+
+    if (workers.count == workers.capacity) {
+
+        int capacity = workers.capacity ? workers.capacity * 2 : 8;
+        Worker * slots = ALLOC(sizeof(Worker) * capacity);
+        if (slots == NULL) return -1;
+
+        if (workers.slots != NULL) {
+            memcpy(slots, workers.slots, sizeof(Worker) * workers.count);
+            FREE(workers.slots);
+        }
+        workers.slots = slots;
+        workers.capacity = capacity;
+    }
+
+    memset(&workers.slots[workers.count], 0, sizeof(Worker));
+    workers.slots[workers.count].pidfd = -1;
+    workers.slots[workers.count].fd = -1;
+    return workers.count++;
+}
+
+static int worker_spawn(int slot) {
+
+    Worker * worker = &workers.slots[slot];
+    WorkerPool * pool = worker->pool;
+
+    // A socket rather than pipes, so a request to a worker that just died
+    // fails with EPIPE instead of raising SIGPIPE:
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) return PIPELINES_ERR_FORK;
+
+    int env_count = 0;
+    while (pool->envp && pool->envp[env_count]) ++env_count;
+
+    char ** envp = arena_alloc(&scratch, sizeof(char *) * (env_count + 3));
+    if (envp == NULL) {
+        close(fds[0]);
+        close(fds[1]);
+        return PIPELINES_ERR_ALLOC;
+    }
+
+    // It keeps the environment it was started with, so any make it runs
+    // shares the jobserver from the start:
+    if (env_count > 0) memcpy(envp, pool->envp, sizeof(char *) * env_count);
+    envp[env_count++] = "PIPELINES_WORKER=1";
+    if (jobserver_enabled()) envp[env_count++] = (char *) jobserver_makeflags();
+    envp[env_count] = NULL;
+
+    pid_t pid = pipeline_spawn_argv(pool->workdir, pool->argv, envp, fds[1], fds[1], -1);
+    close(fds[1]);
+    if (pid < 0) {
+        close(fds[0]);
+        return pid;
+    }
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.u32 = slot };
+    worker->pidfd = pidfd_open(pid, 0);
+    if (worker->pidfd < 0 || epoll_ctl(workers.epfd, EPOLL_CTL_ADD, fds[0], &ev) < 0) {
+        kill(-pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        if (worker->pidfd >= 0) close(worker->pidfd);
+        worker->pidfd = -1;
+        close(fds[0]);
+        return PIPELINES_ERR_FORK;
+    }
+
+    worker->pid = pid;
+    worker->fd = fds[0];
+    worker->started_ns = now_ns();
+    worker->response_len = 0;
+    return 0;
+}
+
+// Collects a worker that has exited or been killed. Returns its wait status.
+static int worker_reap(Worker * worker) {
+
+    int status = 0;
+    epoll_ctl(workers.epfd, EPOLL_CTL_DEL, worker->fd, NULL);
+    close(worker->fd);
+    waitpid(worker->pid, &status, 0);
+    close(worker->pidfd);
+
+    worker->fd = -1;
+    worker->pidfd = -1;
+    worker->pid = 0;
+    worker->pipeline = NULL;
+    worker->response_len = 0;
+    return status;
+}
+
+// Asks an idle worker to exit and waits for it, with SIGKILL for one that
+// doesn't go within the usual stop timeout.
+static void worker_stop(Worker * worker) {
+
+    if (worker->pid == 0) return;
+
+    shutdown(worker->fd, SHUT_WR);
+    kill(-worker->pid, SIGTERM);
+
+    struct pollfd pfd = { .fd = worker->pidfd, .events = POLLIN };
+    if (poll(&pfd, 1, PIPELINE_STOP_TIMEOUT_MS) == 0) kill(-worker->pid, SIGKILL);
+    worker_reap(worker);
+}
+
+// Finds a worker in the pool for a run: an idle one that's running, or
+// failing that a slot to start one in. Returns -1 if the pool is busy.
+static int worker_find(WorkerPool * pool, int * start) {
+
+    int used = 0, stopped = -1;
+    for (int i = 0; i < workers.count; ++i) {
+
+        Worker * worker = &workers.slots[i];
+        if (worker->pool != pool) continue;
+
+        if (worker->pid != 0 && worker->pipeline == NULL) {
+            *start = 0;
+            return i;
+        }
+        if (worker->pid == 0 && stopped < 0) stopped = i;
+        ++used;
+    }
+
+    *start = 1;
+    if (stopped >= 0) return stopped;
+    if (used >= pool->size) return -1;
+
+    int slot = worker_slot_new();
+    if (slot >= 0) workers.slots[slot].pool = pool;
+    return slot;
+}
+
+int worker_start(Pipeline * pipeline) {
+
+    WorkerPool * pool = worker_pool_find(pipeline);
+    if (pool == NULL) return -1;
+
+    for (int i = 0; i < workers.count; ++i) {
+        if (workers.slots[i].pool == pool && workers.slots[i].pid != 0) return 0;
+    }
+
+    int start;
+    int slot = worker_find(pool, &start);
+    if (slot < 0) return -1;
+
+    int res = worker_spawn(slot);
+    if (res < 0) {
+        printf(">> Pipeline %s: unable to start worker (%s)\n", pipeline->name, pipelines_strerror(res));
+        workers.slots[slot].pool = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+int worker_available(Pipeline * pipeline) {
+
+    // Without a pool, worker_send() gets to report why:
+    WorkerPool * pool = worker_pool_find(pipeline);
+    if (pool == NULL) return 1;
+
+    int used = 0;
+    for (int i = 0; i < workers.count; ++i) {
+        Worker * worker = &workers.slots[i];
+        if (worker->pool != pool) continue;
+        if (worker->pid == 0 || worker->pipeline == NULL) return 1;
+        ++used;
+    }
+    return used < pool->size;
+}
+
+// Writes the request for a run into scratch memory. Returns its length.
+static int worker_request(Pipeline * pipeline, char ** request) {
+
+    ChangeSet * changes = &pipeline->changes;
+    int name_len = strlen(pipeline->name);
+
+    // Paths are NUL-separated in the change set:
+    int body_len = 9 + name_len + 1;
+    body_len += changes->incomplete ? 11 : 8 * changes->count + changes->strings_len;
+
+    int header_len = snprintf(NULL, 0, "run %d\n", body_len);
+    char * buf = arena_alloc(&scratch, header_len + body_len + 1);
+    if (buf == NULL) return -1;
+
+    char * at = buf + sprintf(buf, "run %d\n", body_len);
+    at += sprintf(at, "pipeline %s\n", pipeline->name);
+
+    if (changes->incomplete) {
+        at += sprintf(at, "incomplete\n");
+    } else {
+        for (int i = 0; i < changes->strings_len; i += strlen(changes->strings + i) + 1) {
+            at += sprintf(at, "changed %s\n", changes->strings + i);
+        }
+    }
+
+    *request = buf;
+    return at - buf;
+}
+
+static int worker_write(Worker * worker, char const * data, int len) {
+
+    while (len > 0) {
+        ssize_t n = send(worker->fd, data, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int worker_send(Pipeline * pipeline) {
+
+    char * request;
+    int len = worker_request(pipeline, &request);
+    WorkerPool * pool = len < 0 ? NULL : worker_pool_find(pipeline);
+    if (pool == NULL) {
+        METRIC_ADD(pipeline->metrics, spawn_failures, 1);
+        return PIPELINES_ERR_ALLOC;
+    }
+
+    // A worker may have exited since it last said anything, in which case
+    // the request fails and one more is started to take it:
+    int res = PIPELINES_ERR_FORK;
+    for (int attempt = 0; attempt < 2; ++attempt) {
+
+        int start;
+        int slot = worker_find(pool, &start);
+        if (slot < 0) break;
+
+        Worker * worker = &workers.slots[slot];
+        if (start && (res = worker_spawn(slot)) < 0) {
+            worker->pool = NULL;
+            break;
+        }
+
+        if (worker_write(worker, request, len) == 0) {
+            worker->pipeline = pipeline;
+            pipeline->worker_slot = slot;
+            pipeline->pid = worker->pid;
+            res = 0;
+            break;
+        }
+
+        res = PIPELINES_ERR_EXEC;
+        worker_reap(worker);
+    }
+
+    if (res < 0) {
+        METRIC_ADD(pipeline->metrics, spawn_failures, 1);
+        return res;
+    }
+
+    pipeline_run_started(pipeline);
+    return 0;
+}
+
+// Reads what's waiting from a worker. Returns 1 if a response is complete,
+// 0 if more is to come, -1 if the worker exited and -2 if it broke the
+// protocol. A response that was complete before the worker exited still
+// counts.
+static int worker_read(Worker * worker, int * header_len, int * status, int * body_len) {
+
+    if (worker->response == NULL) {
+        worker->response = ALLOC(WORKER_RESPONSE_MAX);
+        if (worker->response == NULL) return -1;
+    }
+
+    // A full buffer is as much as a valid response can take, so anything
+    // still waiting after it makes the response malformed:
+    int exited = 0;
+    while (worker->response_len < WORKER_RESPONSE_MAX) {
+
+        ssize_t n = recv(worker->fd, worker->response + worker->response_len,
+                         WORKER_RESPONSE_MAX - worker->response_len, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            exited = 1;
+            break;
+        }
+        worker->response_len += n;
+    }
+
+    if (worker->response_len == 0) return exited ? -1 : 0;
+
+    if (worker->pipeline == NULL) {
+        printf(">> Worker \"%s\" wrote to stdout without a request\n", worker_pool_name(worker->pool));
+        return -2;
+    }
+
+    char * newline = memchr(worker->response, '\n', worker->response_len);
+    if (newline == NULL) {
+        if (worker->response_len < WORKER_HEADER_MAX) return exited ? -1 : 0;
+
+    } else if (newline - worker->response < WORKER_HEADER_MAX) {
+        *header_len = newline - worker->response + 1;
+        *newline = '\0';
+        int matched = sscanf(worker->response, "done %d %d", status, body_len);
+        *newline = '\n';
+
+        if (matched == 2 && *body_len >= 0 && *body_len <= WORKER_BODY_MAX) {
+            int end = *header_len + *body_len;
+            if (worker->response_len == end) return 1;
+            if (worker->response_len < end) return exited ? -1 : 0;
+        }
+    }
+
+    printf(">> Pipeline %s: worker sent a malformed response\n", worker->pipeline->name);
+    return -2;
+}
+
+int worker_drain(WorkerResult * results, int max) {
+
+    struct epoll_event events[64];
+    if (max > 64) max = 64;
+
+    int n = epoll_wait(workers.epfd, events, max, 0);
+    int count = 0;
+
+    for (int i = 0; i < n; ++i) {
+
+        Worker * worker = &workers.slots[events[i].data.u32];
+        if (worker->pid == 0) continue;
+
+        int header_len, status, body_len;
+        int res = worker_read(worker, &header_len, &status, &body_len);
+        if (res == 0) continue;
+
+        Pipeline * pipeline = worker->pipeline;
+        if (res > 0) {
+            output_write(pipeline, worker->response + header_len, body_len);
+            worker->response_len = 0;
+            worker->pipeline = NULL;
+            pipeline->worker_slot = -1;
+            results[count++] = (WorkerResult) { .pipeline = pipeline, .exited = 1, .status = status };
+            continue;
+        }
+
+        // It exited, or has to go. Either way the run it had is over:
+        if (res == -2) kill(-worker->pid, SIGKILL);
+        int restart = now_ns() - worker->started_ns >= WORKER_MIN_UPTIME_NS;
+        int wstatus = worker_reap(worker);
+
+        if (pipeline == NULL) {
+            printf(">> Worker \"%s\" exited%s\n", worker_pool_name(worker->pool), restart ? ", restarting it" : "");
+        } else {
+            if (res == -1 && pipeline->stop_deadline_ns == 0) printf(">> Pipeline %s: worker exited mid-run\n", pipeline->name);
+            pipeline->worker_slot = -1;
+            results[count++] = (WorkerResult) {
+                .pipeline = pipeline,
+                .exited = WIFEXITED(wstatus),
+                .status = WIFEXITED(wstatus) && WEXITSTATUS(wstatus) != 0 ? WEXITSTATUS(wstatus) : 1
+            };
+        }
+
+        // Runs needing it will start it again otherwise:
+        if (restart) {
+            int slot = worker - workers.slots;
+            int err = worker_spawn(slot);
+            if (err < 0) printf(">> Unable to restart worker \"%s\" (%s)\n", worker_pool_name(worker->pool), pipelines_strerror(err));
+        }
+    }
+
+    return count;
+}
+
+void worker_move(Pipeline * pipeline) {
+    if (pipeline->worker_slot >= 0) workers.slots[pipeline->worker_slot].pipeline = pipeline;
+}
+
+void worker_kill(Pipeline * pipeline) {
+
+    Worker * worker = &workers.slots[pipeline->worker_slot];
+
+    struct pollfd pfd = { .fd = worker->pidfd, .events = POLLIN };
+    while (poll(&pfd, 1, pipeline_supervise_run(pipeline)) == 0);
+
+    worker_reap(worker);
+    pipeline->worker_slot = -1;
+}
+
+static void worker_pool_free(WorkerPool * pool) {
+    FREE(pool->workdir);
+    str_list_free(pool->argv);
+    str_list_free(pool->envp);
+    FREE(pool);
+}
+
+void worker_prune(Pipeline * pipelines) {
+
+    WorkerPool ** link = &workers.pools;
+    while (*link != NULL) {
+
+        WorkerPool * pool = *link;
+        int used = 0;
+
+        for (Pipeline * pipeline = pipelines; pipeline->valid && !used; ++pipeline) {
+            used = pipeline->worker && worker_pool_matches(pool, pipeline);
+        }
+        for (int i = 0; i < workers.count && !used; ++i) {
+            used = workers.slots[i].pool == pool && workers.slots[i].pipeline != NULL;
+        }
+
+        if (used) {
+            link = &pool->next;
+            continue;
+        }
+
+        for (int i = 0; i < workers.count; ++i) {
+            if (workers.slots[i].pool != pool) continue;
+            worker_stop(&workers.slots[i]);
+            workers.slots[i].pool = NULL;
+        }
+
+        *link = pool->next;
+        worker_pool_free(pool);
+    }
+}
+
+void worker_close() {
+
+    for (int i = 0; i < workers.count; ++i) {
+        worker_stop(&workers.slots[i]);
+        FREE(workers.slots[i].response);
+    }
+
+    while (workers.pools != NULL) {
+        WorkerPool * pool = workers.pools;
+        workers.pools = pool->next;
+        worker_pool_free(pool);
+    }
+
+    FREE(workers.slots);
+    if (workers.epfd >= 0) close(workers.epfd);
+    memset(&workers, 0, sizeof(workers));
+    workers.epfd = -1;
+}
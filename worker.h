@@ -0,0 +1,72 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "pipelines.h"
+
+// Persistent workers, for commands that take much longer to start than to do
+// their work. A pipeline with "worker: true" starts cmd once and keeps it
+// running, then hands it each run as a request, so a run costs a round trip
+// rather than a process launch. Pipelines with the same cmd, workdir and env
+// share a pool of up to worker_pool workers. A worker that exits is started
+// again, straight away if it had been up for a while, or otherwise when a run
+// next needs it. Only the epoll engine runs workers.
+//
+// A worker is started with PIPELINES_WORKER=1 in its environment, and with
+// stdin and stdout both connected to pipelines (stderr goes to the terminal).
+// Each request and response is a header line giving the length of the body
+// that follows it:
+//
+//   run <length>\n
+//   pipeline <name>\n          The pipeline the run is for
+//   changed <path>\n           One line for each changed path, or instead
+//   incomplete\n               if every path should be assumed changed
+//
+//   done <status> <length>\n
+//   <output>                   Shown and logged as a command's output would be
+//
+// A status of 0 is a success. A worker gets one request at a time and
+// shouldn't write anything else to stdout. One that breaks the protocol is
+// killed and restarted, as is one stopped by on_change: restart. Closing its
+// stdin asks it to exit.
+
+// Starts polling for responses. Returns a descriptor for the caller's event
+// loop to wait on, or -1.
+int worker_open();
+
+// Makes sure a worker is running for the pipeline, so its first run doesn't
+// pay for the start.
+int worker_start(Pipeline * pipeline);
+
+// Returns 1 if a worker is free to take a run of the pipeline now.
+int worker_available(Pipeline * pipeline);
+
+// Sends the pipeline's pending changes to a worker as a run, as
+// pipeline_spawn() does for a command. pipeline->pid is set to the worker's
+// pid until the run is over. Returns 0, or a PIPELINES_ERROR.
+int worker_send(Pipeline * pipeline);
+
+typedef struct {
+    Pipeline * pipeline;
+    int exited;         // 0 if the worker was killed before it responded
+    int status;         // The status it sent back, or non-zero if it exited instead
+} WorkerResult;
+
+// Reads whatever responses have arrived. Returns the number of runs that
+// finished, up to max, with their results in results.
+int worker_drain(WorkerResult * results, int max);
+
+// Points a running request at a pipeline whose state was moved into it from
+// another (see pipeline_move_state()).
+void worker_move(Pipeline * pipeline);
+
+// Waits for the worker handling a pipeline's run to exit, once it's been
+// told to stop (see pipeline_stop_run()).
+void worker_kill(Pipeline * pipeline);
+
+// Stops the workers no pipeline uses any more, after the Pipefile changed.
+void worker_prune(Pipeline * pipelines);
+
+// Stops every worker.
+void worker_close();
+
+#endif // WORKER_H